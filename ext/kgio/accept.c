@@ -15,7 +15,9 @@ static int accept4_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
 #endif /* ! linux */
 
 struct accept_args {
+	VALUE io;
 	int fd;
+	int flags; /* accept4_flags when the call was made */
 	struct sockaddr *addr;
 	socklen_t *addrlen;
 };
@@ -48,10 +50,63 @@ static VALUE xaccept(void *ptr)
 {
 	struct accept_args *a = ptr;
 
-	return (VALUE)accept4(a->fd, a->addr, a->addrlen, accept4_flags);
+	return (VALUE)accept4(a->fd, a->addr, a->addrlen, a->flags);
 }
 
-#ifdef HAVE_RB_THREAD_BLOCKING_REGION
+/* clients accepted per GVL release by kgio_tryaccept_many */
+#define ACCEPT_BATCH 64
+
+struct accept_many_args {
+	VALUE rv; /* Array of wrapped clients */
+	int fd;
+	int flags; /* accept4_flags when the batch was started */
+	int tcp; /* record peer addresses in addrs */
+	int max; /* <= ACCEPT_BATCH */
+	int nr; /* descriptors in clients */
+	int wrapped; /* descriptors already in rv */
+	int err; /* errno which ended the batch, zero if max was reached */
+	int clients[ACCEPT_BATCH];
+	union kgio_sockaddr addrs[ACCEPT_BATCH];
+};
+
+/*
+ * accepts up to m->max clients from the non-blocking listener without
+ * touching any Ruby objects, so it may run without the GVL
+ */
+static VALUE xaccept_many(void *ptr)
+{
+	struct accept_many_args *m = ptr;
+	struct sockaddr *addr = NULL;
+	socklen_t addrlen, *lenp = NULL;
+	int client;
+
+	while (m->nr < m->max) {
+		if (m->tcp) {
+			addr = &m->addrs[m->nr].sa;
+			addrlen = sizeof(union kgio_sockaddr);
+			lenp = &addrlen;
+		}
+		client = accept4(m->fd, addr, lenp, m->flags);
+		if (client >= 0) {
+			m->clients[m->nr++] = client;
+			continue;
+		}
+		switch (errno) {
+#ifdef ECONNABORTED
+		case ECONNABORTED:
+#endif /* ECONNABORTED */
+#ifdef EPROTO
+		case EPROTO:
+#endif /* EPROTO */
+			continue;
+		}
+		m->err = errno;
+		break;
+	}
+	return Qnil;
+}
+
+#ifdef KGIO_WITHOUT_GVL
 #  include <time.h>
 /*
  * Try to use a (real) blocking accept() since that can prevent
@@ -66,7 +121,12 @@ static int thread_accept(struct accept_args *a, int force_nonblock)
 {
 	if (force_nonblock)
 		set_nonblocking(a->fd);
-	return (int)rb_thread_blocking_region(xaccept, a, RUBY_UBF_IO, 0);
+	return (int)kgio_without_gvl(xaccept, a);
+}
+
+static void thread_accept_many(struct accept_many_args *m)
+{
+	(void)kgio_without_gvl(xaccept_many, m);
 }
 
 static void set_blocking_or_block(int fd)
@@ -81,6 +141,7 @@ static void set_blocking_or_block(int fd)
 		(void)rb_io_wait_readable(fd);
 	} else {
 		int flags = fcntl(fd, F_GETFL);
+
 		if (flags == -1)
 			rb_sys_fail("fcntl(F_GETFL)");
 		if (flags & O_NONBLOCK) {
@@ -91,7 +152,7 @@ static void set_blocking_or_block(int fd)
 		last_set_blocking = now;
 	}
 }
-#else /* ! HAVE_RB_THREAD_BLOCKING_REGION */
+#else /* ! KGIO_WITHOUT_GVL */
 #  include <rubysig.h>
 static int thread_accept(struct accept_args *a, int force_nonblock)
 {
@@ -104,26 +165,56 @@ static int thread_accept(struct accept_args *a, int force_nonblock)
 	TRAP_END;
 	return rv;
 }
+
+static void thread_accept_many(struct accept_many_args *m)
+{
+	TRAP_BEG;
+	(void)xaccept_many(m);
+	TRAP_END;
+}
 #define set_blocking_or_block(fd) (void)rb_io_wait_readable(fd)
-#endif /* ! HAVE_RB_THREAD_BLOCKING_REGION */
+#endif /* ! KGIO_WITHOUT_GVL */
+
+/* +flags+ are the accept4(2) flags +client+ was accepted with */
+static VALUE new_client(int client, int flags)
+{
+	VALUE rv = sock_for_fd(cClientSocket, client);
 
-static VALUE
-my_accept(VALUE io, struct sockaddr *addr, socklen_t *addrlen, int nonblock)
+	kgio_fd_init(rv, (flags & SOCK_NONBLOCK) ?
+	                 KGIO_FD_STREAM | KGIO_FD_NONBLOCK : KGIO_FD_STREAM);
+	return rv;
+}
+
+/*
+ * +deadline+ is from kgio_deadline(), a blocking accept with a deadline
+ * (or a kgio_timeout on +io+) waits with poll(2) instead of accept(2).
+ * So does one under a Fiber scheduler, to let other Fibers run.
+ */
+static VALUE my_accept(VALUE io, struct sockaddr *addr, socklen_t *addrlen,
+                       int nonblock, double deadline)
 {
 	int client;
 	struct accept_args a;
+	int timed = !nonblock &&
+	            (deadline != 0 || !NIL_P(kgio_default_timeout(io)) ||
+	             kgio_fiber_scheduled());
 
+	a.io = io;
 	a.fd = my_fileno(io);
 	a.addr = addr;
 	a.addrlen = addrlen;
+	a.flags = accept4_flags;
 retry:
-	client = thread_accept(&a, nonblock);
+	client = thread_accept(&a, nonblock || timed);
 	if (client == -1) {
 		switch (errno) {
 		case EAGAIN:
 			if (nonblock)
 				return Qnil;
-			set_blocking_or_block(a.fd);
+			if (timed)
+				kgio_wait_readable_until(io, a.fd, deadline);
+			else
+				set_blocking_or_block(a.fd);
 #ifdef ECONNABORTED
 		case ECONNABORTED:
 #endif /* ECONNABORTED */
@@ -140,7 +231,7 @@ retry:
 #endif /* ENOBUFS */
 			errno = 0;
 			rb_gc();
-			client = thread_accept(&a, nonblock);
+			client = thread_accept(&a, nonblock || timed);
 		}
 		if (client == -1) {
 			if (errno == EINTR)
@@ -148,20 +239,122 @@ retry:
 			rb_sys_fail("accept");
 		}
 	}
-	return sock_for_fd(cClientSocket, client);
+	return new_client(client, a.flags);
+}
+
+/* kgio_addr is only converted to a String when first used */
+static void addr_set(VALUE io, const struct sockaddr *addr)
+{
+	if (!addr || !kgio_peer_set(io, addr))
+		rb_ivar_set(io, iv_kgio_addr, localhost);
+}
+
+/* wraps each client accepted by xaccept_many into m->rv */
+static VALUE wrap_many(VALUE ptr)
+{
+	struct accept_many_args *m = (struct accept_many_args *)ptr;
+
+	while (m->wrapped < m->nr) {
+		int i = m->wrapped;
+		VALUE client = new_client(m->clients[i], m->flags);
+
+		m->wrapped++;
+		if (m->tcp)
+			addr_set(client, &m->addrs[i].sa);
+		else
+			rb_ivar_set(client, iv_kgio_addr, localhost);
+		rb_ary_push(m->rv, client);
+	}
+	return Qnil;
+}
+
+/* do not leak descriptors if wrapping one of them raised */
+static VALUE close_unwrapped(VALUE ptr)
+{
+	struct accept_many_args *m = (struct accept_many_args *)ptr;
+
+	while (m->wrapped < m->nr)
+		(void)close(m->clients[m->wrapped++]);
+	return Qnil;
+}
+
+static VALUE my_accept_many(VALUE io, VALUE max, int tcp)
+{
+	struct accept_many_args m;
+	long left = NUM2LONG(max);
+	int gc_retried = 0;
+
+	if (left < 0)
+		rb_raise(rb_eArgError, "negative max: %ld", left);
+	m.rv = rb_ary_new();
+	m.fd = my_fileno(io);
+	m.tcp = tcp;
+	m.flags = accept4_flags;
+	while (left > 0) {
+		m.max = left > ACCEPT_BATCH ? ACCEPT_BATCH : (int)left;
+		m.nr = m.wrapped = m.err = 0;
+
+		/* other processes sharing the listener may have cleared it */
+		set_nonblocking(m.fd);
+		thread_accept_many(&m);
+		rb_ensure(wrap_many, (VALUE)&m, close_unwrapped, (VALUE)&m);
+		left -= m.nr;
+		switch (m.err) {
+		case 0:
+		case EINTR:
+			continue;
+		case EAGAIN:
+			return m.rv;
+		case ENOMEM:
+		case EMFILE:
+		case ENFILE:
+#ifdef ENOBUFS
+		case ENOBUFS:
+#endif /* ENOBUFS */
+			if (RARRAY_LEN(m.rv) == 0 && !gc_retried) {
+				gc_retried = 1;
+				rb_gc();
+				continue;
+			}
+		}
+		/* hand over what we have, the error will recur next call */
+		if (RARRAY_LEN(m.rv) > 0)
+			return m.rv;
+		errno = m.err;
+		rb_sys_fail("accept");
+	}
+	return m.rv;
 }
 
-static void in_addr_set(VALUE io, struct sockaddr_in *addr)
+/* flags for accept4(2) on behalf of other modules (e.g. Kgio::Ring) */
+int kgio_accept4_flags(void)
 {
-	VALUE host = rb_str_new(0, INET_ADDRSTRLEN);
-	socklen_t addrlen = (socklen_t)INET_ADDRSTRLEN;
-	const char *name;
+	return accept4_flags;
+}
 
-	name = inet_ntop(AF_INET, &addr->sin_addr, RSTRING_PTR(host), addrlen);
-	if (name == NULL)
-		rb_sys_fail("inet_ntop");
-	rb_str_set_len(host, strlen(name));
-	rb_ivar_set(io, iv_kgio_addr, host);
+static VALUE wrap_accepted(VALUE ptr)
+{
+	return new_client(*(int *)ptr, 0);
+}
+
+/*
+ * wraps a descriptor accepted elsewhere (e.g. by Kgio::Ring) the same
+ * way kgio_accept does, +addr+ is the peer address if known.  The flags
+ * it was accepted with are unknown, so O_NONBLOCK is not assumed.
+ * +client+ is closed if it cannot be wrapped, once wrapped it belongs
+ * to the returned IO.
+ */
+VALUE kgio_accepted(int client, const struct sockaddr *addr)
+{
+	int state = 0;
+	VALUE rv = rb_protect(wrap_accepted, (VALUE)&client, &state);
+
+	if (state) {
+		(void)close(client);
+		rb_jump_tag(state);
+	}
+	addr_set(rv, addr);
+	return rv;
 }
 
 /*
@@ -178,12 +371,12 @@ static void in_addr_set(VALUE io, struct sockaddr_in *addr)
  */
 static VALUE tcp_tryaccept(VALUE io)
 {
-	struct sockaddr_in addr;
-	socklen_t addrlen = sizeof(struct sockaddr_in);
-	VALUE rv = my_accept(io, (struct sockaddr *)&addr, &addrlen, 1);
+	union kgio_sockaddr addr;
+	socklen_t addrlen = sizeof(addr);
+	VALUE rv = my_accept(io, &addr.sa, &addrlen, 1, 0);
 
 	if (!NIL_P(rv))
-		in_addr_set(rv, &addr);
+		addr_set(rv, &addr.sa);
 	return rv;
 }
 
@@ -192,6 +385,7 @@ static VALUE tcp_tryaccept(VALUE io)
  *
  *	server = Kgio::TCPServer.new('0.0.0.0', 80)
  *	server.kgio_accept -> Kgio::Socket or nil
+ *	server.kgio_accept(timeout) -> Kgio::Socket or nil
  *
  * Initiates a blocking accept and returns a generic Kgio::Socket
  * object with the kgio_addr attribute set to the IP address of
@@ -199,17 +393,48 @@ static VALUE tcp_tryaccept(VALUE io)
  *
  * On Ruby implementations using native threads, this can use a blocking
  * accept(2) (or accept4(2)) system call to avoid thundering herds.
+ *
+ * Raises Kgio::Timeout (without a backtrace) if no client connects
+ * within +timeout+ seconds, or within the kgio_timeout of the server
+ * if +timeout+ is nil.
  */
-static VALUE tcp_accept(VALUE io)
+static VALUE tcp_accept(int argc, VALUE *argv, VALUE io)
 {
-	struct sockaddr_in addr;
-	socklen_t addrlen = sizeof(struct sockaddr_in);
-	VALUE rv = my_accept(io, (struct sockaddr *)&addr, &addrlen, 0);
+	union kgio_sockaddr addr;
+	socklen_t addrlen = sizeof(addr);
+	VALUE timeout, rv;
 
-	in_addr_set(rv, &addr);
+	rb_scan_args(argc, argv, "01", &timeout);
+	rv = my_accept(io, &addr.sa, &addrlen, 0, kgio_deadline(timeout));
+
+	addr_set(rv, &addr.sa);
 	return rv;
 }
 
+/*
+ * call-seq:
+ *
+ *	server = Kgio::TCPServer.new('0.0.0.0', 80)
+ *	server.kgio_tryaccept_many(max) -> Array
+ *
+ * Accepts up to +max+ pending clients with non-blocking accepts and
+ * returns them in an Array, which is empty if none were pending.  Each
+ * is set up the same way as one returned by kgio_tryaccept.
+ *
+ * This is cheaper than calling kgio_tryaccept in a loop to drain the
+ * listen queue after a burst of connections: accept(2) is called
+ * repeatedly without the GVL, which is only released once for every
+ * 64 clients.
+ *
+ * Errors are raised only if no client was accepted, otherwise the
+ * clients accepted so far are returned and the error is left to
+ * recur on the next call.
+ */
+static VALUE tcp_tryaccept_many(VALUE io, VALUE max)
+{
+	return my_accept_many(io, max, 1);
+}
+
 /*
  * call-seq:
  *
@@ -224,7 +449,7 @@ static VALUE tcp_accept(VALUE io)
  */
 static VALUE unix_tryaccept(VALUE io)
 {
-	VALUE rv = my_accept(io, NULL, NULL, 1);
+	VALUE rv = my_accept(io, NULL, NULL, 1, 0);
 
 	if (!NIL_P(rv))
 		rb_ivar_set(rv, iv_kgio_addr, localhost);
@@ -236,6 +461,7 @@ static VALUE unix_tryaccept(VALUE io)
  *
  *	server = Kgio::UNIXServer.new("/path/to/unix/socket")
  *	server.kgio_accept -> Kgio::Socket or nil
+ *	server.kgio_accept(timeout) -> Kgio::Socket or nil
  *
  * Initiates a blocking accept and returns a generic Kgio::Socket
  * object with the kgio_addr attribute set (to the value of
@@ -243,15 +469,162 @@ static VALUE unix_tryaccept(VALUE io)
  *
  * On Ruby implementations using native threads, this can use a blocking
  * accept(2) (or accept4(2)) system call to avoid thundering herds.
+ *
+ * Raises Kgio::Timeout (without a backtrace) if no client connects
+ * within +timeout+ seconds, or within the kgio_timeout of the server
+ * if +timeout+ is nil.
  */
-static VALUE unix_accept(VALUE io)
+static VALUE unix_accept(int argc, VALUE *argv, VALUE io)
 {
-	VALUE rv = my_accept(io, NULL, NULL, 0);
+	VALUE timeout, rv;
+
+	rb_scan_args(argc, argv, "01", &timeout);
+	rv = my_accept(io, NULL, NULL, 0, kgio_deadline(timeout));
 
 	rb_ivar_set(rv, iv_kgio_addr, localhost);
 	return rv;
 }
 
+/*
+ * call-seq:
+ *
+ *	server = Kgio::UNIXServer.new("/path/to/unix/socket")
+ *	server.kgio_tryaccept_many(max) -> Array
+ *
+ * Accepts up to +max+ pending clients and returns them in an Array,
+ * see Kgio::TCPServer#kgio_tryaccept_many.  The kgio_addr attribute
+ * of each is set to Kgio::LOCALHOST.
+ */
+static VALUE unix_tryaccept_many(VALUE io, VALUE max)
+{
+	return my_accept_many(io, max, 0);
+}
+
+struct accept_read_args {
+	VALUE client;
+	VALUE length;
+	VALUE buf;
+};
+
+static VALUE first_read(VALUE ptr)
+{
+	struct accept_read_args *r = (struct accept_read_args *)ptr;
+
+	return kgio_tryrecv_buf(r->client, r->length, r->buf);
+}
+
+/*
+ * reads whatever the new +client+ already sent, closing it if that
+ * raises so a reset connection does not linger until GC
+ */
+static VALUE accept_read(VALUE client, VALUE length, VALUE buf)
+{
+	struct accept_read_args r;
+	int state = 0;
+	VALUE data;
+
+	if (NIL_P(client))
+		return Qnil;
+	r.client = client;
+	r.length = length;
+	r.buf = buf;
+	data = rb_protect(first_read, (VALUE)&r, &state);
+	if (state) {
+		rb_funcall(client, rb_intern("close"), 0);
+		rb_jump_tag(state);
+	}
+	return rb_assoc_new(client, data);
+}
+
+/* bad arguments must not cost us a connection */
+static void check_length(VALUE length)
+{
+	if (NUM2LONG(length) < 0)
+		rb_raise(rb_eArgError, "negative length %ld given",
+		         NUM2LONG(length));
+}
+
+/*
+ * call-seq:
+ *
+ *	server.kgio_tryaccept_read(maxlen) -> [ client, data ] or nil
+ *	server.kgio_tryaccept_read(maxlen, buffer) -> [ client, data ] or nil
+ *
+ * Like kgio_tryaccept, but also reads up to +maxlen+ bytes the client
+ * has already sent, in the same call.  +data+ is what
+ * client.kgio_tryread(maxlen, buffer) would return: a String,
+ * Kgio::WaitReadable if nothing has arrived yet, or nil on EOF.
+ *
+ * Most useful with Kgio::TCPServer#kgio_defer_accept, which keeps
+ * clients in the kernel until they send data, so new connections do
+ * not need a trip through the event loop before their first read.
+ *
+ * Returns nil if no client was pending.
+ */
+static VALUE tcp_tryaccept_read(int argc, VALUE *argv, VALUE io)
+{
+	VALUE length, buf;
+
+	rb_scan_args(argc, argv, "11", &length, &buf);
+	check_length(length);
+	return accept_read(tcp_tryaccept(io), length, buf);
+}
+
+/*
+ * call-seq:
+ *
+ *	server.kgio_accept_read(maxlen) -> [ client, data ]
+ *	server.kgio_accept_read(maxlen, buffer) -> [ client, data ]
+ *	server.kgio_accept_read(maxlen, buffer, timeout) -> [ client, data ]
+ *
+ * Like kgio_accept, but also reads up to +maxlen+ bytes the client
+ * has already sent, see Kgio::TCPServer#kgio_tryaccept_read.  Only the
+ * accept may block (or time out), the read never waits.
+ */
+static VALUE tcp_accept_read(int argc, VALUE *argv, VALUE io)
+{
+	VALUE length, buf, timeout;
+
+	rb_scan_args(argc, argv, "12", &length, &buf, &timeout);
+	check_length(length);
+	return accept_read(tcp_accept(1, &timeout, io), length, buf);
+}
+
+/*
+ * call-seq:
+ *
+ *	server.kgio_tryaccept_read(maxlen) -> [ client, data ] or nil
+ *	server.kgio_tryaccept_read(maxlen, buffer) -> [ client, data ] or nil
+ *
+ * Same as Kgio::TCPServer#kgio_tryaccept_read, for UNIX domain sockets.
+ */
+static VALUE unix_tryaccept_read(int argc, VALUE *argv, VALUE io)
+{
+	VALUE length, buf;
+
+	rb_scan_args(argc, argv, "11", &length, &buf);
+	check_length(length);
+	return accept_read(unix_tryaccept(io), length, buf);
+}
+
+/*
+ * call-seq:
+ *
+ *	server.kgio_accept_read(maxlen) -> [ client, data ]
+ *	server.kgio_accept_read(maxlen, buffer) -> [ client, data ]
+ *	server.kgio_accept_read(maxlen, buffer, timeout) -> [ client, data ]
+ *
+ * Same as Kgio::TCPServer#kgio_accept_read, for UNIX domain sockets.
+ */
+static VALUE unix_accept_read(int argc, VALUE *argv, VALUE io)
+{
+	VALUE length, buf, timeout;
+
+	rb_scan_args(argc, argv, "12", &length, &buf, &timeout);
+	check_length(length);
+	return accept_read(unix_accept(1, &timeout, io), length, buf);
+}
+
 /*
  * call-seq:
  *
@@ -361,12 +734,24 @@ void init_kgio_accept(void)
 	cUNIXServer = rb_const_get(rb_cObject, rb_intern("UNIXServer"));
 	cUNIXServer = rb_define_class_under(mKgio, "UNIXServer", cUNIXServer);
 	rb_define_method(cUNIXServer, "kgio_tryaccept", unix_tryaccept, 0);
-	rb_define_method(cUNIXServer, "kgio_accept", unix_accept, 0);
+	rb_define_method(cUNIXServer, "kgio_accept", unix_accept, -1);
+	rb_define_method(cUNIXServer, "kgio_tryaccept_many",
+	                 unix_tryaccept_many, 1);
+	rb_define_method(cUNIXServer, "kgio_tryaccept_read",
+	                 unix_tryaccept_read, -1);
+	rb_define_method(cUNIXServer, "kgio_accept_read", unix_accept_read, -1);
+	kgio_define_timeout(cUNIXServer);
 
 	cTCPServer = rb_const_get(rb_cObject, rb_intern("TCPServer"));
 	cTCPServer = rb_define_class_under(mKgio, "TCPServer", cTCPServer);
 	rb_define_method(cTCPServer, "kgio_tryaccept", tcp_tryaccept, 0);
-	rb_define_method(cTCPServer, "kgio_accept", tcp_accept, 0);
+	rb_define_method(cTCPServer, "kgio_accept", tcp_accept, -1);
+	rb_define_method(cTCPServer, "kgio_tryaccept_many",
+	                 tcp_tryaccept_many, 1);
+	rb_define_method(cTCPServer, "kgio_tryaccept_read",
+	                 tcp_tryaccept_read, -1);
+	rb_define_method(cTCPServer, "kgio_accept_read", tcp_accept_read, -1);
+	kgio_define_timeout(cTCPServer);
 	init_sock_for_fd();
 	iv_kgio_addr = rb_intern("@kgio_addr");
 }
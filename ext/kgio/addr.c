@@ -0,0 +1,169 @@
+#include "kgio.h"
+
+/*
+ * Most accepted clients never have their kgio_addr looked at, so
+ * accept only records the peer address in a hidden ivar and the
+ * String is made on first access to kgio_addr.  An IO has nowhere
+ * else to keep it, so each accept still sets that one ivar.  IPv4
+ * addresses are stored as an Integer, which is an immediate on 64-bit
+ * Rubies but may be a Bignum on 32-bit ones.  IPv6 addresses are
+ * stored as their 16 raw bytes in a String, which is allocated.
+ *
+ * Recently formatted addresses are kept as frozen Strings in a small
+ * direct-mapped cache, so clients which reconnect skip inet_ntop(3).
+ * Each socket gets its own copy (sharing the frozen String's memory)
+ * so callers may still modify what kgio_addr returns.
+ */
+#define ADDR_CACHE_SIZE 64 /* power-of-two */
+
+struct addr_key {
+	int family; /* zero for an empty slot */
+	unsigned char bytes[16];
+};
+
+static struct addr_key cache_keys[ADDR_CACHE_SIZE];
+static VALUE cache_strs; /* Array, parallel to cache_keys */
+static ID id_peer, iv_kgio_addr;
+
+/*
+ * stores the peer address of io for kgio_addr to convert later,
+ * returns zero (storing nothing) if addr is not an IP address
+ */
+int kgio_peer_set(VALUE io, const struct sockaddr *addr)
+{
+	const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+	VALUE raw;
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		raw = ULONG2NUM((unsigned long)ntohl(in->sin_addr.s_addr));
+		break;
+#ifdef AF_INET6
+	case AF_INET6: {
+		const struct sockaddr_in6 *in6;
+		const unsigned char *b;
+
+		in6 = (const struct sockaddr_in6 *)addr;
+		b = in6->sin6_addr.s6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+			raw = ULONG2NUM(((unsigned long)b[12] << 24) |
+			                ((unsigned long)b[13] << 16) |
+			                ((unsigned long)b[14] << 8) |
+			                (unsigned long)b[15]);
+		} else {
+			raw = rb_str_new((const char *)b, 16);
+		}
+		break;
+	}
+#endif /* AF_INET6 */
+	default:
+		return 0;
+	}
+	rb_ivar_set(io, id_peer, raw);
+	return 1;
+}
+
+/*
+ * fills +addr+ from a numeric IPv4 or IPv6 address String and a port,
+ * returns the length of the address.  No DNS lookups are done.
+ */
+socklen_t kgio_inet_addr(union kgio_sockaddr *addr, VALUE ip, VALUE port)
+{
+	const char *host = StringValuePtr(ip);
+	unsigned short p = htons((unsigned short)NUM2INT(port));
+
+	memset(addr, 0, sizeof(*addr));
+	if (inet_pton(AF_INET, host, &addr->in.sin_addr) == 1) {
+		addr->in.sin_family = AF_INET;
+		addr->in.sin_port = p;
+		return (socklen_t)sizeof(struct sockaddr_in);
+	}
+#ifdef AF_INET6
+	if (inet_pton(AF_INET6, host, &addr->in6.sin6_addr) == 1) {
+		addr->in6.sin6_family = AF_INET6;
+		addr->in6.sin6_port = p;
+		return (socklen_t)sizeof(struct sockaddr_in6);
+	}
+#endif /* AF_INET6 */
+	rb_raise(rb_eArgError, "invalid address: %s", host);
+	return 0;
+}
+
+static unsigned long hash_key(const struct addr_key *k)
+{
+	unsigned long h = 5381;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		h = h * 33 + k->bytes[i];
+	return h;
+}
+
+static VALUE addr_str(VALUE raw)
+{
+	struct addr_key k;
+	char buf[INET6_ADDRSTRLEN];
+	unsigned long h;
+	VALUE str;
+
+	memset(&k, 0, sizeof(k));
+	if (TYPE(raw) == T_STRING) {
+		k.family = AF_INET6;
+		memcpy(k.bytes, RSTRING_PTR(raw), 16);
+	} else {
+		uint32_t a = htonl((uint32_t)NUM2ULONG(raw));
+
+		k.family = AF_INET;
+		memcpy(k.bytes, &a, sizeof(a));
+	}
+	h = hash_key(&k) & (ADDR_CACHE_SIZE - 1);
+	if (memcmp(&cache_keys[h], &k, sizeof(k)) == 0)
+		return rb_ary_entry(cache_strs, (long)h);
+
+	if (!inet_ntop(k.family, k.bytes, buf, sizeof(buf)))
+		rb_sys_fail("inet_ntop");
+	str = rb_obj_freeze(rb_str_new2(buf));
+	rb_ary_store(cache_strs, (long)h, str);
+	cache_keys[h] = k;
+	return str;
+}
+
+/*
+ * call-seq:
+ *
+ *	socket.kgio_addr	-> String or nil
+ *
+ * Returns the IP address of the client for sockets returned by
+ * kgio_accept and kgio_tryaccept (Kgio::LOCALHOST for UNIX domain
+ * sockets), or whatever was assigned with kgio_addr=.  IPv4-mapped
+ * IPv6 clients are reported with their IPv4 address.
+ *
+ * The String is created the first time this is called.
+ */
+static VALUE kgio_addr(VALUE io)
+{
+	VALUE addr = rb_attr_get(io, iv_kgio_addr);
+
+	if (NIL_P(addr)) {
+		VALUE raw = rb_attr_get(io, id_peer);
+
+		if (!NIL_P(raw)) {
+			addr = rb_str_dup(addr_str(raw));
+			rb_ivar_set(io, iv_kgio_addr, addr);
+		}
+	}
+	return addr;
+}
+
+void init_kgio_addr(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE mSocketMethods = rb_define_module_under(mKgio, "SocketMethods");
+
+	id_peer = rb_intern("kgio_peer");
+	iv_kgio_addr = rb_intern("@kgio_addr");
+	cache_strs = rb_ary_new2(ADDR_CACHE_SIZE);
+	rb_global_variable(&cache_strs);
+	rb_define_method(mSocketMethods, "kgio_addr", kgio_addr, 0);
+	rb_define_attr(mSocketMethods, "kgio_addr", 0, 1);
+}
@@ -0,0 +1,223 @@
+#include "kgio.h"
+#ifdef HAVE_RUBY_ENCODING_H
+#  include <ruby/encoding.h>
+#endif
+
+/*
+ * buffers are grouped into power-of-two size classes from 4K to 1M,
+ * smaller reads still get a 4K buffer since anything smaller may be
+ * embedded in the object slot and is cheap to allocate anyways
+ */
+#define POOL_MIN_SHIFT 12
+#define POOL_MAX_SHIFT 20
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_DEFAULT_MAX (4 * 1024 * 1024)
+
+#ifdef HAVE_RB_STR_CAPACITY
+#  define buf_capa(str) ((long)rb_str_capacity(str))
+#else
+#  define buf_capa(str) RSTRING_LEN(str) /* conservative */
+#endif
+
+struct kgio_pool {
+	VALUE free[POOL_CLASSES]; /* Arrays of idle Strings */
+	long bytes; /* total capacity of idle Strings */
+	long max_bytes;
+};
+
+static void pool_mark(void *ptr)
+{
+	struct kgio_pool *p = ptr;
+	int i;
+
+	for (i = 0; i < POOL_CLASSES; i++)
+		rb_gc_mark(p->free[i]);
+}
+
+static VALUE pool_alloc(VALUE klass)
+{
+	struct kgio_pool *p;
+	VALUE self = Data_Make_Struct(klass, struct kgio_pool,
+	                              pool_mark, -1, p);
+	int i;
+
+	for (i = 0; i < POOL_CLASSES; i++)
+		p->free[i] = rb_ary_new();
+	p->max_bytes = POOL_DEFAULT_MAX;
+	return self;
+}
+
+static struct kgio_pool *pool_of(VALUE self)
+{
+	struct kgio_pool *p;
+
+	Data_Get_Struct(self, struct kgio_pool, p);
+	return p;
+}
+
+int kgio_is_pool(VALUE obj)
+{
+	return TYPE(obj) == T_DATA && RDATA(obj)->dmark == pool_mark;
+}
+
+static long class_size(int c)
+{
+	return 1L << (c + POOL_MIN_SHIFT);
+}
+
+/*
+ * returns a String with room for at least len bytes and a length of
+ * len, lengths too large to be pooled get a new String each time
+ */
+VALUE kgio_pool_get(VALUE self, long len)
+{
+	struct kgio_pool *p = pool_of(self);
+	VALUE str;
+	int c;
+
+	for (c = 0; c < POOL_CLASSES && class_size(c) < len; c++)
+		;
+	if (c == POOL_CLASSES)
+		return rb_str_new(NULL, len);
+
+	if (RARRAY_LEN(p->free[c]) > 0) {
+		str = rb_ary_pop(p->free[c]);
+		p->bytes -= buf_capa(str);
+	} else {
+		str = rb_str_new(NULL, class_size(c));
+	}
+	rb_str_set_len(str, len);
+	return str;
+}
+
+/* takes str back for later reuse if it fits in a size class */
+void kgio_pool_put(VALUE self, VALUE str)
+{
+	struct kgio_pool *p = pool_of(self);
+	long capa;
+	int c;
+
+	if (TYPE(str) != T_STRING || OBJ_FROZEN(str))
+		return;
+	rb_str_modify(str);
+	capa = buf_capa(str);
+	if (capa >= class_size(POOL_CLASSES))
+		return;
+	for (c = POOL_CLASSES - 1; c >= 0 && class_size(c) > capa; c--)
+		;
+	if (c < 0 || p->bytes + capa > p->max_bytes)
+		return;
+
+	rb_str_set_len(str, 0);
+#ifdef HAVE_RUBY_ENCODING_H
+	rb_enc_associate(str, rb_ascii8bit_encoding());
+#endif
+	p->bytes += capa;
+	rb_ary_push(p->free[c], str);
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::BufferPool.new                -> pool
+ *	Kgio::BufferPool.new(max_bytes)     -> pool
+ *
+ * Creates a new pool which keeps at most +max_bytes+ (default: 4M)
+ * of idle buffers.  Pools are not thread-safe, use one per thread
+ * (or per worker process).
+ */
+static VALUE pool_init(int argc, VALUE *argv, VALUE self)
+{
+	struct kgio_pool *p = pool_of(self);
+	VALUE max_bytes;
+
+	rb_scan_args(argc, argv, "01", &max_bytes);
+	if (!NIL_P(max_bytes)) {
+		p->max_bytes = NUM2LONG(max_bytes);
+		if (p->max_bytes < 0)
+			rb_raise(rb_eArgError, "negative max_bytes given");
+	}
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	pool.get(len)	-> String
+ *
+ * Returns an empty binary String with room for at least +len+ bytes,
+ * reusing a previously returned buffer if possible.
+ */
+static VALUE pool_get(VALUE self, VALUE len)
+{
+	VALUE str = kgio_pool_get(self, NUM2LONG(len));
+
+	rb_str_set_len(str, 0);
+	return str;
+}
+
+/*
+ * call-seq:
+ *
+ *	pool.put(str)	-> nil
+ *
+ * Returns +str+ to the pool for reuse, it is truncated to zero
+ * length and its encoding is reset to ASCII-8BIT.  The caller must
+ * not use +str+ afterwards.
+ *
+ * Strings which are frozen, too small or too large, or which would
+ * grow the pool past its limit are left to the garbage collector.
+ */
+static VALUE pool_put(VALUE self, VALUE str)
+{
+	kgio_pool_put(self, str);
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *
+ *	pool.bytes	-> Integer
+ *
+ * Returns the number of bytes held by idle buffers in the pool.
+ */
+static VALUE pool_bytes(VALUE self)
+{
+	return LONG2NUM(pool_of(self)->bytes);
+}
+
+/*
+ * call-seq:
+ *
+ *	pool.max_bytes	-> Integer
+ *
+ * Returns the maximum number of bytes the pool keeps idle.
+ */
+static VALUE pool_max_bytes(VALUE self)
+{
+	return LONG2NUM(pool_of(self)->max_bytes);
+}
+
+void init_kgio_buffer_pool(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE cBufferPool;
+
+	/*
+	 * Document-class: Kgio::BufferPool
+	 *
+	 * A pool of reusable read buffers.  It may be passed to
+	 * kgio_read, kgio_tryread and friends in place of a buffer,
+	 * the String returned should be given back with
+	 * Kgio::BufferPool#put once the caller is done with it.
+	 * Buffers are returned automatically on EOF and
+	 * Kgio::WaitReadable.
+	 */
+	cBufferPool = rb_define_class_under(mKgio, "BufferPool", rb_cObject);
+	rb_define_alloc_func(cBufferPool, pool_alloc);
+	rb_define_method(cBufferPool, "initialize", pool_init, -1);
+	rb_define_method(cBufferPool, "get", pool_get, 1);
+	rb_define_method(cBufferPool, "put", pool_put, 1);
+	rb_define_method(cBufferPool, "bytes", pool_bytes, 0);
+	rb_define_method(cBufferPool, "max_bytes", pool_max_bytes, 0);
+}
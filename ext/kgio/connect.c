@@ -1,6 +1,9 @@
 #include "kgio.h"
 #include "sock_for_fd.h"
 
+static ID id_try_symbols;
+static VALUE sym_try_symbols;
+
 static void close_fail(int fd, const char *msg)
 {
 	int saved_errno = errno;
@@ -15,9 +18,40 @@ static void close_fail(int fd, const char *msg)
 #  define MY_SOCK_STREAM SOCK_STREAM
 #endif /* ! SOCK_NONBLOCK */
 
-static VALUE
-my_connect(VALUE klass, int io_wait, int domain, void *addr, socklen_t addrlen)
+/* our sockets are always non-blocking stream sockets */
+static VALUE new_sock(VALUE klass, int fd, int try_syms)
 {
+	VALUE io = sock_for_fd(klass, fd);
+
+	kgio_fd_init(io, KGIO_FD_STREAM | KGIO_FD_NONBLOCK);
+	if (try_syms)
+		rb_ivar_set(io, id_try_symbols, Qtrue);
+	return io;
+}
+
+/*
+ * pops the trailing options Hash off the arguments to the *.start
+ * methods, returns true if :try_symbols is enabled
+ */
+static int start_opts(int *argc, VALUE *argv)
+{
+	VALUE opts;
+
+	if (*argc == 0 || TYPE(argv[*argc - 1]) != T_HASH)
+		return 0;
+	opts = argv[--*argc];
+	return RTEST(rb_hash_aref(opts, sym_try_symbols));
+}
+
+/*
+ * io_wait is 1 for *.new, for *.start it is 0, or -1 if the caller
+ * wants the :try_symbols behavior
+ */
+static VALUE my_connect(VALUE klass, int io_wait, VALUE timeout, int domain,
+                        void *addr, socklen_t addrlen)
+{
+	int try_syms = io_wait < 0;
+	double deadline = io_wait > 0 ? kgio_deadline(timeout) : 0;
 	int fd = socket(domain, MY_SOCK_STREAM, 0);
 
 	if (fd == -1) {
@@ -42,60 +76,72 @@ my_connect(VALUE klass, int io_wait, int domain, void *addr, socklen_t addrlen)
 
 	if (connect(fd, addr, addrlen) == -1) {
 		if (errno == EINPROGRESS) {
-			VALUE io = sock_for_fd(klass, fd);
+			VALUE io = new_sock(klass, fd, try_syms);
 
-			if (io_wait) {
+			if (io_wait > 0) {
 				errno = EAGAIN;
-				kgio_wait_writable(io, fd);
+				if (!kgio_wait(io, fd, POLLOUT, deadline)) {
+					rb_funcall(io, rb_intern("close"), 0);
+					kgio_timeout_error("connect timed out");
+				}
 			}
 			return io;
 		}
+		if (try_syms) {
+			VALUE sym = kgio_errno_symbol(errno);
+
+			if (!NIL_P(sym)) {
+				(void)close(fd);
+				return sym;
+			}
+		}
 		close_fail(fd, "connect");
 	}
-	return sock_for_fd(klass, fd);
+	return new_sock(klass, fd, try_syms);
 }
 
-static VALUE tcp_connect(VALUE klass, VALUE ip, VALUE port, int io_wait)
+static VALUE
+tcp_connect(VALUE klass, VALUE ip, VALUE port, int io_wait, VALUE timeout)
 {
-	struct sockaddr_in addr = { 0 };
-
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons((unsigned short)NUM2INT(port));
-
-	switch (inet_pton(AF_INET, StringValuePtr(ip), &addr.sin_addr)) {
-	case 1:
-		return my_connect(klass, io_wait, PF_INET, &addr, sizeof(addr));
-	case -1:
-		rb_sys_fail("inet_pton");
-	}
-	rb_raise(rb_eArgError, "invalid address: %s", StringValuePtr(ip));
+	union kgio_sockaddr addr;
+	socklen_t addrlen = kgio_inet_addr(&addr, ip, port);
 
-	return Qnil;
+	return my_connect(klass, io_wait, timeout, addr.sa.sa_family,
+	                  &addr, addrlen);
 }
 
 /*
  * call-seq:
  *
  *	Kgio::TCPSocket.new('127.0.0.1', 80) -> socket
+ *	Kgio::TCPSocket.new('127.0.0.1', 80, timeout) -> socket
+ *	Kgio::TCPSocket.new('::1', 80) -> socket
  *
  * Creates a new Kgio::TCPSocket object and initiates a
  * non-blocking connection.
  *
  * This may block and call any method assigned to Kgio.wait_writable.
+ * If the connection is not established within +timeout+ seconds, the
+ * socket is closed and Kgio::Timeout is raised.
  *
  * Unlike the TCPSocket.new in Ruby, this does NOT perform DNS
  * lookups (which is subject to a different set of timeouts and
  * best handled elsewhere).
  */
-static VALUE kgio_tcp_connect(VALUE klass, VALUE ip, VALUE port)
+static VALUE kgio_tcp_connect(int argc, VALUE *argv, VALUE klass)
 {
-	return tcp_connect(klass, ip, port, 1);
+	VALUE ip, port, timeout;
+
+	rb_scan_args(argc, argv, "21", &ip, &port, &timeout);
+	return tcp_connect(klass, ip, port, 1, timeout);
 }
 
 /*
  * call-seq:
  *
  *	Kgio::TCPSocket.start('127.0.0.1', 80) -> socket
+ *	Kgio::TCPSocket.start('::1', 80) -> socket
+ *	Kgio::TCPSocket.start('::1', 80, :try_symbols => true) -> socket
  *
  * Creates a new Kgio::TCPSocket object and initiates a
  * non-blocking connection.  The caller should select/poll
@@ -103,16 +149,25 @@ static VALUE kgio_tcp_connect(VALUE klass, VALUE ip, VALUE port)
  * or optimistically attempt a write and handle Kgio::WaitWritable
  * or Errno::EAGAIN.
  *
+ * With :try_symbols => true, returns :econnrefused instead of
+ * raising if the connection is refused immediately, and the new
+ * socket starts with kgio_try_symbols enabled.
+ *
  * Unlike the TCPSocket.new in Ruby, this does NOT perform DNS
  * lookups (which is subject to a different set of timeouts and
  * best handled elsewhere).
  */
-static VALUE kgio_tcp_start(VALUE klass, VALUE ip, VALUE port)
+static VALUE kgio_tcp_start(int argc, VALUE *argv, VALUE klass)
 {
-	return tcp_connect(klass, ip, port, 0);
+	int try_syms = start_opts(&argc, argv);
+	VALUE ip, port;
+
+	rb_scan_args(argc, argv, "20", &ip, &port);
+	return tcp_connect(klass, ip, port, try_syms ? -1 : 0, Qnil);
 }
 
-static VALUE unix_connect(VALUE klass, VALUE path, int io_wait)
+static VALUE
+unix_connect(VALUE klass, VALUE path, int io_wait, VALUE timeout)
 {
 	struct sockaddr_un addr = { 0 };
 	long len;
@@ -127,41 +182,58 @@ static VALUE unix_connect(VALUE klass, VALUE path, int io_wait)
 	memcpy(addr.sun_path, RSTRING_PTR(path), len);
 	addr.sun_family = AF_UNIX;
 
-	return my_connect(klass, io_wait, PF_UNIX, &addr, sizeof(addr));
+	return my_connect(klass, io_wait, timeout, PF_UNIX,
+	                  &addr, sizeof(addr));
 }
 
 /*
  * call-seq:
  *
  *	Kgio::UNIXSocket.new("/path/to/unix/socket") -> socket
+ *	Kgio::UNIXSocket.new("/path/to/unix/socket", timeout) -> socket
  *
  * Creates a new Kgio::UNIXSocket object and initiates a
  * non-blocking connection.
  *
  * This may block and call any method assigned to Kgio.wait_writable.
+ * If the connection is not established within +timeout+ seconds, the
+ * socket is closed and Kgio::Timeout is raised.
  */
-static VALUE kgio_unix_connect(VALUE klass, VALUE path)
+static VALUE kgio_unix_connect(int argc, VALUE *argv, VALUE klass)
 {
-	return unix_connect(klass, path, 1);
+	VALUE path, timeout;
+
+	rb_scan_args(argc, argv, "11", &path, &timeout);
+	return unix_connect(klass, path, 1, timeout);
 }
 
 /*
  * call-seq:
  *
  *	Kgio::UNIXSocket.start("/path/to/unix/socket") -> socket
+ *	Kgio::UNIXSocket.start(path, :try_symbols => true) -> socket
  *
  * Creates a new Kgio::UNIXSocket object and initiates a
  * non-blocking connection.  The caller should select/poll
  * on the socket for writability before attempting to write
  * or optimistically attempt a write and handle Kgio::WaitWritable
  * or Errno::EAGAIN.
+ *
+ * With :try_symbols => true, returns :econnrefused instead of
+ * raising if the connection is refused immediately, and the new
+ * socket starts with kgio_try_symbols enabled.
  */
-static VALUE kgio_unix_start(VALUE klass, VALUE path)
+static VALUE kgio_unix_start(int argc, VALUE *argv, VALUE klass)
 {
-	return unix_connect(klass, path, 0);
+	int try_syms = start_opts(&argc, argv);
+	VALUE path;
+
+	rb_scan_args(argc, argv, "10", &path);
+	return unix_connect(klass, path, try_syms ? -1 : 0, Qnil);
 }
 
-static VALUE stream_connect(VALUE klass, VALUE addr, int io_wait)
+static VALUE
+stream_connect(VALUE klass, VALUE addr, int io_wait, VALUE timeout)
 {
 	int domain;
 	socklen_t addrlen;
@@ -183,7 +255,7 @@ static VALUE stream_connect(VALUE klass, VALUE addr, int io_wait)
 		rb_raise(rb_eArgError, "invalid address family");
 	}
 
-	return my_connect(klass, io_wait, domain, sockaddr, addrlen);
+	return my_connect(klass, io_wait, timeout, domain, sockaddr, addrlen);
 }
 
 /* call-seq:
@@ -193,15 +265,21 @@ static VALUE stream_connect(VALUE klass, VALUE addr, int io_wait)
  *
  *      addr = Socket.pack_sockaddr_un("/path/to/unix/socket")
  *	Kgio::Socket.connect(addr) -> socket
+ *	Kgio::Socket.connect(addr, timeout) -> socket
  *
  * Creates a generic Kgio::Socket object and initiates a
  * non-blocking connection.
  *
  * This may block and call any method assigned to Kgio.wait_writable.
+ * If the connection is not established within +timeout+ seconds, the
+ * socket is closed and Kgio::Timeout is raised.
  */
-static VALUE kgio_connect(VALUE klass, VALUE addr)
+static VALUE kgio_connect(int argc, VALUE *argv, VALUE klass)
 {
-	return stream_connect(klass, addr, 1);
+	VALUE addr, timeout;
+
+	rb_scan_args(argc, argv, "11", &addr, &timeout);
+	return stream_connect(klass, addr, 1, timeout);
 }
 
 /* call-seq:
@@ -211,16 +289,25 @@ static VALUE kgio_connect(VALUE klass, VALUE addr)
  *
  *      addr = Socket.pack_sockaddr_un("/path/to/unix/socket")
  *	Kgio::Socket.start(addr) -> socket
+ *	Kgio::Socket.start(addr, :try_symbols => true) -> socket
  *
  * Creates a generic Kgio::Socket object and initiates a
  * non-blocking connection.  The caller should select/poll
  * on the socket for writability before attempting to write
  * or optimistically attempt a write and handle Kgio::WaitWritable
  * or Errno::EAGAIN.
+ *
+ * With :try_symbols => true, returns :econnrefused instead of
+ * raising if the connection is refused immediately, and the new
+ * socket starts with kgio_try_symbols enabled.
  */
-static VALUE kgio_start(VALUE klass, VALUE addr)
+static VALUE kgio_start(int argc, VALUE *argv, VALUE klass)
 {
-	return stream_connect(klass, addr, 0);
+	int try_syms = start_opts(&argc, argv);
+	VALUE addr;
+
+	rb_scan_args(argc, argv, "10", &addr);
+	return stream_connect(klass, addr, try_syms ? -1 : 0, Qnil);
 }
 
 void init_kgio_connect(void)
@@ -230,6 +317,9 @@ void init_kgio_connect(void)
 	VALUE mSocketMethods = rb_const_get(mKgio, rb_intern("SocketMethods"));
 	VALUE cKgio_Socket, cTCPSocket, cUNIXSocket;
 
+	id_try_symbols = rb_intern("kgio_try_symbols");
+	sym_try_symbols = ID2SYM(rb_intern("try_symbols"));
+
 	/*
 	 * Document-class: Kgio::Socket
 	 *
@@ -239,19 +329,19 @@ void init_kgio_connect(void)
 	 */
 	cKgio_Socket = rb_define_class_under(mKgio, "Socket", cSocket);
 	rb_include_module(cKgio_Socket, mSocketMethods);
-	rb_define_singleton_method(cKgio_Socket, "new", kgio_connect, 1);
-	rb_define_singleton_method(cKgio_Socket, "start", kgio_start, 1);
+	rb_define_singleton_method(cKgio_Socket, "new", kgio_connect, -1);
+	rb_define_singleton_method(cKgio_Socket, "start", kgio_start, -1);
 
 	cTCPSocket = rb_const_get(rb_cObject, rb_intern("TCPSocket"));
 	cTCPSocket = rb_define_class_under(mKgio, "TCPSocket", cTCPSocket);
 	rb_include_module(cTCPSocket, mSocketMethods);
-	rb_define_singleton_method(cTCPSocket, "new", kgio_tcp_connect, 2);
-	rb_define_singleton_method(cTCPSocket, "start", kgio_tcp_start, 2);
+	rb_define_singleton_method(cTCPSocket, "new", kgio_tcp_connect, -1);
+	rb_define_singleton_method(cTCPSocket, "start", kgio_tcp_start, -1);
 
 	cUNIXSocket = rb_const_get(rb_cObject, rb_intern("UNIXSocket"));
 	cUNIXSocket = rb_define_class_under(mKgio, "UNIXSocket", cUNIXSocket);
 	rb_include_module(cUNIXSocket, mSocketMethods);
-	rb_define_singleton_method(cUNIXSocket, "new", kgio_unix_connect, 1);
-	rb_define_singleton_method(cUNIXSocket, "start", kgio_unix_start, 1);
+	rb_define_singleton_method(cUNIXSocket, "new", kgio_unix_connect, -1);
+	rb_define_singleton_method(cUNIXSocket, "start", kgio_unix_start, -1);
 	init_sock_for_fd();
 }
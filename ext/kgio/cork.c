@@ -0,0 +1,73 @@
+#include "kgio.h"
+#include <netinet/tcp.h>
+
+/* BSDs spell TCP_CORK as TCP_NOPUSH with (nearly) the same semantics */
+#if !defined(TCP_CORK) && defined(TCP_NOPUSH)
+#  define TCP_CORK TCP_NOPUSH
+#endif
+
+#ifdef TCP_CORK
+static VALUE set_cork(VALUE io, int val)
+{
+	int fd = my_fileno(io);
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(int)) == 0)
+		return Qtrue;
+	switch (errno) {
+	case EOPNOTSUPP: /* UNIX domain sockets */
+	case ENOPROTOOPT:
+		return Qfalse;
+	}
+	rb_sys_fail("setsockopt(TCP_CORK)");
+	return Qfalse;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_cork	-> true or false
+ *
+ * Sets TCP_CORK (TCP_NOPUSH on BSD) on the socket so the kernel only
+ * sends full segments until Kgio::SocketMethods#kgio_uncork is called.
+ * Use this around a series of small writes (e.g. a response header
+ * and body) so they share segments.
+ *
+ * Returns false without doing anything if the socket does not
+ * support corking (e.g. UNIX domain sockets), true otherwise.
+ */
+static VALUE kgio_cork(VALUE io)
+{
+	return set_cork(io, 1);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_uncork	-> true or false
+ *
+ * Clears TCP_CORK on the socket, flushing any partial segment
+ * held back since Kgio::SocketMethods#kgio_cork was called.
+ *
+ * Returns false without doing anything if the socket does not
+ * support corking, true otherwise.
+ */
+static VALUE kgio_uncork(VALUE io)
+{
+	return set_cork(io, 0);
+}
+#else /* ! TCP_CORK */
+static VALUE kgio_cork(VALUE io)
+{
+	return Qfalse;
+}
+#  define kgio_uncork kgio_cork
+#endif /* ! TCP_CORK */
+
+void init_kgio_cork(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE mSocketMethods = rb_const_get(mKgio, rb_intern("SocketMethods"));
+
+	rb_define_method(mSocketMethods, "kgio_cork", kgio_cork, 0);
+	rb_define_method(mSocketMethods, "kgio_uncork", kgio_uncork, 0);
+}
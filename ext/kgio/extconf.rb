@@ -2,6 +2,25 @@ require 'mkmf'
 $CPPFLAGS << ' -D_GNU_SOURCE'
 
 have_func('accept4', %w(sys/socket.h))
+if have_header('sys/sendfile.h')
+  have_func('sendfile', %w(sys/sendfile.h))
+end
+have_func('splice', %w(fcntl.h))
+have_func('tee', %w(fcntl.h))
+have_func('vmsplice', %w(fcntl.h sys/uio.h))
+have_type('struct mmsghdr', %w(sys/socket.h))
+have_func('recvmmsg', %w(sys/socket.h))
+have_func('sendmmsg', %w(sys/socket.h))
+have_func('pipe2', %w(fcntl.h unistd.h))
+have_func('memmem', %w(string.h))
+have_library('rt', 'clock_gettime') unless have_func('clock_gettime', %w(time.h))
+have_header('linux/filter.h')
+if have_header('sys/epoll.h')
+  have_func('epoll_create1', %w(sys/epoll.h))
+end
+if have_header('linux/io_uring.h')
+  have_const('IORING_OP_SPLICE', 'linux/io_uring.h')
+end
 if have_header('ruby/io.h')
   have_struct_member("rb_io_t", "fd", "ruby/io.h")
   have_struct_member("rb_io_t", "mode", "ruby/io.h")
@@ -15,7 +34,15 @@ else
 end
 have_func('rb_io_ascii8bit_binmode')
 have_func('rb_thread_blocking_region')
+if have_header('ruby/thread.h')
+  have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+end
+if have_header('ruby/fiber/scheduler.h')
+  have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h')
+end
 have_func('rb_str_set_len')
+have_func('rb_str_capacity')
+have_header('ruby/encoding.h')
 
 dir_config('kgio')
 create_makefile('kgio_ext')
@@ -0,0 +1,176 @@
+#include "kgio.h"
+#include <sys/stat.h>
+
+/*
+ * The type of descriptor behind an IO (pipe, stream socket or other)
+ * cannot change while it is open, so it is detected once and kept in
+ * a hidden ivar on the IO.  The read and write paths use it to pick
+ * recv(2)/send(2) with MSG_DONTWAIT, which need no fcntl(2) at all.
+ *
+ * O_NONBLOCK belongs to the open file description, which may be shared
+ * with other processes (listeners in prefork servers), so it is only
+ * remembered (as KGIO_FD_NONBLOCK) for descriptors Kgio created with it
+ * set: pipes from Kgio::Pipe.new, connected sockets and sockets accepted
+ * with Kgio.accept_nonblock = true.  Clearing the flag through the IO
+ * (IO#nonblock=, IO#nonblock or IO#reopen) drops the mark.  Clearing it
+ * behind the IO's back (fcntl(2) on a dup or in another process) is not
+ * noticed for these descriptors, every other descriptor is checked with
+ * fcntl(2) on each call.
+ */
+static ID id_fd_type;
+
+static int fd_detect(int fd)
+{
+	struct stat st;
+	int type;
+	socklen_t len = sizeof(int);
+
+	if (fstat(fd, &st) == -1)
+		return KGIO_FD_UNKNOWN; /* try again next time */
+	if (S_ISFIFO(st.st_mode))
+		return KGIO_FD_PIPE;
+	if (S_ISSOCK(st.st_mode) &&
+	    getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 &&
+	    type == SOCK_STREAM)
+		return KGIO_FD_STREAM;
+	return KGIO_FD_OTHER;
+}
+
+/*
+ * returns one of KGIO_FD_{PIPE,STREAM,OTHER} (or KGIO_FD_UNKNOWN),
+ * with KGIO_FD_NONBLOCK set if Kgio created the descriptor non-blocking
+ */
+int kgio_fd_state(VALUE io, int fd)
+{
+	VALUE type = rb_attr_get(io, id_fd_type);
+	int rv;
+
+	if (FIXNUM_P(type))
+		return FIX2INT(type);
+	rv = fd_detect(fd);
+	if (rv != KGIO_FD_UNKNOWN)
+		kgio_fd_init(io, rv);
+	return rv;
+}
+
+/*
+ * records the type of a descriptor we just created for io, with
+ * KGIO_FD_NONBLOCK if we created it with O_NONBLOCK set
+ */
+void kgio_fd_init(VALUE io, int type)
+{
+	if (!OBJ_FROZEN(io))
+		rb_ivar_set(io, id_fd_type, INT2FIX(type));
+}
+
+/*
+ * call-seq:
+ *
+ *	io.reopen(other_io)		-> io
+ *	io.reopen(path, mode_str)	-> io
+ *
+ * Same as IO#reopen, but also forgets the type of descriptor Kgio
+ * detected for +io+.
+ */
+static VALUE kgio_reopen(int argc, VALUE *argv, VALUE io)
+{
+	VALUE rv = rb_call_super(argc, argv);
+
+	if (!OBJ_FROZEN(io))
+		rb_ivar_set(io, id_fd_type, Qnil);
+	return rv;
+}
+
+/* forgets that Kgio set O_NONBLOCK, the type is still valid */
+static void nonblock_forget(VALUE io)
+{
+	VALUE type = rb_attr_get(io, id_fd_type);
+
+	if (FIXNUM_P(type) && (FIX2INT(type) & KGIO_FD_NONBLOCK))
+		rb_ivar_set(io, id_fd_type,
+		            INT2FIX(FIX2INT(type) & ~KGIO_FD_NONBLOCK));
+}
+
+/*
+ * call-seq:
+ *
+ *	io.nonblock = boolean	-> boolean
+ *
+ * Same as IO#nonblock= (from io/nonblock), but also tells Kgio to
+ * check O_NONBLOCK again before its next non-blocking call.
+ */
+static VALUE kgio_nonblock_set(VALUE io, VALUE boolean)
+{
+	nonblock_forget(io);
+	return rb_call_super(1, &boolean);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.nonblock(boolean = true) { ... }	-> obj
+ *
+ * Same as IO#nonblock (from io/nonblock), but also tells Kgio to check
+ * O_NONBLOCK again before its next non-blocking call.
+ */
+static VALUE kgio_nonblock_blk(int argc, VALUE *argv, VALUE io)
+{
+	nonblock_forget(io);
+	return rb_call_super(argc, argv);
+}
+
+static VALUE pipe_close(VALUE pair)
+{
+	long i;
+
+	for (i = 0; i < RARRAY_LEN(pair); i++) {
+		VALUE io = rb_ary_entry(pair, i);
+
+		if (!RTEST(rb_funcall(io, rb_intern("closed?"), 0)))
+			rb_funcall(io, rb_intern("close"), 0);
+	}
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *
+ *	rd, wr = Kgio::Pipe.new
+ *	Kgio::Pipe.new { |rd, wr| ... }	-> obj
+ *
+ * Same as IO.pipe, except both ends are Kgio::Pipe objects created
+ * with O_NONBLOCK set, so Kgio methods do not check it with fcntl(2)
+ * on every call.
+ */
+static VALUE kgio_pipe_new(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE pair = rb_funcall2(klass, rb_intern("pipe"), argc, argv);
+	long i;
+
+	for (i = 0; i < RARRAY_LEN(pair); i++) {
+		VALUE io = rb_ary_entry(pair, i);
+
+		set_nonblocking(my_fileno(io));
+		kgio_fd_init(io, KGIO_FD_PIPE | KGIO_FD_NONBLOCK);
+	}
+	if (rb_block_given_p())
+		return rb_ensure(rb_yield, pair, pipe_close, pair);
+	return pair;
+}
+
+void init_kgio_fd_state(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE mPipeMethods = rb_const_get(mKgio, rb_intern("PipeMethods"));
+	VALUE mSocketMethods = rb_const_get(mKgio, rb_intern("SocketMethods"));
+	VALUE cPipe = rb_define_class_under(mKgio, "Pipe", rb_cIO);
+
+	id_fd_type = rb_intern("kgio_fd_type");
+	rb_define_method(mPipeMethods, "reopen", kgio_reopen, -1);
+	rb_define_method(mSocketMethods, "reopen", kgio_reopen, -1);
+	rb_define_method(mPipeMethods, "nonblock=", kgio_nonblock_set, 1);
+	rb_define_method(mSocketMethods, "nonblock=", kgio_nonblock_set, 1);
+	rb_define_method(mPipeMethods, "nonblock", kgio_nonblock_blk, -1);
+	rb_define_method(mSocketMethods, "nonblock", kgio_nonblock_blk, -1);
+	rb_define_singleton_method(cPipe, "new", kgio_pipe_new, -1);
+}
@@ -16,25 +16,115 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <poll.h>
 
 #include "missing/ancient_ruby.h"
 #include "nonblock.h"
 #include "my_fileno.h"
 
+/*
+ * we know MSG_DONTWAIT works properly on all stream sockets under Linux
+ * we can define this macro for other platforms as people care and
+ * notice.
+ */
+#if defined(__linux__) && ! defined(USE_MSG_DONTWAIT)
+#  define USE_MSG_DONTWAIT
+#endif
+
+/*
+ * rb_thread_blocking_region was replaced by rb_thread_call_without_gvl
+ * and removed in Ruby 2.2, kgio_without_gvl() calls whichever exists
+ */
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) || \
+    defined(HAVE_RB_THREAD_BLOCKING_REGION)
+#  define KGIO_WITHOUT_GVL
+#endif
+
+/* large enough for any peer address kgio_addr understands */
+union kgio_sockaddr {
+	struct sockaddr sa;
+	struct sockaddr_in in;
+#ifdef AF_INET6
+	struct sockaddr_in6 in6;
+#endif
+};
+
 struct io_args {
 	VALUE io;
 	VALUE buf;
+	VALUE pool; /* Kgio::BufferPool buf was taken from, or nil */
 	char *ptr;
 	long len;
 	int fd;
+	double deadline; /* from kgio_deadline(), zero for none */
 };
 
 void init_kgio_wait(void);
 void init_kgio_read_write(void);
 void init_kgio_accept(void);
 void init_kgio_connect(void);
+void init_kgio_sendfile(void);
+void init_kgio_splice(void);
+void init_kgio_udp(void);
+void init_kgio_buffer_pool(void);
+void init_kgio_cork(void);
+void init_kgio_fd_state(void);
+void init_kgio_read_until(void);
+void init_kgio_read_exactly(void);
+void init_kgio_read_buffer(void);
+void init_kgio_ring(void);
+void init_kgio_poller(void);
+void init_kgio_listen(void);
+void init_kgio_addr(void);
 
 void kgio_wait_writable(VALUE io, int fd);
 void kgio_wait_readable(VALUE io, int fd);
+double kgio_deadline(VALUE timeout);
+int kgio_wait(VALUE io, int fd, short events, double deadline);
+void kgio_wait_readable_until(VALUE io, int fd, double deadline);
+void kgio_wait_writable_until(VALUE io, int fd, double deadline);
+void kgio_define_timeout(VALUE klass);
+VALUE kgio_default_timeout(VALUE io);
+int kgio_fiber_scheduled(void);
+#ifdef KGIO_WITHOUT_GVL
+VALUE kgio_without_gvl(VALUE (*fn)(void *), void *ptr);
+#endif
+VALUE kgio_errno_symbol(int err);
+VALUE kgio_try_symbol(VALUE io, int err);
+VALUE kgio_try_eof(VALUE io);
+VALUE kgio_syserr(int err, const char *msg);
+
+/* file descriptor types cached by kgio_fd_type() */
+#define KGIO_FD_UNKNOWN 0
+#define KGIO_FD_PIPE 1
+#define KGIO_FD_STREAM 2 /* stream socket, MSG_DONTWAIT works */
+#define KGIO_FD_OTHER 3
+#define KGIO_FD_NONBLOCK 4 /* flag: kgio created it with O_NONBLOCK */
+
+int kgio_fd_state(VALUE io, int fd);
+#define kgio_fd_type(io,fd) (kgio_fd_state((io),(fd)) & ~KGIO_FD_NONBLOCK)
+void kgio_fd_init(VALUE io, int type);
+
+/* sets O_NONBLOCK unless +state+ from kgio_fd_state() says it is set */
+#define kgio_nonblock(state,fd) do { \
+	if (!((state) & KGIO_FD_NONBLOCK)) set_nonblocking(fd); \
+} while (0)
+
+long kgio_read_raw(struct io_args *a, const char **msg);
+VALUE kgio_tryrecv_buf(VALUE io, VALUE length, VALUE buf);
+
+int kgio_accept4_flags(void);
+VALUE kgio_accepted(int client, const struct sockaddr *addr);
+int kgio_peer_set(VALUE io, const struct sockaddr *addr);
+socklen_t kgio_inet_addr(union kgio_sockaddr *, VALUE ip, VALUE port);
+
+int kgio_is_pool(VALUE obj);
+VALUE kgio_pool_get(VALUE pool, long len);
+void kgio_pool_put(VALUE pool, VALUE str);
+
+NORETURN(void kgio_raise_empty_bt(VALUE, const char *));
+NORETURN(void kgio_rd_sys_fail(const char *));
+NORETURN(void kgio_wr_sys_fail(const char *));
+NORETURN(void kgio_timeout_error(const char *));
 
 #endif /* KGIO_H */
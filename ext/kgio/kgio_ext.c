@@ -3,7 +3,20 @@
 void Init_kgio_ext(void)
 {
 	init_kgio_wait();
+	init_kgio_buffer_pool();
 	init_kgio_read_write();
+	init_kgio_addr();
+	init_kgio_fd_state();
+	init_kgio_read_until();
+	init_kgio_read_exactly();
+	init_kgio_read_buffer();
 	init_kgio_connect();
 	init_kgio_accept();
+	init_kgio_listen();
+	init_kgio_sendfile();
+	init_kgio_splice();
+	init_kgio_udp();
+	init_kgio_cork();
+	init_kgio_ring();
+	init_kgio_poller();
 }
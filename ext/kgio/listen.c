@@ -0,0 +1,329 @@
+#include "kgio.h"
+#include "sock_for_fd.h"
+#include <netinet/tcp.h>
+#ifdef HAVE_LINUX_FILTER_H
+#  include <linux/filter.h>
+#endif
+
+/* FreeBSD 12+ spells the load-balancing variant SO_REUSEPORT_LB */
+#if defined(SO_REUSEPORT_LB)
+#  define KGIO_SO_REUSEPORT SO_REUSEPORT_LB
+#elif defined(SO_REUSEPORT)
+#  define KGIO_SO_REUSEPORT SO_REUSEPORT
+#endif
+
+#ifdef TCP_DEFER_ACCEPT
+static int set_defer_accept(int fd, VALUE seconds)
+{
+	int val = NUM2INT(seconds);
+
+	return setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &val, sizeof(int));
+}
+
+/*
+ * call-seq:
+ *
+ *	server.kgio_defer_accept(seconds)	-> true or false
+ *
+ * Sets TCP_DEFER_ACCEPT on the listener so the kernel only completes
+ * accept for clients which have sent data, waiting up to about
+ * +seconds+ for it.  Clients which connect and stay idle never wake up
+ * the server, and a client returned by kgio_tryaccept_read will
+ * usually come with its request.  Zero disables it again.
+ *
+ * Returns false without doing anything if the system does not support
+ * TCP_DEFER_ACCEPT (only Linux does), true otherwise.
+ */
+static VALUE kgio_defer_accept(VALUE io, VALUE seconds)
+{
+	if (set_defer_accept(my_fileno(io), seconds) == 0)
+		return Qtrue;
+	switch (errno) {
+	case EOPNOTSUPP:
+	case ENOPROTOOPT:
+		return Qfalse;
+	}
+	rb_sys_fail("setsockopt(TCP_DEFER_ACCEPT)");
+	return Qfalse;
+}
+#else /* ! TCP_DEFER_ACCEPT */
+static VALUE kgio_defer_accept(VALUE io, VALUE seconds)
+{
+	(void)NUM2INT(seconds);
+	return Qfalse;
+}
+#endif /* ! TCP_DEFER_ACCEPT */
+
+#ifdef KGIO_SO_REUSEPORT
+static VALUE sym_backlog, sym_bpf, sym_ebpf, sym_workers, sym_cpu;
+static VALUE sym_defer_accept;
+
+static void close_fail(int fd, const char *msg)
+{
+	int saved_errno = errno;
+
+	(void)close(fd);
+	errno = saved_errno;
+	rb_sys_fail(msg);
+}
+
+static int my_socket(int domain)
+{
+	int fd = socket(domain, SOCK_STREAM, 0);
+
+	if (fd == -1) {
+		switch (errno) {
+		case EMFILE:
+		case ENFILE:
+#ifdef ENOBUFS
+		case ENOBUFS:
+#endif /* ENOBUFS */
+			errno = 0;
+			rb_gc();
+			fd = socket(domain, SOCK_STREAM, 0);
+		}
+		if (fd == -1)
+			rb_sys_fail("socket");
+	}
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		close_fail(fd, "fcntl(F_SETFD, FD_CLOEXEC)");
+	return fd;
+}
+
+#if !defined(SO_ATTACH_REUSEPORT_CBPF) || !defined(HAVE_LINUX_FILTER_H)
+typedef struct { unsigned short len; } kgio_fprog;
+#endif
+
+static VALUE opt(VALUE opts, VALUE key)
+{
+	return NIL_P(opts) ? Qnil : rb_hash_aref(opts, key);
+}
+
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(HAVE_LINUX_FILTER_H)
+typedef struct sock_fprog kgio_fprog;
+
+/*
+ * steers each connection to the listener at the index of the CPU which
+ * received it (modulo +workers+), so it is accepted by the worker that
+ * is likely to already have the flow in its cache.  Indices are in the
+ * order listeners joined the group.
+ */
+static void cpu_prog(struct sock_fprog *prog, VALUE workers)
+{
+	struct sock_filter *code = prog->filter;
+	unsigned short n = 0;
+
+	memset(code, 0, sizeof(struct sock_filter) * prog->len);
+	code[n].code = BPF_LD | BPF_W | BPF_ABS;
+	code[n++].k = (unsigned)(SKF_AD_OFF + SKF_AD_CPU);
+	if (!NIL_P(workers)) {
+		code[n].code = BPF_ALU | BPF_MOD | BPF_K;
+		code[n++].k = NUM2UINT(workers);
+		if (code[n - 1].k == 0)
+			rb_raise(rb_eArgError, "workers must be positive");
+	}
+	code[n++].code = BPF_RET | BPF_A;
+	prog->len = n;
+}
+
+/* +ary+ is an Array of [ code, jt, jf, k ] classic BPF instructions */
+static void cbpf_prog(struct sock_fprog *prog, VALUE ary)
+{
+	long i;
+
+	for (i = 0; i < prog->len; i++) {
+		VALUE insn = rb_ary_entry(ary, i);
+
+		Check_Type(insn, T_ARRAY);
+		if (RARRAY_LEN(insn) != 4)
+			rb_raise(rb_eArgError,
+			         "BPF insn must be [ code, jt, jf, k ]");
+		prog->filter[i].code = (unsigned short)
+		                       NUM2UINT(rb_ary_entry(insn, 0));
+		prog->filter[i].jt = (unsigned char)
+		                     NUM2UINT(rb_ary_entry(insn, 1));
+		prog->filter[i].jf = (unsigned char)
+		                     NUM2UINT(rb_ary_entry(insn, 2));
+		prog->filter[i].k = NUM2UINT(rb_ary_entry(insn, 3));
+	}
+}
+
+/*
+ * builds the steering program before the socket exists so bad options
+ * cannot leak a descriptor.  Returns the String holding the program.
+ */
+static VALUE steering_prog(kgio_fprog *prog, VALUE bpf, VALUE workers)
+{
+	VALUE code;
+	long len = 3;
+
+	prog->len = 0;
+	if (NIL_P(bpf))
+		return Qnil;
+	if (bpf != sym_cpu) {
+		Check_Type(bpf, T_ARRAY);
+		len = RARRAY_LEN(bpf);
+		if (len <= 0 || len > BPF_MAXINSNS)
+			rb_raise(rb_eArgError,
+			         "BPF program must have 1..%d insns",
+			         BPF_MAXINSNS);
+	}
+	code = rb_str_new(NULL, sizeof(struct sock_filter) * len);
+	prog->filter = (struct sock_filter *)RSTRING_PTR(code);
+	prog->len = (unsigned short)len;
+	if (bpf == sym_cpu)
+		cpu_prog(prog, workers);
+	else
+		cbpf_prog(prog, bpf);
+	return code;
+}
+
+static void attach_cbpf(int fd, kgio_fprog *prog)
+{
+	if (prog->len == 0)
+		return;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+	               prog, sizeof(*prog)) == -1)
+		close_fail(fd, "setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+}
+#else /* ! SO_ATTACH_REUSEPORT_CBPF */
+static VALUE steering_prog(kgio_fprog *prog, VALUE bpf, VALUE workers)
+{
+	prog->len = 0;
+	if (!NIL_P(bpf))
+		rb_raise(rb_eNotImpError, "BPF steering not supported");
+	return Qnil;
+}
+#  define attach_cbpf(fd, prog) (void)(fd)
+#endif /* ! SO_ATTACH_REUSEPORT_CBPF */
+
+/* +prog_fd+ is the descriptor of an already-loaded eBPF program */
+static void attach_ebpf(int fd, int prog_fd)
+{
+	if (prog_fd < 0)
+		return;
+#ifdef SO_ATTACH_REUSEPORT_EBPF
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF,
+	               &prog_fd, sizeof(int)) == -1)
+		close_fail(fd, "setsockopt(SO_ATTACH_REUSEPORT_EBPF)");
+#else /* ! SO_ATTACH_REUSEPORT_EBPF */
+	(void)close(fd);
+	rb_raise(rb_eNotImpError, "eBPF steering not supported");
+#endif /* ! SO_ATTACH_REUSEPORT_EBPF */
+}
+
+static VALUE
+my_listen(VALUE klass, int domain, void *addr, socklen_t addrlen, VALUE opts)
+{
+	VALUE backlog = opt(opts, sym_backlog);
+	VALUE bpf = opt(opts, sym_bpf);
+	VALUE ebpf = opt(opts, sym_ebpf);
+	VALUE defer = opt(opts, sym_defer_accept);
+	int n = NIL_P(backlog) ? SOMAXCONN : NUM2INT(backlog);
+	int prog_fd = -1;
+	kgio_fprog prog;
+	VALUE code = steering_prog(&prog, bpf, opt(opts, sym_workers));
+	int fd, val = 1;
+
+	if (!NIL_P(ebpf))
+		prog_fd = FIXNUM_P(ebpf) ? FIX2INT(ebpf) : my_fileno(ebpf);
+	if (!NIL_P(defer))
+		(void)NUM2INT(defer);
+	fd = my_socket(domain);
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(int)) == -1)
+		close_fail(fd, "setsockopt(SO_REUSEADDR)");
+	if (setsockopt(fd, SOL_SOCKET, KGIO_SO_REUSEPORT,
+	               &val, sizeof(int)) == -1)
+		close_fail(fd, "setsockopt(SO_REUSEPORT)");
+	if (bind(fd, addr, addrlen) == -1)
+		close_fail(fd, "bind");
+#ifdef TCP_DEFER_ACCEPT
+	if (!NIL_P(defer) && set_defer_accept(fd, defer) == -1)
+		close_fail(fd, "setsockopt(TCP_DEFER_ACCEPT)");
+#endif /* TCP_DEFER_ACCEPT */
+	if (listen(fd, n) == -1)
+		close_fail(fd, "listen");
+
+	/* attaching before listen(2) would start a group of our own */
+	attach_cbpf(fd, &prog);
+	attach_ebpf(fd, prog_fd);
+	RB_GC_GUARD(code);
+	return sock_for_fd(klass, fd);
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::TCPServer.new_reuseport('0.0.0.0', 80)		-> server
+ *	Kgio::TCPServer.new_reuseport('0.0.0.0', 80, opts)	-> server
+ *	Kgio::TCPServer.new_reuseport('::', 80, opts)		-> server
+ *
+ * Creates a listening Kgio::TCPServer with SO_REUSEPORT set, so every
+ * worker of a prefork server may bind its own listener to the same
+ * address.  The kernel then spreads incoming connections across the
+ * listeners of the group instead of letting workers race to accept
+ * from one shared queue.  All listeners of a group must be created by
+ * the same user.
+ *
+ * +opts+ is a Hash which may contain:
+ *
+ * :backlog - the listen(2) backlog of this listener (default: SOMAXCONN)
+ *
+ * :bpf - either :cpu or an Array of [ code, jt, jf, k ] classic BPF
+ * instructions which select the listener (by the order they joined
+ * the group) for each connection.  :cpu picks the listener at the
+ * index of the CPU which received the connection, modulo the
+ * :workers option if given.  Linux only.
+ *
+ * :workers - the number of listeners in the group, for :bpf => :cpu
+ *
+ * :ebpf - the descriptor (Integer or IO) of a loaded eBPF program to
+ * steer connections with instead.  Linux only.
+ *
+ * :defer_accept - seconds to hold back clients which have not sent
+ * anything yet, see Kgio::TCPServer#kgio_defer_accept.  Ignored where
+ * TCP_DEFER_ACCEPT is unsupported.
+ *
+ * A steering program applies to the whole group, so only one listener
+ * needs to attach it.  Connections fall back to the default hash-based
+ * distribution if the program selects a listener which does not exist.
+ *
+ * Like Kgio::TCPSocket.new, this does NOT perform DNS lookups.
+ */
+static VALUE tcp_new_reuseport(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE ip, port, opts;
+	union kgio_sockaddr addr;
+	socklen_t addrlen;
+
+	rb_scan_args(argc, argv, "21", &ip, &port, &opts);
+	if (!NIL_P(opts))
+		Check_Type(opts, T_HASH);
+	addrlen = kgio_inet_addr(&addr, ip, port);
+	return my_listen(klass, addr.sa.sa_family, &addr, addrlen, opts);
+}
+
+static void init_reuseport(VALUE cTCPServer)
+{
+	sym_backlog = ID2SYM(rb_intern("backlog"));
+	sym_bpf = ID2SYM(rb_intern("bpf"));
+	sym_ebpf = ID2SYM(rb_intern("ebpf"));
+	sym_workers = ID2SYM(rb_intern("workers"));
+	sym_cpu = ID2SYM(rb_intern("cpu"));
+	sym_defer_accept = ID2SYM(rb_intern("defer_accept"));
+	rb_define_singleton_method(cTCPServer, "new_reuseport",
+	                           tcp_new_reuseport, -1);
+	init_sock_for_fd();
+}
+#else /* ! KGIO_SO_REUSEPORT */
+#  define init_reuseport(klass) (void)(klass)
+#endif /* ! KGIO_SO_REUSEPORT */
+
+void init_kgio_listen(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE cTCPServer = rb_const_get(mKgio, rb_intern("TCPServer"));
+
+	rb_define_method(cTCPServer, "kgio_defer_accept", kgio_defer_accept, 1);
+	init_reuseport(cTCPServer);
+}
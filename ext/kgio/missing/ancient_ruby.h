@@ -16,5 +16,8 @@ static void rb_str_set_len(VALUE str, long len)
 #ifndef RSTRING_LEN
 #  define RSTRING_LEN(s) (RSTRING(s)->len)
 #endif /* !defined(RSTRING_LEN) */
+#ifndef RB_GC_GUARD
+#  define RB_GC_GUARD(v) (*(volatile VALUE *)&(v))
+#endif /* !defined(RB_GC_GUARD) */
 
 #endif /* MISSING_ANCIENT_RUBY_H */
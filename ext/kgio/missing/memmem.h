@@ -0,0 +1,29 @@
+#ifndef MISSING_MEMMEM_H
+#define MISSING_MEMMEM_H
+#include <string.h>
+
+#ifndef HAVE_MEMMEM
+/* naive, but memchr(3) is usually vectorized and does the heavy lifting */
+static void *
+my_memmem(const void *haystack, size_t hlen, const void *needle, size_t nlen)
+{
+	const char *h = haystack;
+	const char *end = h + hlen;
+	const char *n = needle;
+
+	if (nlen == 0)
+		return (void *)h;
+	while ((size_t)(end - h) >= nlen) {
+		h = memchr(h, n[0], (size_t)(end - h) - nlen + 1);
+		if (h == NULL)
+			return NULL;
+		if (memcmp(h, n, nlen) == 0)
+			return (void *)h;
+		h++;
+	}
+	return NULL;
+}
+#  define memmem(h,hlen,n,nlen) my_memmem((h),(hlen),(n),(nlen))
+#endif /* ! HAVE_MEMMEM */
+
+#endif /* MISSING_MEMMEM_H */
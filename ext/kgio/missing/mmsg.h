@@ -0,0 +1,57 @@
+#ifndef HAVE_TYPE_STRUCT_MMSGHDR
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#endif /* ! HAVE_TYPE_STRUCT_MMSGHDR */
+
+#ifdef HAVE_RECVMMSG
+#  define my_recvmmsg(fd,vec,vlen,flags) \
+          recvmmsg((fd),(vec),(vlen),(flags),NULL)
+#else /* ! HAVE_RECVMMSG */
+/*
+ * recvmmsg() is currently a Linux-only goodie, emulate it with a
+ * recvmsg() loop, this still saves Ruby method calls.
+ */
+static int
+my_recvmmsg(int fd, struct mmsghdr *vec, unsigned int vlen, int flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < vlen; i++) {
+		ssize_t n = recvmsg(fd, &vec[i].msg_hdr, flags);
+
+		if (n == -1) {
+			if (i == 0)
+				return -1;
+			break;
+		}
+		vec[i].msg_len = (unsigned int)n;
+	}
+	errno = 0;
+	return (int)i;
+}
+#endif /* ! HAVE_RECVMMSG */
+
+#ifdef HAVE_SENDMMSG
+#  define my_sendmmsg(fd,vec,vlen,flags) sendmmsg((fd),(vec),(vlen),(flags))
+#else /* ! HAVE_SENDMMSG */
+static int
+my_sendmmsg(int fd, struct mmsghdr *vec, unsigned int vlen, int flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < vlen; i++) {
+		ssize_t n = sendmsg(fd, &vec[i].msg_hdr, flags);
+
+		if (n == -1) {
+			if (i == 0)
+				return -1;
+			break;
+		}
+		vec[i].msg_len = (unsigned int)n;
+	}
+	errno = 0;
+	return (int)i;
+}
+#endif /* ! HAVE_SENDMMSG */
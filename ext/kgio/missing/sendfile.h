@@ -0,0 +1,26 @@
+#if defined(__linux__) && defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+#  include <sys/sendfile.h>
+#  define xsendfile(out_fd,in_fd,offset,count) \
+          sendfile((out_fd),(in_fd),(offset),(count))
+#else /* ! linux */
+/*
+ * sendfile() is non-portable and the BSD variants have a different
+ * signature, so emulate the GNU/Linux one with pread() + write().
+ * This still saves a round trip through the Ruby heap.
+ */
+static ssize_t xsendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	char buf[16384];
+	ssize_t r, w;
+
+	if (count > sizeof(buf))
+		count = sizeof(buf);
+	r = pread(in_fd, buf, count, *offset);
+	if (r <= 0)
+		return r;
+	w = write(out_fd, buf, (size_t)r);
+	if (w > 0)
+		*offset += w;
+	return w;
+}
+#endif /* ! linux */
@@ -0,0 +1,372 @@
+#include "kgio.h"
+#ifdef HAVE_SYS_EPOLL_H
+#  include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#  include <math.h>
+#  include <limits.h>
+#  include <sys/time.h>
+
+/*
+ * Registered IOs are kept in an Array indexed by file descriptor, the
+ * kernel hands the descriptor back in epoll_event.data.  Keeping them
+ * referenced there also keeps them from being garbage collected while
+ * they are registered.  The events buffer and the Array returned by
+ * Kgio::Poller#wait are reused by every call.
+ */
+#define POLLER_DEFAULT_EVENTS 64
+
+struct kgio_poller {
+	int fd;
+	int capa; /* number of entries in events */
+	struct epoll_event *events;
+	VALUE ios; /* Array: fd => IO */
+	VALUE ready; /* Array returned by wait */
+};
+
+static void poller_mark(void *ptr)
+{
+	struct kgio_poller *p = ptr;
+
+	rb_gc_mark(p->ios);
+	rb_gc_mark(p->ready);
+}
+
+static void poller_free(void *ptr)
+{
+	struct kgio_poller *p = ptr;
+
+	if (p->fd >= 0)
+		(void)close(p->fd);
+	xfree(p->events);
+	xfree(p);
+}
+
+static VALUE poller_alloc(VALUE klass)
+{
+	struct kgio_poller *p;
+	VALUE self = Data_Make_Struct(klass, struct kgio_poller,
+	                              poller_mark, poller_free, p);
+
+	p->fd = -1;
+	p->ios = p->ready = Qnil;
+	return self;
+}
+
+static struct kgio_poller *poller_of(VALUE self)
+{
+	struct kgio_poller *p;
+
+	Data_Get_Struct(self, struct kgio_poller, p);
+	if (p->fd < 0)
+		rb_raise(rb_eIOError, "closed poller");
+	return p;
+}
+
+static int my_epoll_create(void)
+{
+#ifdef HAVE_EPOLL_CREATE1
+	return epoll_create1(EPOLL_CLOEXEC);
+#else
+	int fd = epoll_create(1);
+
+	if (fd >= 0)
+		(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+#endif
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::Poller.new		-> poller
+ *	Kgio::Poller.new(max_events)	-> poller
+ *
+ * Creates a new epoll(7) descriptor.  Kgio::Poller#wait returns at
+ * most +max_events+ (default: 64) IOs per call unless told otherwise.
+ *
+ * Pollers are not thread-safe, use one per thread (or per worker
+ * process) and do not share them across fork.
+ */
+static VALUE poller_init(int argc, VALUE *argv, VALUE self)
+{
+	struct kgio_poller *p;
+	VALUE max_events;
+
+	Data_Get_Struct(self, struct kgio_poller, p);
+	rb_scan_args(argc, argv, "01", &max_events);
+	p->capa = NIL_P(max_events) ? POLLER_DEFAULT_EVENTS :
+	          NUM2INT(max_events);
+	if (p->capa <= 0)
+		rb_raise(rb_eArgError, "max_events must be positive");
+	if (p->fd >= 0)
+		rb_raise(rb_eRuntimeError, "poller already initialized");
+
+	p->fd = my_epoll_create();
+	if (p->fd < 0) {
+		if (errno == EMFILE || errno == ENFILE || errno == ENOMEM) {
+			rb_gc();
+			p->fd = my_epoll_create();
+		}
+		if (p->fd < 0)
+			rb_sys_fail("epoll_create");
+	}
+	p->events = ALLOC_N(struct epoll_event, p->capa);
+	p->ios = rb_ary_new();
+	p->ready = rb_ary_new2(p->capa);
+	return self;
+}
+
+static int my_epoll_ctl(struct kgio_poller *p, int op, int fd, unsigned events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	return epoll_ctl(p->fd, op, fd, &ev);
+}
+
+/*
+ * call-seq:
+ *
+ *	poller.add(io)			-> poller
+ *	poller.add(io, events)		-> poller
+ *
+ * Registers +io+ for +events+ (default: Kgio::Poller::IN), a bitwise
+ * OR of Kgio::Poller::IN, Kgio::Poller::OUT, Kgio::Poller::ET and
+ * Kgio::Poller::ONESHOT.  If +io+ is already registered, its events
+ * are replaced, this is also how a one-shot registration is re-armed.
+ *
+ * Edge-triggered (ET) registrations are only reported again after new
+ * data arrives (or space frees up), so callers should use the kgio_try*
+ * methods until they return Kgio::WaitReadable or Kgio::WaitWritable.
+ */
+static VALUE poller_add(int argc, VALUE *argv, VALUE self)
+{
+	struct kgio_poller *p = poller_of(self);
+	VALUE io, events;
+	unsigned ev;
+	int fd;
+
+	rb_scan_args(argc, argv, "11", &io, &events);
+	ev = NIL_P(events) ? EPOLLIN : NUM2UINT(events);
+	fd = my_fileno(io);
+	if (my_epoll_ctl(p, EPOLL_CTL_ADD, fd, ev) != 0) {
+		if (errno != EEXIST ||
+		    my_epoll_ctl(p, EPOLL_CTL_MOD, fd, ev) != 0)
+			rb_sys_fail("epoll_ctl");
+	}
+	rb_ary_store(p->ios, fd, io);
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	poller.delete(io)	-> io or nil
+ *
+ * Stops watching +io+.  Returns +io+, or nil if it was not registered.
+ * IOs which are closed without being deleted are dropped by the kernel
+ * automatically, but stay referenced by the poller until their file
+ * descriptor is registered again.
+ */
+static VALUE poller_delete(VALUE self, VALUE io)
+{
+	struct kgio_poller *p = poller_of(self);
+	int fd = my_fileno(io);
+
+	if (my_epoll_ctl(p, EPOLL_CTL_DEL, fd, 0) != 0) {
+		if (errno == ENOENT)
+			return Qnil;
+		rb_sys_fail("epoll_ctl");
+	}
+	if (rb_ary_entry(p->ios, fd) == io)
+		rb_ary_store(p->ios, fd, Qnil);
+	return io;
+}
+
+struct wait_args {
+	int fd;
+	int maxevents;
+	int timeout;
+	struct epoll_event *events;
+};
+
+static VALUE nogvl_wait(void *ptr)
+{
+	struct wait_args *w = ptr;
+
+	return (VALUE)epoll_wait(w->fd, w->events, w->maxevents, w->timeout);
+}
+
+#ifdef KGIO_WITHOUT_GVL
+#  define blocking_wait(w) (int)kgio_without_gvl(nogvl_wait, (w))
+#else /* ! KGIO_WITHOUT_GVL */
+/*
+ * green threads: wait for the epoll descriptor itself to become
+ * readable so other threads may run, then collect the events
+ */
+static int blocking_wait(struct wait_args *w)
+{
+	fd_set fds;
+	struct timeval tv, *tvp = NULL;
+
+	if (w->timeout >= 0) {
+		tv.tv_sec = w->timeout / 1000;
+		tv.tv_usec = (w->timeout % 1000) * 1000;
+		tvp = &tv;
+	}
+	FD_ZERO(&fds);
+	FD_SET(w->fd, &fds);
+	if (rb_thread_select(w->fd + 1, &fds, NULL, NULL, tvp) <= 0)
+		return 0;
+	w->timeout = 0;
+	return (int)nogvl_wait(w);
+}
+#endif /* ! KGIO_WITHOUT_GVL */
+
+static int timeout_ms(VALUE timeout)
+{
+	double ms;
+
+	if (NIL_P(timeout))
+		return -1;
+	ms = ceil(NUM2DBL(timeout) * 1000.0);
+	if (ms < 0)
+		return -1;
+	return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+/*
+ * call-seq:
+ *
+ *	poller.wait				-> Array
+ *	poller.wait(timeout)			-> Array
+ *	poller.wait(timeout, max_events)	-> Array
+ *
+ * Waits up to +timeout+ seconds (forever if nil) for registered IOs
+ * to become ready and returns an Array of at most +max_events+ ready
+ * IOs.  Returns an empty Array on timeout, or if the wait was
+ * interrupted.  Other threads may run while this waits.
+ *
+ * The same Array is returned by every call and overwritten by the
+ * next one, so nothing is allocated per call.  Callers which need to
+ * keep the IOs around must copy it.
+ */
+static VALUE poller_wait(int argc, VALUE *argv, VALUE self)
+{
+	struct kgio_poller *p = poller_of(self);
+	VALUE timeout, max_events;
+	struct wait_args w;
+	int i, n;
+
+	rb_scan_args(argc, argv, "02", &timeout, &max_events);
+	w.maxevents = NIL_P(max_events) ? p->capa : NUM2INT(max_events);
+	if (w.maxevents <= 0)
+		rb_raise(rb_eArgError, "max_events must be positive");
+	if (w.maxevents > p->capa) {
+		REALLOC_N(p->events, struct epoll_event, w.maxevents);
+		p->capa = w.maxevents;
+	}
+	w.fd = p->fd;
+	w.timeout = timeout_ms(timeout);
+	w.events = p->events;
+	if (w.timeout == 0)
+		n = (int)nogvl_wait(&w);
+	else
+		n = blocking_wait(&w);
+	if (n < 0 && errno != EINTR)
+		rb_sys_fail("epoll_wait");
+	rb_ary_clear(p->ready);
+	for (i = 0; i < n; i++) {
+		VALUE io = rb_ary_entry(p->ios, p->events[i].data.fd);
+
+		if (!NIL_P(io))
+			rb_ary_push(p->ready, io);
+	}
+	return p->ready;
+}
+
+/*
+ * call-seq:
+ *
+ *	poller.close	-> nil
+ *
+ * Closes the epoll descriptor and forgets every registered IO.
+ */
+static VALUE poller_close(VALUE self)
+{
+	struct kgio_poller *p = poller_of(self);
+	int fd = p->fd;
+
+	p->fd = -1;
+	p->ios = rb_ary_new();
+	if (close(fd) != 0)
+		rb_sys_fail("close");
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *
+ *	poller.closed?	-> true or false
+ *
+ * Returns true if Kgio::Poller#close was called.
+ */
+static VALUE poller_closed_p(VALUE self)
+{
+	struct kgio_poller *p;
+
+	Data_Get_Struct(self, struct kgio_poller, p);
+	return p->fd < 0 ? Qtrue : Qfalse;
+}
+
+void init_kgio_poller(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE cPoller;
+
+	/*
+	 * Document-class: Kgio::Poller
+	 *
+	 * An epoll(7) readiness notifier for driving many Kgio sockets
+	 * and pipes from one thread with the kgio_try* methods, without
+	 * the per-call cost of IO.select.
+	 *
+	 *	poller = Kgio::Poller.new
+	 *	poller.add(client, Kgio::Poller::IN | Kgio::Poller::ET)
+	 *	loop do
+	 *	  poller.wait.each do |io|
+	 *	    case buf = io.kgio_tryread(16384)
+	 *	    ...
+	 *	    end
+	 *	  end
+	 *	end
+	 *
+	 * Only available on systems with epoll (Linux).
+	 */
+	cPoller = rb_define_class_under(mKgio, "Poller", rb_cObject);
+	rb_define_alloc_func(cPoller, poller_alloc);
+
+	/* readable, EPOLLIN */
+	rb_define_const(cPoller, "IN", UINT2NUM(EPOLLIN));
+	/* writable, EPOLLOUT */
+	rb_define_const(cPoller, "OUT", UINT2NUM(EPOLLOUT));
+	/* edge-triggered, EPOLLET */
+	rb_define_const(cPoller, "ET", UINT2NUM(EPOLLET));
+	/* disabled after one event until re-added, EPOLLONESHOT */
+	rb_define_const(cPoller, "ONESHOT", UINT2NUM(EPOLLONESHOT));
+
+	rb_define_method(cPoller, "initialize", poller_init, -1);
+	rb_define_method(cPoller, "add", poller_add, -1);
+	rb_define_method(cPoller, "delete", poller_delete, 1);
+	rb_define_method(cPoller, "wait", poller_wait, -1);
+	rb_define_method(cPoller, "close", poller_close, 0);
+	rb_define_method(cPoller, "closed?", poller_closed_p, 0);
+}
+#else /* ! HAVE_SYS_EPOLL_H */
+void init_kgio_poller(void)
+{
+}
+#endif /* ! HAVE_SYS_EPOLL_H */
@@ -0,0 +1,560 @@
+#include "kgio.h"
+#include "missing/memmem.h"
+static VALUE mKgio_WaitReadable;
+
+#define RBUF_CHUNK 16384
+
+/*
+ * slices smaller than this are copied, since sharing the backing
+ * String forces the next fill to allocate a new one
+ */
+#define RBUF_SHARE_MIN 512
+
+/*
+ * Unconsumed data lives in [off, off + len) of a private String used as
+ * a byte array.  Space freed by consume() at the front is reclaimed by
+ * moving leftover bytes to the front when more room is needed, which
+ * is cheap since leftovers between requests are usually small.
+ *
+ * Once a slice sharing the backing String was handed out, we never
+ * write to that String again: the next fill copies the leftover bytes
+ * into a new one instead.
+ */
+struct kgio_rbuf {
+	VALUE io;
+	VALUE str; /* backing store, nil when empty and shrunk */
+	long off;
+	long len;
+	long scanned; /* bytes from off already searched for a delimiter */
+	long chunk; /* minimum read size */
+	int shared;
+};
+
+static void rbuf_mark(void *ptr)
+{
+	struct kgio_rbuf *b = ptr;
+
+	rb_gc_mark(b->io);
+	rb_gc_mark(b->str);
+}
+
+static VALUE rbuf_alloc(VALUE klass)
+{
+	struct kgio_rbuf *b;
+	VALUE self = Data_Make_Struct(klass, struct kgio_rbuf,
+	                              rbuf_mark, -1, b);
+
+	b->io = b->str = Qnil;
+	b->chunk = RBUF_CHUNK;
+	return self;
+}
+
+static struct kgio_rbuf *rbuf_of(VALUE self)
+{
+	struct kgio_rbuf *b;
+
+	Data_Get_Struct(self, struct kgio_rbuf, b);
+	if (NIL_P(b->io))
+		rb_raise(rb_eArgError, "uninitialized Kgio::ReadBuffer");
+	return b;
+}
+
+static long rbuf_capa(struct kgio_rbuf *b)
+{
+	return NIL_P(b->str) ? 0 : RSTRING_LEN(b->str);
+}
+
+/* moves leftover bytes into a new backing String of at least capa bytes */
+static void rbuf_realloc(struct kgio_rbuf *b, long capa)
+{
+	VALUE str = rb_str_new(NULL, capa);
+
+	if (b->len)
+		memcpy(RSTRING_PTR(str), RSTRING_PTR(b->str) + b->off, b->len);
+	b->str = str;
+	b->off = 0;
+	b->shared = 0;
+}
+
+/* ensures at least need bytes may be written after the leftover data */
+static char *rbuf_reserve(struct kgio_rbuf *b, long need)
+{
+	long capa = rbuf_capa(b);
+
+	if (b->shared || b->len + need > capa) {
+		long want = b->len + need;
+
+		if (!b->shared && want < capa * 2)
+			want = capa * 2;
+		rbuf_realloc(b, want);
+	} else if (b->off + b->len + need > capa) {
+		memmove(RSTRING_PTR(b->str),
+		        RSTRING_PTR(b->str) + b->off, b->len);
+		b->off = 0;
+	}
+	return RSTRING_PTR(b->str) + b->off + b->len;
+}
+
+/*
+ * reads at least once into the buffer, returns the number of bytes
+ * read.  Otherwise returns zero with *rv set to what the caller
+ * returns: nil on EOF, or (if we are not waiting) Kgio::WaitReadable
+ * or whatever kgio_try* methods return on EOF and disconnects.
+ */
+static long rbuf_fill(struct kgio_rbuf *b, long need, int io_wait, VALUE *rv)
+{
+	struct io_args a;
+	const char *msg;
+	long n;
+
+	if (need < b->chunk)
+		need = b->chunk;
+	a.io = b->io;
+	a.fd = my_fileno(b->io);
+	for (;;) {
+		/* buffer may be modified while we wait */
+		a.ptr = rbuf_reserve(b, need);
+		a.len = rbuf_capa(b) - b->off - b->len;
+		n = kgio_read_raw(&a, &msg);
+		if (n > 0) {
+			b->len += n;
+			return n;
+		}
+		if (n == 0) {
+			*rv = io_wait ? Qnil : kgio_try_eof(b->io);
+			return 0;
+		}
+		if (errno == EAGAIN) {
+			if (!io_wait) {
+				*rv = mKgio_WaitReadable;
+				return 0;
+			}
+			kgio_wait_readable(a.io, a.fd);
+			continue;
+		}
+		if (!io_wait) {
+			*rv = kgio_try_symbol(b->io, errno);
+			if (!NIL_P(*rv))
+				return 0;
+		}
+		kgio_rd_sys_fail(msg);
+	}
+}
+
+static VALUE rbuf_slice(struct kgio_rbuf *b, long off, long len)
+{
+	if (len < RBUF_SHARE_MIN)
+		return rb_str_new(RSTRING_PTR(b->str) + b->off + off, len);
+	b->shared = 1;
+	return rb_str_substr(b->str, b->off + off, len);
+}
+
+static long rbuf_consume(struct kgio_rbuf *b, long n)
+{
+	if (n > b->len)
+		n = b->len;
+	b->off += n;
+	b->len -= n;
+	b->scanned = b->scanned > n ? b->scanned - n : 0;
+	if (b->len == 0)
+		b->off = 0;
+	return n;
+}
+
+/* returns the offset of delim in the buffer, -1 if not found */
+static long
+rbuf_index(struct kgio_rbuf *b, const char *d, long dlen, long off)
+{
+	const char *ptr, *hit;
+
+	if (b->len - off < dlen)
+		return -1;
+	ptr = RSTRING_PTR(b->str) + b->off;
+	if (dlen == 1)
+		hit = memchr(ptr + off, d[0], (size_t)(b->len - off));
+	else
+		hit = memmem(ptr + off, (size_t)(b->len - off),
+		             d, (size_t)dlen);
+	return hit ? (long)(hit - ptr) : -1;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::ReadBuffer.new(io)		-> rbuf
+ *	Kgio::ReadBuffer.new(io, chunk)		-> rbuf
+ *
+ * Creates a read buffer for +io+, each read into it is at least
+ * +chunk+ bytes (default: 16384).  No memory is allocated until the
+ * first read.
+ */
+static VALUE rbuf_init(int argc, VALUE *argv, VALUE self)
+{
+	struct kgio_rbuf *b;
+	VALUE io, chunk;
+
+	Data_Get_Struct(self, struct kgio_rbuf, b);
+	rb_scan_args(argc, argv, "11", &io, &chunk);
+	(void)my_fileno(io);
+	b->io = io;
+	if (!NIL_P(chunk)) {
+		b->chunk = NUM2LONG(chunk);
+		if (b->chunk <= 0)
+			rb_raise(rb_eArgError, "chunk must be positive");
+	}
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.io		-> io
+ *
+ * Returns the IO this buffer reads from.
+ */
+static VALUE rbuf_io(VALUE self)
+{
+	return rbuf_of(self)->io;
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.size	-> Integer
+ *
+ * Returns the number of bytes read but not yet consumed.
+ */
+static VALUE rbuf_size(VALUE self)
+{
+	return LONG2NUM(rbuf_of(self)->len);
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.capacity	-> Integer
+ *
+ * Returns the number of bytes currently allocated for the buffer.
+ */
+static VALUE rbuf_capacity(VALUE self)
+{
+	return LONG2NUM(rbuf_capa(rbuf_of(self)));
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.tryfill	-> Integer, nil or Kgio::WaitReadable
+ *
+ * Reads whatever is available from the IO (at least +chunk+ bytes
+ * if possible) and appends it to the buffer.
+ *
+ * Returns the number of bytes read, nil on EOF, or
+ * Kgio::WaitReadable if EAGAIN is encountered.
+ */
+static VALUE rbuf_tryfill(VALUE self)
+{
+	VALUE rv;
+	long n = rbuf_fill(rbuf_of(self), 0, 0, &rv);
+
+	return n > 0 ? LONG2NUM(n) : rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.fill	-> Integer or nil
+ *
+ * Same as Kgio::ReadBuffer#tryfill, except it calls the method
+ * assigned to Kgio.wait_readable, or blocks in a thread-safe manner
+ * until some data is read.
+ */
+static VALUE rbuf_fill_m(VALUE self)
+{
+	VALUE rv;
+	long n = rbuf_fill(rbuf_of(self), 0, 1, &rv);
+
+	return n > 0 ? LONG2NUM(n) : rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.to_s	-> String
+ *
+ * Returns all unconsumed bytes without consuming them.  Large
+ * Strings share memory with the buffer instead of being copied.
+ */
+static VALUE rbuf_to_s(VALUE self)
+{
+	struct kgio_rbuf *b = rbuf_of(self);
+
+	return b->len ? rbuf_slice(b, 0, b->len) : rb_str_new(NULL, 0);
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.slice(offset, length)	-> String or nil
+ *
+ * Returns up to +length+ unconsumed bytes starting at +offset+
+ * without consuming them, or nil if +offset+ is past the end of the
+ * buffer.  Large Strings share memory with the buffer instead of
+ * being copied.
+ */
+static VALUE rbuf_slice_m(VALUE self, VALUE offset, VALUE length)
+{
+	struct kgio_rbuf *b = rbuf_of(self);
+	long off = NUM2LONG(offset);
+	long len = NUM2LONG(length);
+
+	if (off < 0 || len < 0 || off > b->len)
+		return Qnil;
+	if (len > b->len - off)
+		len = b->len - off;
+	return len ? rbuf_slice(b, off, len) : rb_str_new(NULL, 0);
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.consume(n)	-> Integer
+ *
+ * Discards up to +n+ bytes from the front of the buffer, returns the
+ * number of bytes discarded.
+ */
+static VALUE rbuf_consume_m(VALUE self, VALUE n)
+{
+	long len = NUM2LONG(n);
+
+	if (len < 0)
+		rb_raise(rb_eArgError, "negative length %ld given", len);
+	return LONG2NUM(rbuf_consume(rbuf_of(self), len));
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.shift(n)	-> String
+ *
+ * Removes and returns up to +n+ bytes from the front of the buffer.
+ */
+static VALUE rbuf_shift(VALUE self, VALUE n)
+{
+	struct kgio_rbuf *b = rbuf_of(self);
+	long len = NUM2LONG(n);
+	VALUE rv;
+
+	if (len < 0)
+		rb_raise(rb_eArgError, "negative length %ld given", len);
+	if (len > b->len)
+		len = b->len;
+	if (len == 0)
+		return rb_str_new(NULL, 0);
+	rv = rbuf_slice(b, 0, len);
+	rbuf_consume(b, len);
+	return rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.index(delim)		-> Integer or nil
+ *	rbuf.index(delim, offset)	-> Integer or nil
+ *
+ * Returns the offset of the first +delim+ in the unconsumed bytes at
+ * or after +offset+, or nil if it is not found.
+ */
+static VALUE rbuf_index_m(int argc, VALUE *argv, VALUE self)
+{
+	struct kgio_rbuf *b = rbuf_of(self);
+	VALUE delim, offset;
+	long off, rv;
+
+	rb_scan_args(argc, argv, "11", &delim, &offset);
+	StringValue(delim);
+	off = NIL_P(offset) ? 0 : NUM2LONG(offset);
+	if (off < 0 || off > b->len)
+		return Qnil;
+	rv = rbuf_index(b, RSTRING_PTR(delim), RSTRING_LEN(delim), off);
+	return rv < 0 ? Qnil : LONG2NUM(rv);
+}
+
+static VALUE
+rbuf_read_until(int io_wait, VALUE self, VALUE delim, VALUE maxlen)
+{
+	struct kgio_rbuf *b = rbuf_of(self);
+	long dlen, max, pos, n;
+	const char *d;
+	VALUE rv;
+
+	StringValue(delim);
+	dlen = RSTRING_LEN(delim);
+	if (dlen == 0)
+		rb_raise(rb_eArgError, "empty delimiter");
+	max = NUM2LONG(maxlen);
+	if (max <= 0)
+		rb_raise(rb_eArgError, "maxlen must be positive");
+
+	for (;;) {
+		long start = b->scanned - (dlen - 1);
+
+		d = RSTRING_PTR(delim); /* delim may change while we wait */
+		pos = rbuf_index(b, d, dlen, start > 0 ? start : 0);
+		if (pos >= 0) {
+			n = pos + dlen;
+			break;
+		}
+		b->scanned = b->len;
+		if (b->len >= max) {
+			n = max;
+			break;
+		}
+		if (rbuf_fill(b, 0, io_wait, &rv) == 0)
+			return rv;
+	}
+	if (n > max)
+		n = max;
+	b->scanned = 0;
+	return rbuf_shift(self, LONG2NUM(n));
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.tryread_until(delim, maxlen)	-> String, nil or WaitReadable
+ *
+ * Removes and returns the bytes up to and including the first +delim+
+ * from the buffer, reading more from the IO if needed.  If +maxlen+
+ * bytes are buffered without a +delim+, the first +maxlen+ bytes are
+ * returned instead (like IO#gets with a limit).  Buffered bytes are
+ * only searched once, no matter how many reads it takes.
+ *
+ * Returns nil on EOF and Kgio::WaitReadable if EAGAIN is
+ * encountered, any partial frame stays in the buffer.
+ */
+static VALUE rbuf_tryread_until(VALUE self, VALUE delim, VALUE maxlen)
+{
+	return rbuf_read_until(0, self, delim, maxlen);
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.read_until(delim, maxlen)	-> String or nil
+ *
+ * Same as Kgio::ReadBuffer#tryread_until, except it calls the method
+ * assigned to Kgio.wait_readable, or blocks in a thread-safe manner
+ * until a whole frame is buffered.
+ */
+static VALUE rbuf_read_until_m(VALUE self, VALUE delim, VALUE maxlen)
+{
+	return rbuf_read_until(1, self, delim, maxlen);
+}
+
+static VALUE rbuf_read_exactly(int io_wait, VALUE self, VALUE length)
+{
+	struct kgio_rbuf *b = rbuf_of(self);
+	long len = NUM2LONG(length);
+	VALUE rv;
+
+	if (len < 0)
+		rb_raise(rb_eArgError, "negative length %ld given", len);
+	while (b->len < len) {
+		if (rbuf_fill(b, len - b->len, io_wait, &rv) == 0)
+			return rv;
+	}
+	return rbuf_shift(self, length);
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.tryread_exactly(length)	-> String, nil or Kgio::WaitReadable
+ *
+ * Removes and returns exactly +length+ bytes from the buffer, reading
+ * more from the IO if needed.
+ *
+ * Returns nil on EOF and Kgio::WaitReadable if EAGAIN is
+ * encountered, any partial frame stays in the buffer.
+ */
+static VALUE rbuf_tryread_exactly(VALUE self, VALUE length)
+{
+	return rbuf_read_exactly(0, self, length);
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.read_exactly(length)	-> String or nil
+ *
+ * Same as Kgio::ReadBuffer#tryread_exactly, except it calls the
+ * method assigned to Kgio.wait_readable, or blocks in a thread-safe
+ * manner until +length+ bytes are buffered.
+ */
+static VALUE rbuf_read_exactly_m(VALUE self, VALUE length)
+{
+	return rbuf_read_exactly(1, self, length);
+}
+
+/*
+ * call-seq:
+ *
+ *	rbuf.shrink	-> Integer
+ *
+ * Releases memory not needed for unconsumed bytes, e.g. before a
+ * keepalive connection goes idle.  An empty buffer holds no memory
+ * at all afterwards.  Returns the new capacity.
+ */
+static VALUE rbuf_shrink(VALUE self)
+{
+	struct kgio_rbuf *b = rbuf_of(self);
+
+	if (b->len == 0) {
+		b->str = Qnil;
+		b->off = 0;
+		b->shared = 0;
+	} else if (b->len < rbuf_capa(b)) {
+		rbuf_realloc(b, b->len);
+	}
+	return LONG2NUM(rbuf_capa(b));
+}
+
+void init_kgio_read_buffer(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE cReadBuffer;
+
+	mKgio_WaitReadable = rb_const_get(mKgio, rb_intern("WaitReadable"));
+
+	/*
+	 * Document-class: Kgio::ReadBuffer
+	 *
+	 * A growable buffer attached to an IO, useful for keeping
+	 * leftover bytes between requests on keepalive connections
+	 * without String#slice! and String#<< copying them around.
+	 * Frames returned by it share memory with the buffer when
+	 * they are large enough.
+	 *
+	 * ReadBuffer objects are not thread-safe.
+	 */
+	cReadBuffer = rb_define_class_under(mKgio, "ReadBuffer", rb_cObject);
+	rb_define_alloc_func(cReadBuffer, rbuf_alloc);
+	rb_define_method(cReadBuffer, "initialize", rbuf_init, -1);
+	rb_define_method(cReadBuffer, "io", rbuf_io, 0);
+	rb_define_method(cReadBuffer, "size", rbuf_size, 0);
+	rb_define_method(cReadBuffer, "capacity", rbuf_capacity, 0);
+	rb_define_method(cReadBuffer, "tryfill", rbuf_tryfill, 0);
+	rb_define_method(cReadBuffer, "fill", rbuf_fill_m, 0);
+	rb_define_method(cReadBuffer, "to_s", rbuf_to_s, 0);
+	rb_define_method(cReadBuffer, "slice", rbuf_slice_m, 2);
+	rb_define_method(cReadBuffer, "consume", rbuf_consume_m, 1);
+	rb_define_method(cReadBuffer, "shift", rbuf_shift, 1);
+	rb_define_method(cReadBuffer, "index", rbuf_index_m, -1);
+	rb_define_method(cReadBuffer, "tryread_until", rbuf_tryread_until, 2);
+	rb_define_method(cReadBuffer, "read_until", rbuf_read_until_m, 2);
+	rb_define_method(cReadBuffer, "tryread_exactly",
+	                 rbuf_tryread_exactly, 1);
+	rb_define_method(cReadBuffer, "read_exactly", rbuf_read_exactly_m, 1);
+	rb_define_method(cReadBuffer, "shrink", rbuf_shrink, 0);
+}
@@ -0,0 +1,272 @@
+#include "kgio.h"
+static VALUE mKgio_WaitReadable;
+static ID id_rcvlowat;
+
+struct exact_args {
+	VALUE io;
+	VALUE buf;
+	long want;
+	int fd;
+	int sock; /* stream socket */
+	int io_wait;
+};
+
+static void
+prepare_exact(struct exact_args *a, VALUE io, VALUE length, VALUE buf, int sock)
+{
+	int st;
+
+	a->io = io;
+	a->fd = my_fileno(io);
+	a->want = NUM2LONG(length);
+	if (a->want < 0)
+		rb_raise(rb_eArgError, "negative length %ld given", a->want);
+	if (NIL_P(buf)) {
+		buf = rb_str_new(NULL, 0);
+	} else {
+		StringValue(buf);
+		rb_str_modify(buf);
+	}
+	a->buf = buf;
+	st = sock ? KGIO_FD_STREAM : kgio_fd_state(io, a->fd);
+	a->sock = (st & ~KGIO_FD_NONBLOCK) == KGIO_FD_STREAM;
+#ifdef USE_MSG_DONTWAIT
+	if (!a->sock)
+#endif
+		kgio_nonblock(st, a->fd);
+}
+
+/*
+ * While a frame is incomplete, SO_RCVLOWAT is raised so the socket only
+ * becomes readable once (most of) the rest of the frame is queued.  The
+ * original value is kept in a hidden ivar until the frame is done.  It
+ * is capped at half the receive buffer, otherwise the socket might
+ * never become readable.
+ */
+#ifdef SO_RCVLOWAT
+static void lowat_raise(struct exact_args *a, long left)
+{
+	VALUE old = rb_attr_get(a->io, id_rcvlowat);
+	socklen_t len = sizeof(int);
+	int val;
+
+	if (getsockopt(a->fd, SOL_SOCKET, SO_RCVBUF, &val, &len) == -1)
+		return;
+	val /= 2;
+	if (left < val)
+		val = (int)left;
+	if (val <= 1)
+		return;
+	if (NIL_P(old)) {
+		int cur;
+
+		len = sizeof(int);
+		if (getsockopt(a->fd, SOL_SOCKET, SO_RCVLOWAT, &cur, &len))
+			return;
+		old = INT2FIX(cur);
+	}
+	if (setsockopt(a->fd, SOL_SOCKET, SO_RCVLOWAT, &val, sizeof(int)) == 0)
+		rb_ivar_set(a->io, id_rcvlowat, old);
+}
+
+static void lowat_restore(struct exact_args *a)
+{
+	VALUE old = rb_attr_get(a->io, id_rcvlowat);
+	int saved_errno = errno;
+	int val;
+
+	if (NIL_P(old))
+		return;
+	val = FIX2INT(old);
+	(void)setsockopt(a->fd, SOL_SOCKET, SO_RCVLOWAT, &val, sizeof(int));
+	rb_ivar_set(a->io, id_rcvlowat, Qnil);
+	errno = saved_errno;
+}
+#else /* ! SO_RCVLOWAT */
+#  define lowat_raise(a,left) (void)(left)
+#  define lowat_restore(a) (void)(a)
+#endif /* ! SO_RCVLOWAT */
+
+static long exact_read(struct exact_args *a, char *ptr, long len)
+{
+	long n;
+
+	do {
+#ifdef USE_MSG_DONTWAIT
+		if (a->sock)
+			n = (long)recv(a->fd, ptr, (size_t)len, MSG_DONTWAIT);
+		else
+#endif /* USE_MSG_DONTWAIT */
+			n = (long)read(a->fd, ptr, (size_t)len);
+	} while (n == -1 && errno == EINTR);
+	return n;
+}
+
+static VALUE exact_loop(VALUE ptr)
+{
+	struct exact_args *a = (struct exact_args *)ptr;
+	long len, n;
+
+	while ((len = RSTRING_LEN(a->buf)) < a->want) {
+		rb_str_resize(a->buf, a->want);
+		n = exact_read(a, RSTRING_PTR(a->buf) + len, a->want - len);
+		rb_str_set_len(a->buf, n > 0 ? len + n : len);
+		if (n > 0)
+			continue;
+		if (n == 0) {
+			lowat_restore(a);
+			return a->io_wait ? Qnil : kgio_try_eof(a->io);
+		}
+		if (errno != EAGAIN) {
+			VALUE sym = a->io_wait ? Qnil :
+			            kgio_try_symbol(a->io, errno);
+
+			lowat_restore(a);
+			if (!NIL_P(sym))
+				return sym;
+			kgio_rd_sys_fail(a->sock ? "recv" : "read");
+		}
+		if (a->sock)
+			lowat_raise(a, a->want - len);
+		if (!a->io_wait)
+			return mKgio_WaitReadable;
+		kgio_wait_readable(a->io, a->fd);
+	}
+	lowat_restore(a);
+	return a->buf;
+}
+
+static VALUE exact_ensure(VALUE ptr)
+{
+	lowat_restore((struct exact_args *)ptr);
+	return Qnil;
+}
+
+static VALUE
+my_read_exactly(int io_wait, int sock, VALUE io, VALUE length, VALUE buf)
+{
+	struct exact_args a;
+
+	prepare_exact(&a, io, length, buf, sock);
+	a.io_wait = io_wait;
+	if (!io_wait)
+		return exact_loop((VALUE)&a);
+	return rb_ensure(exact_loop, (VALUE)&a, exact_ensure, (VALUE)&a);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_read_exactly(length)		-> buffer or nil
+ *	io.kgio_read_exactly(length, buffer)	-> buffer or nil
+ *
+ * Reads until +buffer+ is +length+ bytes long, appending to it.  A
+ * newly allocated buffer is used if none is given.  This behaves like
+ * IO#read(length), but without holding up other threads or fibers.
+ *
+ * On stream sockets, SO_RCVLOWAT is raised while waiting so the
+ * kernel only reports the socket readable once most of the remaining
+ * data is queued, so large frames take a few wakeups instead of one
+ * for every segment that arrives.  The original value is restored
+ * before this returns.
+ *
+ * Calls the method assigned to Kgio.wait_readable, or blocks in a
+ * thread-safe manner for readability.
+ *
+ * Returns nil on EOF, +buffer+ keeps any partial data read.
+ */
+static VALUE kgio_read_exactly(int argc, VALUE *argv, VALUE io)
+{
+	VALUE length, buf;
+
+	rb_scan_args(argc, argv, "11", &length, &buf);
+	return my_read_exactly(1, 0, io, length, buf);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_tryread_exactly(length, buffer)	-> buffer, nil or WaitReadable
+ *
+ * Same as Kgio::PipeMethods#kgio_read_exactly, except it returns
+ * Kgio::WaitReadable if EAGAIN is encountered before +buffer+ is
+ * complete.  +buffer+ keeps the partial data and should be passed
+ * again once the IO is readable.
+ *
+ * On stream sockets, SO_RCVLOWAT stays raised while the frame is
+ * incomplete, so readiness notifications from IO.select, epoll and
+ * friends are also deferred until most of the frame is queued.  It
+ * is restored once the frame completes, or on EOF and errors.
+ * Callers which give up on an incomplete frame (or go on reading
+ * with other methods) must call kgio_reset_rcvlowat, otherwise
+ * the socket is not reported readable until that much data arrives.
+ */
+static VALUE kgio_tryread_exactly(VALUE io, VALUE length, VALUE buf)
+{
+	return my_read_exactly(0, 0, io, length, buf);
+}
+
+/*
+ * Same as Kgio::PipeMethods#kgio_read_exactly, but always treats the
+ * IO as a stream socket
+ */
+static VALUE kgio_recv_exactly(int argc, VALUE *argv, VALUE io)
+{
+	VALUE length, buf;
+
+	rb_scan_args(argc, argv, "11", &length, &buf);
+	return my_read_exactly(1, 1, io, length, buf);
+}
+
+/*
+ * Same as Kgio::PipeMethods#kgio_tryread_exactly, but always treats
+ * the IO as a stream socket
+ */
+static VALUE kgio_tryrecv_exactly(VALUE io, VALUE length, VALUE buf)
+{
+	return my_read_exactly(0, 1, io, length, buf);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_reset_rcvlowat	-> true or false
+ *
+ * Restores the SO_RCVLOWAT value kgio_tryread_exactly raised while a
+ * frame was incomplete.  Returns true if it was raised, false if
+ * there was nothing to restore.
+ */
+static VALUE kgio_reset_rcvlowat(VALUE io)
+{
+	struct exact_args a;
+
+	a.io = io;
+	if (NIL_P(rb_attr_get(io, id_rcvlowat)))
+		return Qfalse;
+	a.fd = my_fileno(io);
+	lowat_restore(&a);
+	return Qtrue;
+}
+
+void init_kgio_read_exactly(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE mPipeMethods = rb_const_get(mKgio, rb_intern("PipeMethods"));
+	VALUE mSocketMethods = rb_const_get(mKgio, rb_intern("SocketMethods"));
+
+	mKgio_WaitReadable = rb_const_get(mKgio, rb_intern("WaitReadable"));
+	id_rcvlowat = rb_intern("kgio_rcvlowat");
+
+	rb_define_method(mPipeMethods, "kgio_read_exactly",
+	                 kgio_read_exactly, -1);
+	rb_define_method(mPipeMethods, "kgio_tryread_exactly",
+	                 kgio_tryread_exactly, 2);
+	rb_define_method(mSocketMethods, "kgio_read_exactly",
+	                 kgio_recv_exactly, -1);
+	rb_define_method(mSocketMethods, "kgio_tryread_exactly",
+	                 kgio_tryrecv_exactly, 2);
+	rb_define_method(mPipeMethods, "kgio_reset_rcvlowat",
+	                 kgio_reset_rcvlowat, 0);
+	rb_define_method(mSocketMethods, "kgio_reset_rcvlowat",
+	                 kgio_reset_rcvlowat, 0);
+}
@@ -0,0 +1,235 @@
+#include "kgio.h"
+#include "missing/memmem.h"
+static VALUE mKgio_WaitReadable;
+static ID id_until_buf, id_until_off;
+
+/*
+ * Each IO remembers how much of its buffer was already searched for
+ * the delimiter when we last returned Kgio::WaitReadable, so bytes
+ * are only scanned once no matter how many reads a frame takes.
+ */
+struct until_args {
+	VALUE io;
+	VALUE buf;
+	const char *delim;
+	long dlen;
+	long maxlen;
+	long off; /* bytes of buf already searched */
+	int fd;
+	int sock; /* use recv(2) with MSG_DONTWAIT */
+};
+
+static void
+prepare_until(struct until_args *a, VALUE io, VALUE delim, VALUE maxlen,
+              VALUE buf)
+{
+	a->io = io;
+	a->fd = my_fileno(io);
+	StringValue(delim);
+	a->delim = RSTRING_PTR(delim);
+	a->dlen = RSTRING_LEN(delim);
+	if (a->dlen == 0)
+		rb_raise(rb_eArgError, "empty delimiter");
+	a->maxlen = NUM2LONG(maxlen);
+	if (a->maxlen <= 0)
+		rb_raise(rb_eArgError, "maxlen must be positive");
+	StringValue(buf);
+	rb_str_modify(buf);
+	a->buf = buf;
+	a->off = 0;
+	if (rb_attr_get(io, id_until_buf) == buf)
+		a->off = NUM2LONG(rb_attr_get(io, id_until_off));
+}
+
+static VALUE until_save(struct until_args *a, VALUE rv)
+{
+	rb_ivar_set(a->io, id_until_buf, a->buf);
+	rb_ivar_set(a->io, id_until_off, LONG2NUM(a->off));
+	return rv;
+}
+
+/* returns the frame length if delim is in buf, zero if not */
+static long until_scan(struct until_args *a)
+{
+	const char *ptr = RSTRING_PTR(a->buf);
+	long len = RSTRING_LEN(a->buf);
+	long start = a->off - (a->dlen - 1); /* delim may straddle reads */
+	const char *hit;
+
+	/* buf may have been modified since we last saw it */
+	if (a->off > len)
+		start = 0;
+	else if (start < 0)
+		start = 0;
+	if (a->dlen == 1)
+		hit = memchr(ptr + start, a->delim[0], (size_t)(len - start));
+	else
+		hit = memmem(ptr + start, (size_t)(len - start),
+		             a->delim, (size_t)a->dlen);
+	if (hit) {
+		a->off = 0; /* bytes after the frame were not searched */
+		return (long)(hit - ptr) + a->dlen;
+	}
+	a->off = len;
+	return 0;
+}
+
+static long until_read(struct until_args *a, char *ptr, long len)
+{
+	long n;
+
+	do {
+#ifdef USE_MSG_DONTWAIT
+		if (a->sock)
+			n = (long)recv(a->fd, ptr, (size_t)len, MSG_DONTWAIT);
+		else
+#endif /* USE_MSG_DONTWAIT */
+			n = (long)read(a->fd, ptr, (size_t)len);
+	} while (n == -1 && errno == EINTR);
+	return n;
+}
+
+static VALUE
+my_read_until(int io_wait, int sock, VALUE io, VALUE delim, VALUE maxlen,
+              VALUE buf)
+{
+	struct until_args a;
+	long frame, len, n;
+	int st;
+
+	prepare_until(&a, io, delim, maxlen, buf);
+	st = sock ? KGIO_FD_STREAM : kgio_fd_state(io, a.fd);
+#ifdef USE_MSG_DONTWAIT
+	a.sock = (st & ~KGIO_FD_NONBLOCK) == KGIO_FD_STREAM;
+#else
+	a.sock = 0;
+#endif
+	if (!a.sock)
+		kgio_nonblock(st, a.fd);
+
+	while ((frame = until_scan(&a)) == 0) {
+		len = RSTRING_LEN(a.buf);
+		if (len >= a.maxlen) {
+			a.off = 0;
+			frame = a.maxlen;
+			break;
+		}
+		rb_str_resize(a.buf, a.maxlen);
+		n = until_read(&a, RSTRING_PTR(a.buf) + len, a.maxlen - len);
+		rb_str_set_len(a.buf, n > 0 ? len + n : len);
+		if (n > 0)
+			continue;
+		if (n == 0) {
+			VALUE eof = io_wait ? Qnil : kgio_try_eof(io);
+
+			return until_save(&a, eof);
+		}
+		if (errno != EAGAIN) {
+			VALUE sym = io_wait ? Qnil : kgio_try_symbol(io, errno);
+
+			if (!NIL_P(sym))
+				return until_save(&a, sym);
+			kgio_rd_sys_fail(a.sock ? "recv" : "read");
+		}
+		if (!io_wait)
+			return until_save(&a, mKgio_WaitReadable);
+		until_save(&a, Qnil);
+		kgio_wait_readable(io, a.fd);
+	}
+	return until_save(&a, LONG2NUM(frame));
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_tryread_until(delim, maxlen, buf)	-> Integer or nil
+ *
+ * Reads from the IO and appends to +buf+ until +buf+ contains the
+ * String +delim+ or holds +maxlen+ bytes.  Returns the length of the
+ * frame at the start of +buf+: up to and including the first +delim+,
+ * or +maxlen+ if +buf+ filled up without finding +delim+ (like
+ * IO#gets with a limit).  The caller is expected to consume the frame
+ * (e.g. with buf.slice!(0, len)) before calling this again.
+ *
+ * Data already in +buf+ is searched first, so no read is done if it
+ * holds a whole frame.  Only newly read bytes are searched when this
+ * is called again with the same +buf+.
+ *
+ * Returns nil on EOF, +buf+ keeps any partial frame read.
+ *
+ * Returns Kgio::WaitReadable if EAGAIN is encountered, +buf+ keeps
+ * any partial frame read.
+ *
+ *	buf = ""
+ *	case len = io.kgio_tryread_until("\r\n\r\n", 0x4000, buf)
+ *	when Integer
+ *	  head = buf.slice!(0, len)
+ *	  ...
+ *	when Kgio::WaitReadable
+ *	  IO.select([io])
+ *	  retry
+ *	when nil
+ *	  ...
+ *	end
+ */
+static VALUE kgio_tryread_until(VALUE io, VALUE delim, VALUE maxlen, VALUE buf)
+{
+	return my_read_until(0, 0, io, delim, maxlen, buf);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_read_until(delim, maxlen, buf)	-> Integer or nil
+ *
+ * Same as Kgio::PipeMethods#kgio_tryread_until, except it calls the
+ * method assigned to Kgio.wait_readable, or blocks in a thread-safe
+ * manner until a whole frame is in +buf+ or EOF is reached.
+ */
+static VALUE kgio_read_until(VALUE io, VALUE delim, VALUE maxlen, VALUE buf)
+{
+	return my_read_until(1, 0, io, delim, maxlen, buf);
+}
+
+#ifdef USE_MSG_DONTWAIT
+/*
+ * This method may be optimized on some systems (e.g. GNU/Linux) to use
+ * MSG_DONTWAIT to avoid explicitly setting the O_NONBLOCK flag via fcntl.
+ * Otherwise this is the same as Kgio::PipeMethods#kgio_tryread_until
+ */
+static VALUE kgio_tryrecv_until(VALUE io, VALUE delim, VALUE maxlen, VALUE buf)
+{
+	return my_read_until(0, 1, io, delim, maxlen, buf);
+}
+
+/*
+ * This method may be optimized on some systems (e.g. GNU/Linux) to use
+ * MSG_DONTWAIT to avoid explicitly setting the O_NONBLOCK flag via fcntl.
+ * Otherwise this is the same as Kgio::PipeMethods#kgio_read_until
+ */
+static VALUE kgio_recv_until(VALUE io, VALUE delim, VALUE maxlen, VALUE buf)
+{
+	return my_read_until(1, 1, io, delim, maxlen, buf);
+}
+#else /* ! USE_MSG_DONTWAIT */
+#  define kgio_tryrecv_until kgio_tryread_until
+#  define kgio_recv_until kgio_read_until
+#endif /* ! USE_MSG_DONTWAIT */
+
+void init_kgio_read_until(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE mPipeMethods = rb_const_get(mKgio, rb_intern("PipeMethods"));
+	VALUE mSocketMethods = rb_const_get(mKgio, rb_intern("SocketMethods"));
+
+	mKgio_WaitReadable = rb_const_get(mKgio, rb_intern("WaitReadable"));
+	id_until_buf = rb_intern("kgio_until_buf");
+	id_until_off = rb_intern("kgio_until_off");
+
+	rb_define_method(mPipeMethods, "kgio_tryread_until",
+	                 kgio_tryread_until, 3);
+	rb_define_method(mPipeMethods, "kgio_read_until", kgio_read_until, 3);
+	rb_define_method(mSocketMethods, "kgio_tryread_until",
+	                 kgio_tryrecv_until, 3);
+	rb_define_method(mSocketMethods, "kgio_read_until", kgio_recv_until, 3);
+}
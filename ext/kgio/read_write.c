@@ -1,21 +1,32 @@
 #include "kgio.h"
+#include <sys/uio.h>
+#include <limits.h>
+#ifdef HAVE_VMSPLICE
+#  include <sys/ioctl.h>
+#endif
 static VALUE mKgio_WaitReadable, mKgio_WaitWritable;
 static VALUE eErrno_EPIPE, eErrno_ECONNRESET;
+static VALUE exc_eof;
+static VALUE sym_eof, sym_epipe, sym_econnreset, sym_econnrefused;
+static VALUE sym_more;
+static ID id_new, id_closed_p, id_try_symbols;
 
 /*
- * we know MSG_DONTWAIT works properly on all stream sockets under Linux
- * we can define this macro for other platforms as people care and
- * notice.
+ * we bound the number of iovecs passed to a single readv/writev call
+ * so the iovec array may live on the stack, larger arrays are written
+ * in several batches
  */
-#if defined(__linux__) && ! defined(USE_MSG_DONTWAIT)
-#  define USE_MSG_DONTWAIT
+#if defined(IOV_MAX) && (IOV_MAX < 256)
+#  define KGIO_IOV_MAX IOV_MAX
+#elif defined(IOV_MAX) || defined(UIO_MAXIOV)
+#  define KGIO_IOV_MAX 256
+#else
+#  define KGIO_IOV_MAX 16 /* _XOPEN_IOV_MAX */
 #endif
 
-NORETURN(static void raise_empty_bt(VALUE, const char *));
 NORETURN(static void my_eof_error(void));
-NORETURN(static void wr_sys_fail(const char *));
 
-static void raise_empty_bt(VALUE err, const char *msg)
+void kgio_raise_empty_bt(VALUE err, const char *msg)
 {
 	VALUE exc = rb_exc_new2(err, msg);
 	VALUE bt = rb_ary_new();
@@ -24,34 +35,122 @@ static void raise_empty_bt(VALUE err, const char *msg)
 	rb_exc_raise(exc);
 }
 
+/*
+ * EOF and disconnects are normal traffic for servers, so they are
+ * raised from frozen, backtrace-free templates (one per exception
+ * class and syscall name, e.g. "Broken pipe - write") instead of
+ * formatting a message and setting a backtrace each time.  Ruby needs
+ * a mutable exception to set #cause on: 2.5+ copies frozen ones by
+ * itself and 2.4 fails on them, so we always raise a copy.
+ */
+#define EXC_CACHE_MAX 32
+static struct {
+	VALUE klass;
+	const char *msg;
+} exc_keys[EXC_CACHE_MAX];
+static VALUE exc_cache; /* Array parallel to exc_keys */
+static int exc_nr;
+
+static VALUE prealloc_exc(VALUE klass, const char *msg)
+{
+	VALUE exc;
+	int i;
+
+	for (i = 0; i < exc_nr; i++) {
+		if (exc_keys[i].klass == klass && !strcmp(exc_keys[i].msg, msg))
+			return rb_ary_entry(exc_cache, i);
+	}
+	exc = rb_funcall(klass, id_new, 1, rb_str_new2(msg));
+	rb_funcall(exc, rb_intern("set_backtrace"), 1, rb_ary_new());
+	rb_obj_freeze(exc);
+	if (exc_nr < EXC_CACHE_MAX) {
+		exc_keys[exc_nr].klass = klass;
+		exc_keys[exc_nr].msg = msg; /* always a string literal */
+		rb_ary_store(exc_cache, exc_nr++, exc);
+	}
+	return exc;
+}
+
 static void my_eof_error(void)
 {
-	raise_empty_bt(rb_eEOFError, "");
+	rb_exc_raise(rb_obj_dup(exc_eof));
+}
+
+/* ECONNRESET is raised without a backtrace like EOFError */
+void kgio_rd_sys_fail(const char *msg)
+{
+	if (errno == ECONNRESET) {
+		errno = 0;
+		rb_exc_raise(rb_obj_dup(prealloc_exc(eErrno_ECONNRESET, msg)));
+	}
+	rb_sys_fail(msg);
 }
 
-static void wr_sys_fail(const char *msg)
+void kgio_wr_sys_fail(const char *msg)
 {
 	switch (errno) {
 	case EPIPE:
 		errno = 0;
-		raise_empty_bt(eErrno_EPIPE, msg);
+		rb_exc_raise(rb_obj_dup(prealloc_exc(eErrno_EPIPE, msg)));
 	case ECONNRESET:
 		errno = 0;
-		raise_empty_bt(eErrno_ECONNRESET, msg);
+		rb_exc_raise(rb_obj_dup(prealloc_exc(eErrno_ECONNRESET, msg)));
 	}
 	rb_sys_fail(msg);
 }
 
-static void prepare_read(struct io_args *a, int argc, VALUE *argv, VALUE io)
+/*
+ * returns (without raising) the exception for +err+ from syscall +msg+
+ * for callers reporting errors as results, EPIPE and ECONNRESET come
+ * from the preallocated templates
+ */
+VALUE kgio_syserr(int err, const char *msg)
 {
-	VALUE length;
+	switch (err) {
+	case EPIPE: return prealloc_exc(eErrno_EPIPE, msg);
+	case ECONNRESET: return prealloc_exc(eErrno_ECONNRESET, msg);
+	}
+	return rb_funcall(rb_eSystemCallError, id_new, 2,
+	                  rb_str_new2(msg), INT2NUM(err));
+}
 
-	a->io = io;
-	a->fd = my_fileno(io);
-	rb_scan_args(argc, argv, "11", &length, &a->buf);
-	a->len = NUM2LONG(length);
+/*
+ * returns the Symbol kgio_try* methods return instead of raising for
+ * +err+ once they are told to, nil if there is none
+ */
+VALUE kgio_errno_symbol(int err)
+{
+	switch (err) {
+	case EPIPE: return sym_epipe;
+	case ECONNRESET: return sym_econnreset;
+	case ECONNREFUSED: return sym_econnrefused;
+	}
+	return Qnil;
+}
+
+/* only looked up on EOF and errors, so it costs nothing otherwise */
+#define try_symbols(io) RTEST(rb_attr_get((io), id_try_symbols))
+
+/* kgio_errno_symbol(err) if kgio_try_symbols is enabled for +io+ */
+VALUE kgio_try_symbol(VALUE io, int err)
+{
+	return try_symbols(io) ? kgio_errno_symbol(err) : Qnil;
+}
+
+/* what kgio_try* methods on +io+ return on EOF */
+VALUE kgio_try_eof(VALUE io)
+{
+	return try_symbols(io) ? sym_eof : Qnil;
+}
+
+static void prepare_read_buf(struct io_args *a)
+{
+	a->pool = Qnil;
 	if (NIL_P(a->buf)) {
 		a->buf = rb_str_new(NULL, a->len);
+	} else if (kgio_is_pool(a->buf)) {
+		a->pool = a->buf;
+		a->buf = kgio_pool_get(a->pool, a->len);
 	} else {
 		StringValue(a->buf);
 		rb_str_resize(a->buf, a->len);
@@ -59,6 +158,29 @@ static void prepare_read(struct io_args *a, int argc, VALUE *argv, VALUE io)
 	a->ptr = RSTRING_PTR(a->buf);
 }
 
+static void
+prepare_read(struct io_args *a, int io_wait, int argc, VALUE *argv, VALUE io)
+{
+	VALUE length, timeout = Qnil;
+
+	a->io = io;
+	a->fd = my_fileno(io);
+	if (io_wait)
+		rb_scan_args(argc, argv, "12", &length, &a->buf, &timeout);
+	else
+		rb_scan_args(argc, argv, "11", &length, &a->buf);
+	a->deadline = kgio_deadline(timeout);
+	a->len = NUM2LONG(length);
+	prepare_read_buf(a);
+}
+
+/* gives a pooled buffer back if we are not returning it to the caller */
+static void release_read_buf(struct io_args *a)
+{
+	if (!NIL_P(a->pool))
+		kgio_pool_put(a->pool, a->buf);
+}
+
 static int read_check(struct io_args *a, long n, const char *msg, int io_wait)
 {
 	if (n == -1) {
@@ -67,36 +189,174 @@ static int read_check(struct io_args *a, long n, const char *msg, int io_wait)
 		rb_str_set_len(a->buf, 0);
 		if (errno == EAGAIN) {
 			if (io_wait) {
-				kgio_wait_readable(a->io, a->fd);
+				kgio_wait_readable_until(a->io, a->fd,
+				                         a->deadline);
 
 				/* buf may be modified in other thread/fiber */
-				rb_str_resize(a->buf, a->len);
+				if (NIL_P(a->pool))
+					rb_str_resize(a->buf, a->len);
+				else /* private, avoid shrinking it */
+					rb_str_set_len(a->buf, a->len);
 				a->ptr = RSTRING_PTR(a->buf);
 				return -1;
 			} else {
+				release_read_buf(a);
 				a->buf = mKgio_WaitReadable;
 				return 0;
 			}
 		}
-		rb_sys_fail(msg);
+		release_read_buf(a);
+		if (!io_wait) {
+			a->buf = kgio_try_symbol(a->io, errno);
+			if (!NIL_P(a->buf))
+				return 0;
+		}
+		kgio_rd_sys_fail(msg);
 	}
 	rb_str_set_len(a->buf, n);
-	if (n == 0)
-		a->buf = Qnil;
+	if (n == 0) {
+		release_read_buf(a);
+		a->buf = io_wait ? Qnil : kgio_try_eof(a->io);
+	}
 	return 0;
 }
 
+#ifdef USE_MSG_DONTWAIT
+/*
+ * PipeMethods may be used with stream sockets, too, those may use
+ * MSG_DONTWAIT and skip O_NONBLOCK entirely
+ */
+#  define use_dontwait(st) (((st) & ~KGIO_FD_NONBLOCK) == KGIO_FD_STREAM)
+#else
+#  define use_dontwait(st) (0)
+#  ifndef MSG_DONTWAIT
+#    define MSG_DONTWAIT 0
+#  endif
+#endif
+
+/*
+ * reads and writes of at least NOGVL_MIN bytes release the GVL so other
+ * threads may run while the kernel copies data.  The String is pinned
+ * for the duration of the call: read buffers are locked against
+ * modification (as IO#read does) and writes use a frozen String sharing
+ * the same memory, so neither may be moved or freed by another thread.
+ * Smaller calls are cheaper than the GVL handoff and are made directly.
+ *
+ * Only read(2), recv(2), write(2) and send(2) go through here: the
+ * readv/writev and recvmsg/sendmsg paths (including Kgio::WriteQueue)
+ * always hold the GVL, since pinning every String in the Array is not
+ * done for them.
+ */
+#ifdef KGIO_WITHOUT_GVL
+#  define NOGVL_MIN (64 * 1024)
+
+struct nogvl_args {
+	char *ptr;
+	size_t len;
+	int fd;
+	int flags; /* -1 for read(2)/write(2), recv(2)/send(2) flags */
+	int write;
+};
+
+static VALUE nogvl_io(void *ptr)
+{
+	struct nogvl_args *n = ptr;
+
+	if (n->write) {
+		if (n->flags < 0)
+			return (VALUE)write(n->fd, n->ptr, n->len);
+		return (VALUE)send(n->fd, n->ptr, n->len, n->flags);
+	}
+	if (n->flags < 0)
+		return (VALUE)read(n->fd, n->ptr, n->len);
+	return (VALUE)recv(n->fd, n->ptr, n->len, n->flags);
+}
+
+static VALUE nogvl_call(VALUE ptr)
+{
+	return kgio_without_gvl(nogvl_io, (void *)ptr);
+}
+
+static long io_syscall(struct io_args *a, int flags, int wr)
+{
+	struct nogvl_args n;
+	VALUE pin;
+	long off, rv;
+
+	n.ptr = a->ptr;
+	n.len = (size_t)a->len;
+	n.fd = a->fd;
+	n.flags = flags;
+	n.write = wr;
+	if (a->len < NOGVL_MIN)
+		return (long)nogvl_io(&n);
+	if (!wr) {
+		rb_str_locktmp(a->buf);
+		return (long)rb_ensure(nogvl_call, (VALUE)&n,
+		                       rb_str_unlocktmp, a->buf);
+	}
+	off = a->ptr - RSTRING_PTR(a->buf);
+	pin = rb_str_new_frozen(a->buf);
+	n.ptr = RSTRING_PTR(pin) + off;
+	rv = (long)nogvl_call((VALUE)&n);
+	RB_GC_GUARD(pin);
+	return rv;
+}
+#  define do_read(a) io_syscall((a), -1, 0)
+#  define do_recv(a,flags) io_syscall((a), (flags), 0)
+#  define do_write(a) io_syscall((a), -1, 1)
+#  define do_send(a,flags) io_syscall((a), (flags), 1)
+#else /* ! KGIO_WITHOUT_GVL */
+#  define do_read(a) (long)read((a)->fd, (a)->ptr, (a)->len)
+#  define do_recv(a,flags) (long)recv((a)->fd, (a)->ptr, (a)->len, (flags))
+#  define do_write(a) (long)write((a)->fd, (a)->ptr, (a)->len)
+#  define do_send(a,flags) (long)send((a)->fd, (a)->ptr, (a)->len, (flags))
+#endif /* ! KGIO_WITHOUT_GVL */
+
+/*
+ * a single non-blocking read of at most a->len bytes into a->ptr for
+ * callers managing their own buffer (a->buf is ignored).  Returns the
+ * number of bytes read, zero on EOF, or -1 with errno set and *msg
+ * naming the syscall which failed.
+ */
+long kgio_read_raw(struct io_args *a, const char **msg)
+{
+	int st = kgio_fd_state(a->io, a->fd);
+	int dontwait = use_dontwait(st);
+	long n;
+
+	if (!dontwait)
+		kgio_nonblock(st, a->fd);
+	*msg = dontwait ? "recv" : "read";
+	do {
+		if (dontwait)
+			n = (long)recv(a->fd, a->ptr, a->len, MSG_DONTWAIT);
+		else
+			n = (long)read(a->fd, a->ptr, a->len);
+	} while (n == -1 && errno == EINTR);
+	return n;
+}
+
 static VALUE my_read(int io_wait, int argc, VALUE *argv, VALUE io)
 {
 	struct io_args a;
 	long n;
+	int st;
 
-	prepare_read(&a, argc, argv, io);
+	prepare_read(&a, io_wait, argc, argv, io);
 
 	if (a.len > 0) {
-		set_nonblocking(a.fd);
+		st = kgio_fd_state(io, a.fd);
+		if (use_dontwait(st)) {
+retry_recv:
+			n = do_recv(&a, MSG_DONTWAIT);
+			if (read_check(&a, n, "recv", io_wait) != 0)
+				goto retry_recv;
+			return a.buf;
+		}
+		kgio_nonblock(st, a.fd);
 retry:
-		n = (long)read(a.fd, a.ptr, a.len);
+		n = do_read(&a);
 		if (read_check(&a, n, "read", io_wait) != 0)
 			goto retry;
 	}
@@ -106,15 +366,22 @@ retry:
 /*
  * call-seq:
  *
- *	io.kgio_read(maxlen)           ->  buffer
- *	io.kgio_read(maxlen, buffer)   ->  buffer
+ *	io.kgio_read(maxlen)                   ->  buffer
+ *	io.kgio_read(maxlen, buffer)           ->  buffer
+ *	io.kgio_read(maxlen, pool)             ->  buffer
+ *	io.kgio_read(maxlen, buffer, timeout)  ->  buffer
  *
  * Reads at most maxlen bytes from the stream socket.  Returns with a
  * newly allocated buffer, or may reuse an existing buffer if supplied.
+ * If a Kgio::BufferPool is given, the buffer is taken from it.
  *
  * Calls the method assigned to Kgio.wait_readable, or blocks in a
  * thread-safe manner for writability.
  *
+ * Raises Kgio::Timeout (without a backtrace) if nothing could be read
+ * within +timeout+ seconds, or within the kgio_timeout of the IO if
+ * +timeout+ is nil.
+ *
  * Returns nil on EOF.
  *
  * This behaves like read(2) and IO#readpartial, NOT fread(3) or
@@ -144,9 +411,11 @@ static VALUE kgio_read_bang(int argc, VALUE *argv, VALUE io)
  *
  *	io.kgio_tryread(maxlen)           ->  buffer
  *	io.kgio_tryread(maxlen, buffer)   ->  buffer
+ *	io.kgio_tryread(maxlen, pool)     ->  buffer
  *
  * Reads at most maxlen bytes from the stream socket.  Returns with a
  * newly allocated buffer, or may reuse an existing buffer if supplied.
+ * If a Kgio::BufferPool is given, the buffer is taken from it.
  *
  * Returns nil on EOF.
  *
@@ -163,11 +432,11 @@ static VALUE my_recv(int io_wait, int argc, VALUE *argv, VALUE io)
 	struct io_args a;
 	long n;
 
-	prepare_read(&a, argc, argv, io);
+	prepare_read(&a, io_wait, argc, argv, io);
 
 	if (a.len > 0) {
 retry:
-		n = (long)recv(a.fd, a.ptr, a.len, MSG_DONTWAIT);
+		n = do_recv(&a, MSG_DONTWAIT);
 		if (read_check(&a, n, "recv", io_wait) != 0)
 			goto retry;
 	}
@@ -211,186 +480,1353 @@ static VALUE kgio_tryrecv(int argc, VALUE *argv, VALUE io)
 #  define kgio_tryrecv kgio_tryread
 #endif /* USE_MSG_DONTWAIT */
 
-static void prepare_write(struct io_args *a, VALUE io, VALUE str)
+/* SocketMethods#kgio_tryread(length, buf) for other modules */
+VALUE kgio_tryrecv_buf(VALUE io, VALUE length, VALUE buf)
 {
-	a->buf = (TYPE(str) == T_STRING) ? str : rb_obj_as_string(str);
-	a->ptr = RSTRING_PTR(a->buf);
-	a->len = RSTRING_LEN(a->buf);
+	VALUE argv[2];
+
+	argv[0] = length;
+	argv[1] = buf;
+	return kgio_tryrecv(2, argv, io);
+}
+
+#ifdef USE_MSG_DONTWAIT
+#  define PEEK_FLAGS (MSG_DONTWAIT|MSG_PEEK)
+#  define peek_noblock(fd) (void)(fd)
+#else
+#  define PEEK_FLAGS (MSG_PEEK)
+#  define peek_noblock(fd) set_nonblocking(fd)
+#endif
+
+static VALUE my_peek(int io_wait, int argc, VALUE *argv, VALUE io)
+{
+	struct io_args a;
+	long n;
+
+	prepare_read(&a, io_wait, argc, argv, io);
+
+	if (a.len > 0) {
+		peek_noblock(a.fd);
+retry:
+		n = (long)recv(a.fd, a.ptr, a.len, PEEK_FLAGS);
+		if (read_check(&a, n, "recv(MSG_PEEK)", io_wait) != 0)
+			goto retry;
+	}
+	return a.buf;
+}
+
+/*
+ * call-seq:
+ *
+ *	socket.kgio_trypeek(maxlen)           ->  buffer
+ *	socket.kgio_trypeek(maxlen, buffer)   ->  buffer
+ *
+ * Like kgio_tryread, except it uses MSG_PEEK so it does not drain the
+ * socket buffer.  A subsequent read of any type (including another peek)
+ * will return the same data.
+ *
+ * Returns nil on EOF.
+ *
+ * Returns Kgio::WaitReadable if EAGAIN is encountered.
+ */
+static VALUE kgio_trypeek(int argc, VALUE *argv, VALUE io)
+{
+	return my_peek(0, argc, argv, io);
+}
+
+/*
+ * call-seq:
+ *
+ *	socket.kgio_peek(maxlen)           ->  buffer
+ *	socket.kgio_peek(maxlen, buffer)   ->  buffer
+ *	socket.kgio_peek(maxlen, buffer, timeout)   ->  buffer
+ *
+ * Like kgio_read, except it uses MSG_PEEK so it does not drain the
+ * socket buffer.  A subsequent read of any type (including another peek)
+ * will return the same data.  Raises Kgio::Timeout if no data arrives
+ * within +timeout+ seconds.
+ *
+ * Returns nil on EOF.
+ */
+static VALUE kgio_peek(int argc, VALUE *argv, VALUE io)
+{
+	return my_peek(1, argc, argv, io);
+}
+
+struct rdv_args {
+	VALUE io;
+	VALUE buf; /* Array of Strings */
+	long len;
+	int iov_cnt;
+	int fd;
+	struct iovec vec[KGIO_IOV_MAX];
+};
+
+/* (re)sizes every buffer to its requested length and points a->vec at it */
+static void resize_iovec(struct rdv_args *a)
+{
+	int i;
+
+	for (i = 0; i < a->iov_cnt; i++) {
+		VALUE str = rb_ary_entry(a->buf, i);
+
+		/* buf may be modified in other thread/fiber */
+		Check_Type(str, T_STRING);
+		rb_str_resize(str, (long)a->vec[i].iov_len);
+		a->vec[i].iov_base = RSTRING_PTR(str);
+	}
+}
+
+static void
+prepare_readv(struct rdv_args *a, int argc, VALUE *argv, VALUE io)
+{
+	VALUE lengths;
+	long i, cnt;
+
 	a->io = io;
 	a->fd = my_fileno(io);
+	rb_scan_args(argc, argv, "11", &lengths, &a->buf);
+	Check_Type(lengths, T_ARRAY);
+	cnt = RARRAY_LEN(lengths);
+	if (cnt > KGIO_IOV_MAX)
+		rb_raise(rb_eArgError, "too many buffers (max: %d)",
+		         KGIO_IOV_MAX);
+	if (NIL_P(a->buf)) {
+		a->buf = rb_ary_new2(cnt);
+	} else {
+		Check_Type(a->buf, T_ARRAY);
+		if (RARRAY_LEN(a->buf) != cnt)
+			rb_raise(rb_eArgError,
+			         "lengths and buffers differ in size");
+	}
+	a->iov_cnt = (int)cnt;
+	a->len = 0;
+	for (i = 0; i < cnt; i++) {
+		long len = NUM2LONG(rb_ary_entry(lengths, i));
+
+		if (len < 0)
+			rb_raise(rb_eArgError,
+			         "negative length %ld given", len);
+		if (RARRAY_LEN(a->buf) == i)
+			rb_ary_push(a->buf, rb_str_new(NULL, len));
+		a->vec[i].iov_len = (size_t)len;
+		a->len += len;
+	}
+	resize_iovec(a);
 }
 
-static int write_check(struct io_args *a, long n, const char *msg, int io_wait)
+static int readv_check(struct rdv_args *a, long n, const char *msg, int io_wait)
 {
-	if (a->len == n) {
-done:
-		a->buf = Qnil;
-	} else if (n == -1) {
+	int i;
+
+	if (n == -1) {
 		if (errno == EINTR)
 			return -1;
+		for (i = 0; i < a->iov_cnt; i++)
+			rb_str_set_len(rb_ary_entry(a->buf, i), 0);
 		if (errno == EAGAIN) {
-			long written = RSTRING_LEN(a->buf) - a->len;
-
 			if (io_wait) {
-				kgio_wait_writable(a->io, a->fd);
-
-				/* buf may be modified in other thread/fiber */
-				a->len = RSTRING_LEN(a->buf) - written;
-				if (a->len <= 0)
-					goto done;
-				a->ptr = RSTRING_PTR(a->buf) + written;
+				kgio_wait_readable(a->io, a->fd);
+				resize_iovec(a);
 				return -1;
-			} else if (written > 0) {
-				a->buf = rb_str_new(a->ptr, a->len);
 			} else {
-				a->buf = mKgio_WaitWritable;
+				a->buf = mKgio_WaitReadable;
+				return 0;
 			}
-			return 0;
 		}
-		wr_sys_fail(msg);
-	} else {
-		assert(n >= 0 && n < a->len && "write/send syscall broken?");
-		a->ptr += n;
-		a->len -= n;
-		return -1;
+		if (!io_wait) {
+			a->buf = kgio_try_symbol(a->io, errno);
+			if (!NIL_P(a->buf))
+				return 0;
+		}
+		kgio_rd_sys_fail(msg);
+	}
+	if (n == 0) {
+		a->buf = io_wait ? Qnil : kgio_try_eof(a->io);
+		return 0;
+	}
+	for (i = 0; i < a->iov_cnt; i++) {
+		long len = (long)a->vec[i].iov_len;
+
+		if (len > n)
+			len = n;
+		rb_str_set_len(rb_ary_entry(a->buf, i), len);
+		n -= len;
 	}
 	return 0;
 }
 
-static VALUE my_write(VALUE io, VALUE str, int io_wait)
+static VALUE my_readv(int io_wait, int argc, VALUE *argv, VALUE io)
 {
-	struct io_args a;
+	struct rdv_args a;
 	long n;
 
-	prepare_write(&a, io, str);
-	set_nonblocking(a.fd);
+	prepare_readv(&a, argc, argv, io);
+
+	if (a.len > 0) {
+		kgio_nonblock(kgio_fd_state(io, a.fd), a.fd);
 retry:
-	n = (long)write(a.fd, a.ptr, a.len);
-	if (write_check(&a, n, "write", io_wait) != 0)
-		goto retry;
+		n = (long)readv(a.fd, a.vec, a.iov_cnt);
+		if (readv_check(&a, n, "readv", io_wait) != 0)
+			goto retry;
+	}
 	return a.buf;
 }
 
 /*
  * call-seq:
  *
- *	io.kgio_write(str)	-> nil
+ *	io.kgio_readv([len1, len2])           ->  [ buf1, buf2 ]
+ *	io.kgio_readv([len1, len2], buffers)  ->  buffers
  *
- * Returns nil when the write completes.
+ * Reads at most len1 + len2 (+ ...) bytes from the stream with
+ * readv(2), filling each buffer in order up to its given length
+ * before moving on to the next one.  Returns an Array of newly
+ * allocated buffers, or may reuse an existing Array of buffers if
+ * supplied.  Buffers which received no data are left empty.
  *
- * Calls the method Kgio.wait_writable if it is set.  Otherwise this
- * blocks in a thread-safe manner until all data is written or a
- * fatal error occurs.
+ * Calls the method assigned to Kgio.wait_readable, or blocks in a
+ * thread-safe manner for readability.
+ *
+ * Returns nil on EOF.
  */
-static VALUE kgio_write(VALUE io, VALUE str)
+static VALUE kgio_readv(int argc, VALUE *argv, VALUE io)
 {
-	return my_write(io, str, 1);
+	return my_readv(1, argc, argv, io);
 }
 
 /*
  * call-seq:
  *
- *	io.kgio_trywrite(str)	-> nil or Kgio::WaitWritable
- *
- * Returns nil if the write was completed in full.
+ *	io.kgio_tryreadv([len1, len2])           ->  [ buf1, buf2 ]
+ *	io.kgio_tryreadv([len1, len2], buffers)  ->  buffers
  *
- * Returns a String containing the unwritten portion if EAGAIN
- * was encountered, but some portion was successfully written.
+ * Same as Kgio::PipeMethods#kgio_readv, except Kgio::WaitReadable
+ * is returned if EAGAIN is encountered.
  *
- * Returns Kgio::WaitWritable if EAGAIN is encountered and nothing
- * was written.
+ * Returns nil on EOF.
  */
-static VALUE kgio_trywrite(VALUE io, VALUE str)
+static VALUE kgio_tryreadv(int argc, VALUE *argv, VALUE io)
 {
-	return my_write(io, str, 0);
+	return my_readv(0, argc, argv, io);
 }
 
 #ifdef USE_MSG_DONTWAIT
-/*
- * This method behaves like Kgio::PipeMethods#kgio_write, except
- * it will use send(2) with the MSG_DONTWAIT flag on sockets to
- * avoid unnecessary calls to fcntl(2).
- */
-static VALUE my_send(VALUE io, VALUE str, int io_wait)
+static VALUE my_recvmsg(int io_wait, int argc, VALUE *argv, VALUE io)
 {
-	struct io_args a;
+	struct rdv_args a;
+	struct msghdr msg;
 	long n;
 
-	prepare_write(&a, io, str);
+	prepare_readv(&a, argc, argv, io);
+
+	if (a.len > 0) {
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = a.vec;
+		msg.msg_iovlen = a.iov_cnt;
 retry:
-	n = (long)send(a.fd, a.ptr, a.len, MSG_DONTWAIT);
-	if (write_check(&a, n, "send", io_wait) != 0)
-		goto retry;
+		n = (long)recvmsg(a.fd, &msg, MSG_DONTWAIT);
+		if (readv_check(&a, n, "recvmsg", io_wait) != 0)
+			goto retry;
+	}
 	return a.buf;
 }
 
 /*
  * This method may be optimized on some systems (e.g. GNU/Linux) to use
- * MSG_DONTWAIT to avoid explicitly setting the O_NONBLOCK flag via fcntl.
- * Otherwise this is the same as Kgio::PipeMethods#kgio_write
+ * recvmsg(2) with MSG_DONTWAIT to avoid explicitly setting the
+ * O_NONBLOCK flag via fcntl.
+ * Otherwise this is the same as Kgio::PipeMethods#kgio_readv
  */
-static VALUE kgio_send(VALUE io, VALUE str)
+static VALUE kgio_recvmsg(int argc, VALUE *argv, VALUE io)
 {
-	return my_send(io, str, 1);
+	return my_recvmsg(1, argc, argv, io);
 }
 
 /*
  * This method may be optimized on some systems (e.g. GNU/Linux) to use
- * MSG_DONTWAIT to avoid explicitly setting the O_NONBLOCK flag via fcntl.
- * Otherwise this is the same as Kgio::PipeMethods#kgio_trywrite
+ * recvmsg(2) with MSG_DONTWAIT to avoid explicitly setting the
+ * O_NONBLOCK flag via fcntl.
+ * Otherwise this is the same as Kgio::PipeMethods#kgio_tryreadv
  */
-static VALUE kgio_trysend(VALUE io, VALUE str)
+static VALUE kgio_tryrecvmsg(int argc, VALUE *argv, VALUE io)
 {
-	return my_send(io, str, 0);
+	return my_recvmsg(0, argc, argv, io);
 }
 #else /* ! USE_MSG_DONTWAIT */
-#  define kgio_send kgio_write
-#  define kgio_trysend kgio_trywrite
+#  define kgio_recvmsg kgio_readv
+#  define kgio_tryrecvmsg kgio_tryreadv
 #endif /* ! USE_MSG_DONTWAIT */
 
-void init_kgio_read_write(void)
+/*
+ * like read_check for the non-blocking case, but errors are returned
+ * as (unraised) exceptions so one bad IO does not lose data already
+ * read from the others
+ */
+static VALUE read_many_result(struct io_args *a, long n, const char *msg)
 {
-	VALUE mPipeMethods, mSocketMethods;
-	VALUE mKgio = rb_define_module("Kgio");
-
-	mKgio_WaitReadable = rb_const_get(mKgio, rb_intern("WaitReadable"));
-	mKgio_WaitWritable = rb_const_get(mKgio, rb_intern("WaitWritable"));
-
-	/*
-	 * Document-module: Kgio::PipeMethods
-	 *
-	 * This module may be used used to create classes that respond to
-	 * various Kgio methods for reading and writing.  This is included
-	 * in Kgio::Pipe by default.
-	 */
-	mPipeMethods = rb_define_module_under(mKgio, "PipeMethods");
-	rb_define_method(mPipeMethods, "kgio_read", kgio_read, -1);
-	rb_define_method(mPipeMethods, "kgio_read!", kgio_read_bang, -1);
-	rb_define_method(mPipeMethods, "kgio_write", kgio_write, 1);
-	rb_define_method(mPipeMethods, "kgio_tryread", kgio_tryread, -1);
-	rb_define_method(mPipeMethods, "kgio_trywrite", kgio_trywrite, 1);
+	if (n > 0) {
+		rb_str_set_len(a->buf, n);
+		return a->buf;
+	}
+	rb_str_set_len(a->buf, 0);
+	release_read_buf(a);
+	if (n == 0)
+		return kgio_try_eof(a->io);
+	if (errno == EAGAIN)
+		return mKgio_WaitReadable;
+	if (!NIL_P(kgio_try_symbol(a->io, errno)))
+		return kgio_try_symbol(a->io, errno);
+	return kgio_syserr(errno, msg);
+}
 
-	/*
-	 * Document-module: Kgio::SocketMethods
-	 *
-	 * This method behaves like Kgio::PipeMethods, but contains
-	 * optimizations for sockets on certain operating systems
-	 * (e.g. GNU/Linux).
-	 */
-	mSocketMethods = rb_define_module_under(mKgio, "SocketMethods");
-	rb_define_method(mSocketMethods, "kgio_read", kgio_recv, -1);
-	rb_define_method(mSocketMethods, "kgio_read!", kgio_recv_bang, -1);
-	rb_define_method(mSocketMethods, "kgio_write", kgio_send, 1);
-	rb_define_method(mSocketMethods, "kgio_tryread", kgio_tryrecv, -1);
-	rb_define_method(mSocketMethods, "kgio_trywrite", kgio_trysend, 1);
+static VALUE read_many_one(struct io_args *a)
+{
+	long n;
+	int st;
 
-	/*
-	 * Returns the client IPv4 address of the socket in dotted quad
-	 * form as a string.  This is always the value of the
-	 * Kgio::LOCALHOST constant for UNIX domain sockets.
-	 */
-	rb_define_attr(mSocketMethods, "kgio_addr", 1, 1);
+	prepare_read_buf(a);
+	if (a->len == 0)
+		return a->buf;
+	st = kgio_fd_state(a->io, a->fd);
+	if (use_dontwait(st)) {
+		do {
+			n = (long)recv(a->fd, a->ptr, a->len, MSG_DONTWAIT);
+		} while (n == -1 && errno == EINTR);
+		return read_many_result(a, n, "recv");
+	}
+	kgio_nonblock(st, a->fd);
+	do {
+		n = (long)read(a->fd, a->ptr, a->len);
+	} while (n == -1 && errno == EINTR);
+	return read_many_result(a, n, "read");
+}
 
+/*
+ * call-seq:
+ *
+ *	Kgio.tryread_many(ios, maxlen)                   -> Array
+ *	Kgio.tryread_many(ios, maxlen, buffers)          -> Array
+ *	Kgio.tryread_many(ios, maxlen, pool)             -> Array
+ *	Kgio.tryread_many(ios, maxlen, buffers, result)  -> result
+ *
+ * Performs the equivalent of kgio_tryread(maxlen) on every IO in +ios+
+ * in a single method call, which is cheaper than calling kgio_tryread
+ * on each one when many IOs are ready at once.  If given, +buffers+
+ * must be an Array of Strings (or nils) parallel to +ios+, or a
+ * Kgio::BufferPool.
+ *
+ * Returns an Array parallel to +ios+, each element is the buffer
+ * read into, nil on EOF, or Kgio::WaitReadable if EAGAIN was
+ * encountered.
+ *
+ * Errors are not raised, instead the SystemCallError (e.g.
+ * Errno::ECONNRESET) for the failing IO is placed in the Array.  So is
+ * an IOError for an IO which was already closed.
+ *
+ * Polling loops may pass the same +result+ Array every time (with
+ * nil +buffers+ if they have none), it is cleared and filled in
+ * instead of allocating a new Array for each call.
+ */
+static VALUE tryread_many(int argc, VALUE *argv, VALUE mod)
+{
+	VALUE ios, length, bufs, rv;
+	long i, cnt, len;
+	struct io_args a;
+
+	rb_scan_args(argc, argv, "22", &ios, &length, &bufs, &rv);
+	len = NUM2LONG(length);
+	Check_Type(ios, T_ARRAY);
+	if (!NIL_P(bufs) && !kgio_is_pool(bufs))
+		Check_Type(bufs, T_ARRAY);
+	cnt = RARRAY_LEN(ios);
+	if (NIL_P(rv)) {
+		rv = rb_ary_new2(cnt);
+	} else {
+		Check_Type(rv, T_ARRAY);
+		if (rv == ios || rv == bufs)
+			rb_raise(rb_eArgError, "result may not be an argument");
+		rb_ary_clear(rv);
+	}
+	for (i = 0; i < cnt; i++) {
+		a.io = rb_ary_entry(ios, i);
+		if (TYPE(a.io) != T_FILE)
+			a.io = rb_convert_type(a.io, T_FILE, "IO", "to_io");
+
+		/* raising here would lose what the other IOs returned */
+		if (RTEST(rb_funcall(a.io, id_closed_p, 0))) {
+			rb_ary_push(rv, rb_exc_new2(rb_eIOError,
+			                            "closed stream"));
+			continue;
+		}
+		a.fd = my_fileno(a.io);
+		a.len = len;
+		if (NIL_P(bufs) || kgio_is_pool(bufs))
+			a.buf = bufs;
+		else
+			a.buf = rb_ary_entry(bufs, i);
+		rb_ary_push(rv, read_many_one(&a));
+	}
+	return rv;
+}
+
+static void prepare_write(struct io_args *a, VALUE io, VALUE str)
+{
+	a->buf = (TYPE(str) == T_STRING) ? str : rb_obj_as_string(str);
+	a->ptr = RSTRING_PTR(a->buf);
+	a->len = RSTRING_LEN(a->buf);
+	a->io = io;
+	a->fd = my_fileno(io);
+	a->deadline = 0;
+}
+
+static int write_check(struct io_args *a, long n, const char *msg, int io_wait)
+{
+	if (a->len == n) {
+done:
+		a->buf = Qnil;
+	} else if (n == -1) {
+		if (errno == EINTR)
+			return -1;
+		if (errno == EAGAIN) {
+			long written = RSTRING_LEN(a->buf) - a->len;
+
+			if (io_wait) {
+				kgio_wait_writable_until(a->io, a->fd,
+				                         a->deadline);
+
+				/* buf may be modified in other thread/fiber */
+				a->len = RSTRING_LEN(a->buf) - written;
+				if (a->len <= 0)
+					goto done;
+				a->ptr = RSTRING_PTR(a->buf) + written;
+				return -1;
+			} else if (written > 0) {
+				/* shares memory with large Strings, no copy */
+				a->buf = rb_str_substr(a->buf, written, a->len);
+			} else {
+				a->buf = mKgio_WaitWritable;
+			}
+			return 0;
+		}
+		if (!io_wait) {
+			a->buf = kgio_try_symbol(a->io, errno);
+			if (!NIL_P(a->buf))
+				return 0;
+		}
+		kgio_wr_sys_fail(msg);
+	} else {
+		assert(n >= 0 && n < a->len && "write/send syscall broken?");
+		a->ptr += n;
+		a->len -= n;
+		return -1;
+	}
+	return 0;
+}
+
+static VALUE my_write(VALUE io, VALUE str, int io_wait, double deadline)
+{
+	struct io_args a;
+	long n;
+	int st;
+
+	prepare_write(&a, io, str);
+	a.deadline = deadline;
+	st = kgio_fd_state(io, a.fd);
+	if (use_dontwait(st)) {
+retry_send:
+		n = do_send(&a, MSG_DONTWAIT);
+		if (write_check(&a, n, "send", io_wait) != 0)
+			goto retry_send;
+		return a.buf;
+	}
+	kgio_nonblock(st, a.fd);
+retry:
+	n = do_write(&a);
+	if (write_check(&a, n, "write", io_wait) != 0)
+		goto retry;
+	return a.buf;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_write(str)		-> nil
+ *	io.kgio_write(str, timeout)	-> nil
+ *
+ * Returns nil when the write completes.
+ *
+ * Calls the method Kgio.wait_writable if it is set.  Otherwise this
+ * blocks in a thread-safe manner until all data is written or a
+ * fatal error occurs.
+ *
+ * Raises Kgio::Timeout (without a backtrace) if all of +str+ could not
+ * be written within +timeout+ seconds, the amount actually written is
+ * unknown to the caller afterwards.  If +timeout+ is nil, the
+ * kgio_timeout of the IO bounds each wait for writability instead.
+ */
+static VALUE kgio_write(int argc, VALUE *argv, VALUE io)
+{
+	VALUE str, timeout;
+
+	rb_scan_args(argc, argv, "11", &str, &timeout);
+	return my_write(io, str, 1, kgio_deadline(timeout));
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_trywrite(str)	-> nil or Kgio::WaitWritable
+ *
+ * Returns nil if the write was completed in full.
+ *
+ * Returns a String containing the unwritten portion if EAGAIN
+ * was encountered, but some portion was successfully written.
+ *
+ * Returns Kgio::WaitWritable if EAGAIN is encountered and nothing
+ * was written.
+ */
+static VALUE kgio_trywrite(VALUE io, VALUE str)
+{
+	return my_write(io, str, 0, 0);
+}
+
+#ifdef HAVE_VMSPLICE
+/*
+ * vmsplice(2) only pays off once the page mapping overhead is lower
+ * than the cost of copying, smaller writes just use write(2)
+ */
+#define VMSPLICE_MIN 16384
+static ID id_vmsplice_pins, id_vmsplice_total;
+
+/*
+ * vmsplice(2) without SPLICE_F_GIFT leaves the pipe referencing our
+ * pages, so each spliced String is pinned (as a frozen String sharing
+ * its buffer) until the reader has consumed it.  The amount consumed
+ * is what we queued minus what is still in the pipe, data written to
+ * the pipe by others only makes this estimate more conservative.
+ */
+static off_t release_pins(VALUE io, int fd)
+{
+	VALUE pins = rb_attr_get(io, id_vmsplice_pins);
+	VALUE total = rb_attr_get(io, id_vmsplice_total);
+	off_t queued = NIL_P(total) ? 0 : NUM2OFFT(total);
+	int in_pipe;
+
+	if (NIL_P(pins) || RARRAY_LEN(pins) == 0)
+		return queued;
+	if (ioctl(fd, FIONREAD, &in_pipe) == -1)
+		return queued;
+	while (RARRAY_LEN(pins) > 0) {
+		VALUE pin = rb_ary_entry(pins, 0);
+
+		if (NUM2OFFT(rb_ary_entry(pin, 0)) > queued - in_pipe)
+			break;
+		rb_ary_shift(pins);
+	}
+	return queued;
+}
+
+/* records that str must stay pinned until queued bytes are consumed */
+static VALUE add_pin(VALUE io, VALUE pin, VALUE str, off_t queued)
+{
+	VALUE end = OFFT2NUM(queued);
+
+	if (NIL_P(pin)) {
+		VALUE pins = rb_attr_get(io, id_vmsplice_pins);
+
+		if (NIL_P(pins)) {
+			pins = rb_ary_new();
+			rb_ivar_set(io, id_vmsplice_pins, pins);
+		}
+		pin = rb_assoc_new(end, str);
+		rb_ary_push(pins, pin);
+	} else {
+		rb_ary_store(pin, 0, end);
+	}
+	rb_ivar_set(io, id_vmsplice_total, end);
+	return pin;
+}
+
+static VALUE my_vmsplice(VALUE io, VALUE str, int io_wait)
+{
+	struct io_args a;
+	struct iovec vec;
+	VALUE pinned, pin = Qnil;
+	off_t queued;
+	long n;
+
+	prepare_write(&a, io, str);
+	if (a.len < VMSPLICE_MIN)
+		return my_write(io, a.buf, io_wait, 0);
+
+	/* modifications to str by the caller will not touch these pages */
+	pinned = a.buf = rb_str_new_frozen(a.buf);
+	a.ptr = RSTRING_PTR(a.buf);
+	queued = release_pins(io, a.fd);
+	kgio_nonblock(kgio_fd_state(io, a.fd), a.fd);
+retry:
+	vec.iov_base = a.ptr;
+	vec.iov_len = (size_t)a.len;
+	n = (long)vmsplice(a.fd, &vec, 1, SPLICE_F_NONBLOCK);
+	if (n > 0) {
+		queued += n;
+		pin = add_pin(io, pin, pinned, queued);
+	} else if (n == -1 && (errno == EBADF || errno == EINVAL) &&
+	           RSTRING_LEN(pinned) == a.len) {
+		/* not a pipe, nothing was spliced yet */
+		return my_write(io, pinned, io_wait, 0);
+	}
+	if (write_check(&a, n, "vmsplice", io_wait) != 0)
+		goto retry;
+	return a.buf;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_vmsplice(str)	-> nil
+ *
+ * Same as Kgio::PipeMethods#kgio_write, except large Strings are
+ * mapped into the pipe with vmsplice(2) instead of being copied.
+ * Writes smaller than 16K (and writes to non-pipes) use write(2).
+ *
+ * Spliced data stays referenced by the pipe until the reader
+ * consumes it, so kgio keeps a frozen reference to it until then.
+ * Modifying +str+ afterwards is safe, but it will be copied.
+ *
+ * Readers should use read(2), data a reader moves out of the pipe
+ * with splice(2) may still reference the pages after the pipe
+ * is empty.
+ */
+static VALUE kgio_vmsplice(VALUE io, VALUE str)
+{
+	return my_vmsplice(io, str, 1);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_tryvmsplice(str)	-> nil, String or Kgio::WaitWritable
+ *
+ * Same as Kgio::PipeMethods#kgio_trywrite, except large Strings are
+ * mapped into the pipe with vmsplice(2) instead of being copied.
+ * See Kgio::PipeMethods#kgio_vmsplice for caveats.
+ */
+static VALUE kgio_tryvmsplice(VALUE io, VALUE str)
+{
+	return my_vmsplice(io, str, 0);
+}
+#else /* ! HAVE_VMSPLICE */
+static VALUE kgio_vmsplice(VALUE io, VALUE str)
+{
+	return my_write(io, str, 1, 0);
+}
+#  define kgio_tryvmsplice kgio_trywrite
+#endif /* ! HAVE_VMSPLICE */
+
+/*
+ * MSG_MORE tells the kernel more data is coming soon, so it may hold
+ * back a partial segment and coalesce it with the next write
+ */
+#ifndef MSG_MORE
+#  define MSG_MORE 0
+#endif
+
+/*
+ * socket writes take an optional trailing options Hash (:more => true)
+ * after the arguments PipeMethods take, returns the value of :more
+ */
+static VALUE
+scan_send_args(int argc, VALUE *argv, int io_wait, VALUE *str, VALUE *timeout)
+{
+	VALUE opts = Qnil;
+
+	if (argc > 1 && TYPE(argv[argc - 1]) == T_HASH)
+		opts = argv[--argc];
+	*timeout = Qnil;
+	if (io_wait)
+		rb_scan_args(argc, argv, "11", str, timeout);
+	else
+		rb_scan_args(argc, argv, "10", str);
+	return NIL_P(opts) ? Qnil : rb_hash_aref(opts, sym_more);
+}
+
+#ifdef USE_MSG_DONTWAIT
+/*
+ * This method behaves like Kgio::PipeMethods#kgio_write, except
+ * it will use send(2) with the MSG_DONTWAIT flag on sockets to
+ * avoid unnecessary calls to fcntl(2).
+ */
+static VALUE my_send(int argc, VALUE *argv, VALUE io, int io_wait)
+{
+	struct io_args a;
+	VALUE str, timeout;
+	int flags = MSG_DONTWAIT;
+	long n;
+
+	if (RTEST(scan_send_args(argc, argv, io_wait, &str, &timeout)))
+		flags |= MSG_MORE;
+	prepare_write(&a, io, str);
+	a.deadline = kgio_deadline(timeout);
+retry:
+	n = do_send(&a, flags);
+	if (write_check(&a, n, "send", io_wait) != 0)
+		goto retry;
+	return a.buf;
+}
+#else /* ! USE_MSG_DONTWAIT */
+static VALUE my_send(int argc, VALUE *argv, VALUE io, int io_wait)
+{
+	VALUE str, timeout;
+
+	/* without MSG_DONTWAIT we write(2), so :more is only a hint */
+	(void)scan_send_args(argc, argv, io_wait, &str, &timeout);
+	return my_write(io, str, io_wait, kgio_deadline(timeout));
+}
+#endif /* ! USE_MSG_DONTWAIT */
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_write(str)				-> nil
+ *	io.kgio_write(str, timeout)			-> nil
+ *	io.kgio_write(str, :more => true)		-> nil
+ *	io.kgio_write(str, timeout, :more => true)	-> nil
+ *
+ * This method may be optimized on some systems (e.g. GNU/Linux) to use
+ * MSG_DONTWAIT to avoid explicitly setting the O_NONBLOCK flag via fcntl.
+ * Otherwise this is the same as Kgio::PipeMethods#kgio_write, and
+ * +timeout+ has the same meaning (nil for none).
+ *
+ * If the :more option is true, the kernel is told more data will
+ * follow (MSG_MORE) so small writes such as response headers may be
+ * coalesced with the next write instead of going out as a segment
+ * of their own.  The last write of a response should leave :more
+ * unset (or false) so the data is flushed.  :more is ignored on
+ * systems without MSG_MORE.
+ */
+static VALUE kgio_send(int argc, VALUE *argv, VALUE io)
+{
+	return my_send(argc, argv, io, 1);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_trywrite(str)			-> nil, String or WaitWritable
+ *	io.kgio_trywrite(str, :more => true)	-> nil, String or WaitWritable
+ *
+ * This method may be optimized on some systems (e.g. GNU/Linux) to use
+ * MSG_DONTWAIT to avoid explicitly setting the O_NONBLOCK flag via fcntl.
+ * Otherwise this is the same as Kgio::PipeMethods#kgio_trywrite
+ *
+ * The :more option has the same meaning as it does for
+ * Kgio::SocketMethods#kgio_write.
+ */
+static VALUE kgio_trysend(int argc, VALUE *argv, VALUE io)
+{
+	return my_send(argc, argv, io, 0);
+}
+
+struct wrv_args {
+	VALUE io;
+	VALUE buf; /* Array of Strings */
+	long pos; /* index of the first unwritten element of buf */
+	long off; /* bytes of buf[pos] already written */
+	long written;
+	int iov_cnt;
+	int fd;
+	struct iovec vec[KGIO_IOV_MAX];
+};
+
+static void prepare_writev(struct wrv_args *a, VALUE io, VALUE ary)
+{
+	long i;
+
+	a->buf = rb_Array(ary);
+	for (i = 0; i < RARRAY_LEN(a->buf); i++) {
+		VALUE str = rb_ary_entry(a->buf, i);
+
+		if (TYPE(str) == T_STRING)
+			continue;
+		if (a->buf == ary)
+			a->buf = rb_ary_dup(ary);
+		rb_ary_store(a->buf, i, rb_obj_as_string(str));
+	}
+	a->pos = a->off = a->written = 0;
+	a->io = io;
+	a->fd = my_fileno(io);
+}
+
+/*
+ * fills a->vec with at most KGIO_IOV_MAX unwritten elements of a->buf,
+ * empty Strings are skipped.  a->iov_cnt is zero once everything is
+ * written
+ */
+static void fill_iovec(struct wrv_args *a)
+{
+	long i = a->pos;
+	long off = a->off;
+
+	a->iov_cnt = 0;
+	for (; i < RARRAY_LEN(a->buf) && a->iov_cnt < KGIO_IOV_MAX; i++) {
+		VALUE str = rb_ary_entry(a->buf, i);
+		long len;
+
+		/* buf may be modified in other thread/fiber */
+		Check_Type(str, T_STRING);
+		len = RSTRING_LEN(str) - off;
+		if (len > 0) {
+			a->vec[a->iov_cnt].iov_base = RSTRING_PTR(str) + off;
+			a->vec[a->iov_cnt].iov_len = (size_t)len;
+			a->iov_cnt++;
+		} else if (a->iov_cnt == 0) {
+			a->pos = i + 1;
+			a->off = 0;
+		}
+		off = 0;
+	}
+}
+
+/* advances a->pos and a->off past n successfully written bytes */
+static void consume_iovec(struct wrv_args *a, long n)
+{
+	a->written += n;
+	while (n > 0) {
+		VALUE str = rb_ary_entry(a->buf, a->pos);
+		long len = RSTRING_LEN(str) - a->off;
+
+		if (n < len) {
+			a->off += n;
+			return;
+		}
+		n -= len;
+		a->pos++;
+		a->off = 0;
+	}
+}
+
+/* returns the unwritten portion of a->buf as a new Array */
+static VALUE unwritten_ary(struct wrv_args *a)
+{
+	long len = RARRAY_LEN(a->buf) - a->pos;
+	VALUE rv = rb_ary_subseq(a->buf, a->pos, len);
+
+	if (a->off > 0) {
+		VALUE str = rb_ary_entry(rv, 0);
+
+		str = rb_str_substr(str, a->off, RSTRING_LEN(str) - a->off);
+		rb_ary_store(rv, 0, str);
+	}
+	return rv;
+}
+
+static int
+writev_check(struct wrv_args *a, long n, const char *msg, int io_wait)
+{
+	if (n >= 0) {
+		assert((n > 0 || a->iov_cnt == 0) && "writev syscall broken?");
+		consume_iovec(a, n);
+		return -1;
+	}
+	if (errno == EINTR)
+		return -1;
+	if (errno == EAGAIN) {
+		if (io_wait) {
+			kgio_wait_writable(a->io, a->fd);
+			return -1;
+		} else if (a->written > 0) {
+			a->buf = unwritten_ary(a);
+		} else {
+			a->buf = mKgio_WaitWritable;
+		}
+		return 0;
+	}
+	if (!io_wait) {
+		a->buf = kgio_try_symbol(a->io, errno);
+		if (!NIL_P(a->buf))
+			return 0;
+	}
+	kgio_wr_sys_fail(msg);
+	return 0;
+}
+
+static VALUE my_writev(VALUE io, VALUE ary, int io_wait)
+{
+	struct wrv_args a;
+	long n;
+
+	prepare_writev(&a, io, ary);
+	kgio_nonblock(kgio_fd_state(io, a.fd), a.fd);
+retry:
+	fill_iovec(&a);
+	if (a.iov_cnt == 0)
+		return Qnil;
+	n = (long)writev(a.fd, a.vec, a.iov_cnt);
+	if (writev_check(&a, n, "writev", io_wait) != 0)
+		goto retry;
+	return a.buf;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_writev(array)	-> nil
+ *
+ * Writes every String in +array+ with writev(2), avoiding the need
+ * to concatenate them beforehand.  Elements which are not Strings
+ * are converted with to_s.  Arrays with more elements than the
+ * system allows in a single writev(2) call are written in batches.
+ *
+ * Returns nil when the write completes.
+ *
+ * Calls the method Kgio.wait_writable if it is set.  Otherwise this
+ * blocks in a thread-safe manner until all data is written or a
+ * fatal error occurs.
+ */
+static VALUE kgio_writev(VALUE io, VALUE ary)
+{
+	return my_writev(io, ary, 1);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_trywritev(array)	-> nil, Array or Kgio::WaitWritable
+ *
+ * Returns nil if the write was completed in full.
+ *
+ * Returns an Array of Strings containing the unwritten portion if
+ * EAGAIN was encountered, but some portion was successfully written.
+ *
+ * Returns Kgio::WaitWritable if EAGAIN is encountered and nothing
+ * was written.
+ */
+static VALUE kgio_trywritev(VALUE io, VALUE ary)
+{
+	return my_writev(io, ary, 0);
+}
+
+#ifdef USE_MSG_DONTWAIT
+static VALUE my_sendmsg(VALUE io, VALUE ary, int io_wait)
+{
+	struct wrv_args a;
+	struct msghdr msg;
+	long n;
+
+	prepare_writev(&a, io, ary);
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = a.vec;
+retry:
+	fill_iovec(&a);
+	if (a.iov_cnt == 0)
+		return Qnil;
+	msg.msg_iovlen = a.iov_cnt;
+	n = (long)sendmsg(a.fd, &msg, MSG_DONTWAIT);
+	if (writev_check(&a, n, "sendmsg", io_wait) != 0)
+		goto retry;
+	return a.buf;
+}
+
+/*
+ * This method may be optimized on some systems (e.g. GNU/Linux) to use
+ * sendmsg(2) with MSG_DONTWAIT to avoid explicitly setting the
+ * O_NONBLOCK flag via fcntl.
+ * Otherwise this is the same as Kgio::PipeMethods#kgio_writev
+ */
+static VALUE kgio_sendmsg(VALUE io, VALUE ary)
+{
+	return my_sendmsg(io, ary, 1);
+}
+
+/*
+ * This method may be optimized on some systems (e.g. GNU/Linux) to use
+ * sendmsg(2) with MSG_DONTWAIT to avoid explicitly setting the
+ * O_NONBLOCK flag via fcntl.
+ * Otherwise this is the same as Kgio::PipeMethods#kgio_trywritev
+ */
+static VALUE kgio_trysendmsg(VALUE io, VALUE ary)
+{
+	return my_sendmsg(io, ary, 0);
+}
+#else /* ! USE_MSG_DONTWAIT */
+#  define kgio_sendmsg kgio_writev
+#  define kgio_trysendmsg kgio_trywritev
+#endif /* ! USE_MSG_DONTWAIT */
+
+/*
+ * Kgio::WriteQueue keeps references to pending Strings along with the
+ * position of the first unwritten byte, so partial writes never copy
+ * the unwritten tail.  It reuses struct wrv_args for flushing.
+ */
+struct kgio_wq {
+	VALUE io;
+	VALUE ary; /* pending frozen Strings */
+	long pos; /* index of the first unwritten element of ary */
+	long off; /* bytes of ary[pos] already written */
+	long bytes; /* unwritten bytes */
+};
+
+/* drop written elements once they make up a good part of the Array */
+#define WQ_COMPACT_MIN 64
+
+static void wq_mark(void *ptr)
+{
+	struct kgio_wq *q = ptr;
+
+	rb_gc_mark(q->io);
+	rb_gc_mark(q->ary);
+}
+
+static VALUE wq_alloc(VALUE klass)
+{
+	struct kgio_wq *q;
+	VALUE self = Data_Make_Struct(klass, struct kgio_wq, wq_mark, -1, q);
+
+	q->io = Qnil;
+	q->ary = rb_ary_new();
+	return self;
+}
+
+static struct kgio_wq *wq_of(VALUE self)
+{
+	struct kgio_wq *q;
+
+	Data_Get_Struct(self, struct kgio_wq, q);
+	if (NIL_P(q->io))
+		rb_raise(rb_eArgError, "uninitialized Kgio::WriteQueue");
+	return q;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::WriteQueue.new(io)	-> queue
+ *
+ * Creates an empty output queue for +io+, which may be a socket or
+ * a pipe.
+ */
+static VALUE wq_init(VALUE self, VALUE io)
+{
+	struct kgio_wq *q;
+
+	Data_Get_Struct(self, struct kgio_wq, q);
+	(void)my_fileno(io);
+	q->io = io;
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	queue.push(str)	-> queue
+ *	queue << str	-> queue
+ *
+ * Appends +str+ to the queue without writing anything.  A frozen
+ * copy of +str+ (which shares memory with +str+ if possible) is kept,
+ * so modifying +str+ afterwards does not affect the queue.
+ */
+static VALUE wq_push(VALUE self, VALUE str)
+{
+	struct kgio_wq *q = wq_of(self);
+
+	str = rb_str_new_frozen(TYPE(str) == T_STRING ?
+	                        str : rb_obj_as_string(str));
+	q->bytes += RSTRING_LEN(str);
+	rb_ary_push(q->ary, str);
+	return self;
+}
+
+/* saves the writev state back into q, dropping written elements */
+static void wq_save(struct kgio_wq *q, struct wrv_args *a)
+{
+	long len = RARRAY_LEN(q->ary);
+
+	q->bytes -= a->written;
+	a->written = 0;
+	q->off = a->off;
+	if (a->pos >= len) {
+		rb_ary_clear(q->ary);
+		q->pos = q->off = 0;
+	} else if (a->pos >= WQ_COMPACT_MIN && a->pos * 2 >= len) {
+		q->ary = a->buf = rb_ary_subseq(q->ary, a->pos, len - a->pos);
+		q->pos = a->pos = 0;
+	} else {
+		q->pos = a->pos;
+	}
+}
+
+static VALUE my_wq_flush(VALUE self, int io_wait)
+{
+	struct kgio_wq *q = wq_of(self);
+	struct wrv_args a;
+	struct msghdr msg;
+	int sock, st;
+	long n;
+
+	a.io = q->io;
+	a.fd = my_fileno(q->io);
+	a.buf = q->ary;
+	a.pos = q->pos;
+	a.off = q->off;
+	a.written = 0;
+	st = kgio_fd_state(a.io, a.fd);
+	sock = use_dontwait(st);
+	if (!sock)
+		kgio_nonblock(st, a.fd);
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = a.vec;
+	for (;;) {
+		fill_iovec(&a);
+		if (a.iov_cnt == 0)
+			break;
+		if (sock) {
+			msg.msg_iovlen = a.iov_cnt;
+			n = (long)sendmsg(a.fd, &msg, MSG_DONTWAIT);
+		} else {
+			n = (long)writev(a.fd, a.vec, a.iov_cnt);
+		}
+		if (n >= 0) {
+			consume_iovec(&a, n);
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		wq_save(q, &a);
+		if (errno != EAGAIN)
+			kgio_wr_sys_fail(sock ? "sendmsg" : "writev");
+		if (!io_wait)
+			return mKgio_WaitWritable;
+		kgio_wait_writable(a.io, a.fd);
+	}
+	wq_save(q, &a);
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *
+ *	queue.tryflush	-> nil or Kgio::WaitWritable
+ *
+ * Writes as much of the queue as possible with writev(2) (or
+ * sendmsg(2) on stream sockets), in batches if needed.
+ *
+ * Returns nil once the queue is empty, or Kgio::WaitWritable if
+ * EAGAIN is encountered.  Written data is never copied, so a slow
+ * client costs no more CPU than a fast one.
+ */
+static VALUE wq_tryflush(VALUE self)
+{
+	return my_wq_flush(self, 0);
+}
+
+/*
+ * call-seq:
+ *
+ *	queue.flush	-> nil
+ *
+ * Same as Kgio::WriteQueue#tryflush, except it calls the method
+ * assigned to Kgio.wait_writable, or blocks in a thread-safe manner
+ * until the queue is empty.
+ */
+static VALUE wq_flush(VALUE self)
+{
+	return my_wq_flush(self, 1);
+}
+
+/*
+ * call-seq:
+ *
+ *	queue.bytes	-> Integer
+ *
+ * Returns the number of bytes waiting to be written, useful for
+ * applying backpressure to whatever is producing the output.
+ */
+static VALUE wq_bytes(VALUE self)
+{
+	return LONG2NUM(wq_of(self)->bytes);
+}
+
+/*
+ * call-seq:
+ *
+ *	queue.empty?	-> true or false
+ *
+ * Returns true if there is nothing left to write.
+ */
+static VALUE wq_empty_p(VALUE self)
+{
+	return wq_of(self)->bytes == 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *
+ *	queue.clear	-> Integer
+ *
+ * Discards everything not yet written (e.g. after the peer went
+ * away) and returns the number of bytes discarded.
+ */
+static VALUE wq_clear(VALUE self)
+{
+	struct kgio_wq *q = wq_of(self);
+	long bytes = q->bytes;
+
+	rb_ary_clear(q->ary);
+	q->pos = q->off = q->bytes = 0;
+	return LONG2NUM(bytes);
+}
+
+/*
+ * call-seq:
+ *
+ *	queue.io	-> io
+ *
+ * Returns the IO this queue writes to.
+ */
+static VALUE wq_io(VALUE self)
+{
+	return wq_of(self)->io;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_try_symbols = true
+ *	io.kgio_try_symbols = false
+ *
+ * When enabled, kgio_tryread, kgio_trypeek, kgio_tryreadv,
+ * kgio_tryread_until, kgio_tryread_exactly, kgio_trywrite and
+ * kgio_trywritev on this IO (as well as Kgio.tryread_many, the try*
+ * methods of Kgio::ReadBuffer and Kgio::WriteQueue#tryflush when they
+ * use it) return :eof instead of nil on EOF, and return :epipe or
+ * :econnreset instead of raising Errno::EPIPE or Errno::ECONNRESET.
+ *
+ * Disconnects are normal traffic for busy servers, this avoids the
+ * cost of creating, raising and rescuing an exception for each one.
+ *
+ * This is off by default, as existing code checks for nil on EOF.
+ * Servers enable it for each client they accept, it never changes
+ * what IOs owned by other code return.
+ */
+static VALUE set_try_symbols(VALUE io, VALUE boolean)
+{
+	switch (TYPE(boolean)) {
+	case T_TRUE:
+	case T_FALSE:
+		rb_ivar_set(io, id_try_symbols, boolean);
+		return boolean;
+	}
+	rb_raise(rb_eTypeError, "not true or false");
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_try_symbols? -> true or false
+ *
+ * Returns true if kgio_try* methods on this IO return Symbols for
+ * EOF and disconnects, see kgio_try_symbols=
+ */
+static VALUE get_try_symbols(VALUE io)
+{
+	return try_symbols(io) ? Qtrue : Qfalse;
+}
+
+void init_kgio_read_write(void)
+{
+	VALUE mPipeMethods, mSocketMethods, cWriteQueue;
+	VALUE mKgio = rb_define_module("Kgio");
+
+	mKgio_WaitReadable = rb_const_get(mKgio, rb_intern("WaitReadable"));
+	mKgio_WaitWritable = rb_const_get(mKgio, rb_intern("WaitWritable"));
+	id_new = rb_intern("new");
+	id_closed_p = rb_intern("closed?");
+	id_try_symbols = rb_intern("kgio_try_symbols");
+
+	rb_define_singleton_method(mKgio, "tryread_many", tryread_many, -1);
+
+	/*
+	 * Document-module: Kgio::PipeMethods
+	 *
+	 * This module may be used used to create classes that respond to
+	 * various Kgio methods for reading and writing.  This is included
+	 * in Kgio::Pipe by default.
+	 */
+	mPipeMethods = rb_define_module_under(mKgio, "PipeMethods");
+	rb_define_method(mPipeMethods, "kgio_read", kgio_read, -1);
+	rb_define_method(mPipeMethods, "kgio_read!", kgio_read_bang, -1);
+	rb_define_method(mPipeMethods, "kgio_write", kgio_write, -1);
+	rb_define_method(mPipeMethods, "kgio_tryread", kgio_tryread, -1);
+	rb_define_method(mPipeMethods, "kgio_trywrite", kgio_trywrite, 1);
+	rb_define_method(mPipeMethods, "kgio_vmsplice", kgio_vmsplice, 1);
+	rb_define_method(mPipeMethods, "kgio_tryvmsplice", kgio_tryvmsplice, 1);
+	rb_define_method(mPipeMethods, "kgio_readv", kgio_readv, -1);
+	rb_define_method(mPipeMethods, "kgio_tryreadv", kgio_tryreadv, -1);
+	rb_define_method(mPipeMethods, "kgio_writev", kgio_writev, 1);
+	rb_define_method(mPipeMethods, "kgio_trywritev", kgio_trywritev, 1);
+	rb_define_method(mPipeMethods, "kgio_try_symbols=", set_try_symbols, 1);
+	rb_define_method(mPipeMethods, "kgio_try_symbols?", get_try_symbols, 0);
+
+	/*
+	 * Document-module: Kgio::SocketMethods
+	 *
+	 * This method behaves like Kgio::PipeMethods, but contains
+	 * optimizations for sockets on certain operating systems
+	 * (e.g. GNU/Linux).
+	 */
+	mSocketMethods = rb_define_module_under(mKgio, "SocketMethods");
+	rb_define_method(mSocketMethods, "kgio_read", kgio_recv, -1);
+	rb_define_method(mSocketMethods, "kgio_read!", kgio_recv_bang, -1);
+	rb_define_method(mSocketMethods, "kgio_write", kgio_send, -1);
+	rb_define_method(mSocketMethods, "kgio_tryread", kgio_tryrecv, -1);
+	rb_define_method(mSocketMethods, "kgio_trypeek", kgio_trypeek, -1);
+	rb_define_method(mSocketMethods, "kgio_peek", kgio_peek, -1);
+	rb_define_method(mSocketMethods, "kgio_trywrite", kgio_trysend, -1);
+	rb_define_method(mSocketMethods, "kgio_readv", kgio_recvmsg, -1);
+	rb_define_method(mSocketMethods, "kgio_tryreadv", kgio_tryrecvmsg, -1);
+	rb_define_method(mSocketMethods, "kgio_writev", kgio_sendmsg, 1);
+	rb_define_method(mSocketMethods, "kgio_trywritev", kgio_trysendmsg, 1);
+	rb_define_method(mSocketMethods, "kgio_try_symbols=",
+	                 set_try_symbols, 1);
+	rb_define_method(mSocketMethods, "kgio_try_symbols?",
+	                 get_try_symbols, 0);
+
+	/*
+	 * Document-class: Kgio::WriteQueue
+	 *
+	 * An output queue for a socket or pipe.  Strings pushed onto it
+	 * are referenced, not copied, and partial writes only advance an
+	 * offset, so large responses to slow clients are never copied.
+	 *
+	 * WriteQueue objects are not thread-safe.
+	 */
+	cWriteQueue = rb_define_class_under(mKgio, "WriteQueue", rb_cObject);
+	rb_define_alloc_func(cWriteQueue, wq_alloc);
+	rb_define_method(cWriteQueue, "initialize", wq_init, 1);
+	rb_define_method(cWriteQueue, "io", wq_io, 0);
+	rb_define_method(cWriteQueue, "push", wq_push, 1);
+	rb_define_method(cWriteQueue, "<<", wq_push, 1);
+	rb_define_method(cWriteQueue, "tryflush", wq_tryflush, 0);
+	rb_define_method(cWriteQueue, "flush", wq_flush, 0);
+	rb_define_method(cWriteQueue, "bytes", wq_bytes, 0);
+	rb_define_method(cWriteQueue, "empty?", wq_empty_p, 0);
+	rb_define_method(cWriteQueue, "clear", wq_clear, 0);
+
+#ifdef HAVE_VMSPLICE
+	id_vmsplice_pins = rb_intern("kgio_vmsplice_pins");
+	id_vmsplice_total = rb_intern("kgio_vmsplice_total");
+#endif
 	eErrno_EPIPE = rb_const_get(rb_mErrno, rb_intern("EPIPE"));
 	eErrno_ECONNRESET = rb_const_get(rb_mErrno, rb_intern("ECONNRESET"));
+	exc_cache = rb_ary_new2(EXC_CACHE_MAX);
+	rb_global_variable(&exc_cache);
+	exc_eof = prealloc_exc(rb_eEOFError, "");
+	sym_eof = ID2SYM(rb_intern("eof"));
+	sym_epipe = ID2SYM(rb_intern("epipe"));
+	sym_econnreset = ID2SYM(rb_intern("econnreset"));
+	sym_econnrefused = ID2SYM(rb_intern("econnrefused"));
+	sym_more = ID2SYM(rb_intern("more"));
 }
@@ -0,0 +1,1139 @@
+#include "kgio.h"
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_CONST_IORING_OP_SPLICE)
+#  include <linux/io_uring.h>
+#  include <sys/syscall.h>
+#  include <sys/mman.h>
+#  include <sys/uio.h>
+#  include <poll.h>
+#  include <endian.h>
+#  include <limits.h>
+#  include <stdint.h>
+#  if defined(__NR_io_uring_setup) && defined(KGIO_WITHOUT_GVL)
+#    define KGIO_RING
+#  endif
+#endif
+
+#ifdef KGIO_RING
+static VALUE sym_op[6];
+static int ring_supported = -1; /* unknown until the first probe */
+
+/*
+ * Each queued operation is a Ruby object in the ring's +ops+ Hash, keyed
+ * by the user_data of its SQE, so everything the kernel may touch stays
+ * reachable (and the Strings pinned) until the final CQE is reaped.
+ * user_data zero is reserved for internal requests (poll and cancel)
+ * whose completions are ignored.
+ */
+enum { OP_ACCEPT, OP_READ, OP_WRITE, OP_WRITEV, OP_SPLICE, OP_CLOSE };
+
+struct ring_op {
+	VALUE io;
+	VALUE buf; /* read buffer, written String, or Array of Strings */
+	VALUE out; /* splice destination */
+	struct iovec *iov;
+	int iovcnt;
+	int iovoff; /* first iovec not completely written */
+	long len; /* bytes wanted or left to write */
+	long off; /* bytes of buf already written */
+	int64_t off_in; /* splice source offset, -1 for none */
+	int fd;
+	int fd_out;
+	int type;
+	int sock; /* stream socket: recv/send instead of read/write */
+	int multishot;
+	int locked; /* buf is locked with rb_str_locktmp */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+};
+
+struct kgio_ring {
+	int fd;
+	int multishot; /* multishot accept, cleared if the kernel refuses */
+	unsigned queued; /* SQEs not yet passed to io_uring_enter */
+	unsigned sq_entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+	unsigned long long seq;
+	VALUE ops; /* Hash: user_data => op, nil once closed */
+	pid_t pid; /* process which may cancel our requests */
+	struct kgio_ring *next; /* on dead_rings */
+};
+
+/*
+ * The +ops+ Hash of an open ring is registered as a GC root, so buffers
+ * the kernel may still write to are never collected along with a ring
+ * which was dropped without Kgio::Ring#close.  The free function of
+ * such a ring may not touch Ruby objects, it only moves the ring to
+ * dead_rings.  reap_dead() cancels and waits for its requests at the
+ * next safe point (the next Kgio::Ring.new, or exit) before the
+ * buffers are let go.
+ */
+static struct kgio_ring *dead_rings;
+
+static int setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+enter(int fd, unsigned submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, submit, min_complete,
+	                    flags, NULL, 0);
+}
+
+static void op_mark(void *ptr)
+{
+	struct ring_op *op = ptr;
+
+	rb_gc_mark(op->io);
+	rb_gc_mark(op->buf);
+	rb_gc_mark(op->out);
+}
+
+static void op_free(void *ptr)
+{
+	struct ring_op *op = ptr;
+
+	xfree(op->iov);
+	xfree(op);
+}
+
+static void ring_unmap(struct kgio_ring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_size);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_size);
+	r->sqes = NULL;
+	r->sq_ring = r->cq_ring = NULL;
+	if (r->fd >= 0)
+		(void)close(r->fd);
+	r->fd = -1;
+}
+
+static void ring_mark(void *ptr)
+{
+	rb_gc_mark(((struct kgio_ring *)ptr)->ops);
+}
+
+static void ring_free(void *ptr)
+{
+	struct kgio_ring *r = ptr;
+
+	if (NIL_P(r->ops)) {
+		ring_unmap(r);
+		xfree(r);
+	} else {
+		r->next = dead_rings;
+		dead_rings = r;
+	}
+}
+
+static void ring_drain(struct kgio_ring *r);
+
+/* releases rings which were garbage collected while still open */
+static void reap_dead(void)
+{
+	while (dead_rings) {
+		struct kgio_ring *r = dead_rings;
+
+		dead_rings = r->next;
+		if (r->pid == getpid())
+			ring_drain(r);
+		ring_unmap(r);
+		rb_gc_unregister_address(&r->ops);
+		xfree(r);
+	}
+}
+
+static void reap_dead_at_exit(VALUE ignored)
+{
+	reap_dead();
+}
+
+static VALUE ring_alloc(VALUE klass)
+{
+	struct kgio_ring *r;
+	VALUE self;
+
+	reap_dead();
+	self = Data_Make_Struct(klass, struct kgio_ring,
+	                        ring_mark, ring_free, r);
+	r->fd = -1;
+	r->ops = Qnil;
+	return self;
+}
+
+static struct kgio_ring *ring_of(VALUE self)
+{
+	struct kgio_ring *r;
+
+	Data_Get_Struct(self, struct kgio_ring, r);
+	if (r->fd < 0)
+		rb_raise(rb_eIOError, "closed ring");
+	return r;
+}
+
+/* io_uring may be compiled in but disabled or too old at runtime */
+static int unsupported(int err)
+{
+	return err == ENOSYS || err == EPERM || err == EACCES || err == EINVAL;
+}
+
+#define RING_FEATURES (IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS)
+
+/* returns zero if every opcode we use is implemented */
+static int probe_ops(int fd)
+{
+	static const int ops[] = {
+		IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+		IORING_OP_READ, IORING_OP_WRITE, IORING_OP_WRITEV,
+		IORING_OP_SPLICE, IORING_OP_CLOSE, IORING_OP_POLL_ADD,
+		IORING_OP_ASYNC_CANCEL
+	};
+	size_t len = sizeof(struct io_uring_probe) +
+	             IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *p = xcalloc(1, len);
+	int rc = 0;
+	size_t i;
+
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+	            p, IORING_OP_LAST) < 0) {
+		rc = -1;
+	} else {
+		for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+			if (ops[i] > p->last_op ||
+			    !(p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+				rc = -1;
+		}
+	}
+	xfree(p);
+	return rc;
+}
+
+static void ring_map(struct kgio_ring *r, struct io_uring_params *p)
+{
+	char *sq, *cq;
+
+	r->sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	r->cq_size = p->cq_off.cqes +
+	             p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_size > r->sq_size)
+			r->sq_size = r->cq_size;
+		r->cq_size = r->sq_size;
+	}
+	r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+		                  MAP_SHARED | MAP_POPULATE, r->fd,
+		                  IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto fail;
+	}
+	r->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = r->sq_ring;
+	cq = r->cq_ring;
+	r->sq_entries = p->sq_entries;
+	r->sq_head = (unsigned *)(sq + p->sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p->sq_off.array);
+	r->cq_head = (unsigned *)(cq + p->cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+	return;
+fail:
+	if (r->sq_ring == MAP_FAILED)
+		r->sq_ring = NULL;
+	if (r->cq_ring == MAP_FAILED)
+		r->cq_ring = NULL;
+	if (r->sqes == MAP_FAILED)
+		r->sqes = NULL;
+	ring_unmap(r);
+	rb_sys_fail("mmap(io_uring)");
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::Ring.supported?	-> true or false
+ *
+ * Returns true if the running kernel provides io_uring with every
+ * operation Kgio::Ring needs (Linux 5.7 or later), false if not.
+ * Kgio::Ring.new raises NotImplementedError when this is false.
+ */
+static VALUE ring_supported_p(VALUE klass)
+{
+	if (ring_supported < 0) {
+		struct io_uring_params p;
+		int fd;
+
+		memset(&p, 0, sizeof(p));
+		fd = setup(2, &p);
+		if (fd < 0) {
+			if (!unsupported(errno))
+				rb_sys_fail("io_uring_setup");
+			ring_supported = 0;
+		} else {
+			ring_supported = (p.features & RING_FEATURES) ==
+			                 RING_FEATURES && probe_ops(fd) == 0;
+			(void)close(fd);
+		}
+	}
+	return ring_supported ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::Ring.new		-> ring
+ *	Kgio::Ring.new(entries)	-> ring
+ *
+ * Creates an io_uring with room for +entries+ (default: 256) queued
+ * operations.  Raises NotImplementedError if io_uring is not usable
+ * on the running kernel, see Kgio::Ring.supported?
+ *
+ * Rings are not thread-safe, use one per thread (or per worker
+ * process).
+ */
+static VALUE ring_init(int argc, VALUE *argv, VALUE self)
+{
+	struct kgio_ring *r;
+	struct io_uring_params p;
+	VALUE entries;
+
+	Data_Get_Struct(self, struct kgio_ring, r);
+	rb_scan_args(argc, argv, "01", &entries);
+	if (ring_supported_p(CLASS_OF(self)) == Qfalse)
+		rb_raise(rb_eNotImpError, "io_uring unusable on this kernel");
+	if (r->fd >= 0)
+		rb_raise(rb_eRuntimeError, "ring already initialized");
+
+	memset(&p, 0, sizeof(p));
+	r->fd = setup(NIL_P(entries) ? 256 : NUM2UINT(entries), &p);
+	if (r->fd < 0)
+		rb_sys_fail("io_uring_setup");
+	(void)fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+	ring_map(r, &p);
+#ifdef IORING_ACCEPT_MULTISHOT
+	r->multishot = 1;
+#endif
+	r->pid = getpid();
+	r->ops = rb_hash_new();
+	rb_gc_register_address(&r->ops);
+	return self;
+}
+
+struct enter_args {
+	int fd;
+	unsigned submit;
+	unsigned min_complete;
+};
+
+static VALUE nogvl_enter(void *ptr)
+{
+	struct enter_args *e = ptr;
+
+	return (VALUE)enter(e->fd, e->submit, e->min_complete,
+	                    IORING_ENTER_GETEVENTS);
+}
+
+/*
+ * submits queued SQEs, waiting for +min_complete+ CQEs without the GVL
+ * if non-zero.  Returns the number of SQEs submitted.
+ */
+static int ring_enter(struct kgio_ring *r, unsigned min_complete)
+{
+	struct enter_args e;
+	int n;
+
+	e.fd = r->fd;
+	e.min_complete = min_complete;
+retry:
+	e.submit = r->queued;
+	if (min_complete)
+		n = (int)kgio_without_gvl(nogvl_enter, &e);
+	else if (e.submit)
+		n = enter(e.fd, e.submit, 0, 0);
+	else
+		return 0;
+	if (n < 0) {
+		switch (errno) {
+		case EINTR:
+			if (min_complete)
+				return 0;
+			goto retry;
+		case EAGAIN:
+		case EBUSY:
+			return 0; /* the caller should reap CQEs first */
+		}
+		rb_sys_fail("io_uring_enter");
+	}
+	r->queued -= (unsigned)n;
+	return n;
+}
+
+/* returns a zeroed SQE, submitting queued ones if the SQ is full */
+static struct io_uring_sqe *ring_sqe(struct kgio_ring *r)
+{
+	unsigned head, tail = *r->sq_tail;
+	unsigned idx;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= r->sq_entries) {
+		ring_enter(r, 0);
+		head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= r->sq_entries)
+			rb_raise(rb_eRuntimeError, "io_uring SQ full");
+	}
+	idx = tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	return sqe;
+}
+
+static void ring_push(struct kgio_ring *r)
+{
+	__atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+}
+
+static void op_prep(struct kgio_ring *r, struct ring_op *op, VALUE key)
+{
+	struct io_uring_sqe *sqe = ring_sqe(r);
+
+	sqe->fd = op->fd;
+	sqe->user_data = NUM2ULL(key);
+	switch (op->type) {
+	case OP_ACCEPT:
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->accept_flags = (unsigned)kgio_accept4_flags();
+#ifdef IORING_ACCEPT_MULTISHOT
+		if (op->multishot) {
+			/* the address would be shared by all CQEs */
+			sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+			break;
+		}
+#endif
+		op->addrlen = (socklen_t)sizeof(op->addr);
+		sqe->addr = (uintptr_t)&op->addr;
+		sqe->addr2 = (uintptr_t)&op->addrlen;
+		break;
+	case OP_READ:
+		sqe->opcode = op->sock ? IORING_OP_RECV : IORING_OP_READ;
+		sqe->addr = (uintptr_t)RSTRING_PTR(op->buf);
+		sqe->len = (unsigned)op->len;
+		if (!op->sock)
+			sqe->off = (uint64_t)-1;
+		break;
+	case OP_WRITE:
+		sqe->opcode = op->sock ? IORING_OP_SEND : IORING_OP_WRITE;
+		sqe->addr = (uintptr_t)(RSTRING_PTR(op->buf) + op->off);
+		sqe->len = (unsigned)op->len;
+		if (!op->sock)
+			sqe->off = (uint64_t)-1;
+		break;
+	case OP_WRITEV:
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr = (uintptr_t)(op->iov + op->iovoff);
+		sqe->len = (unsigned)(op->iovcnt - op->iovoff);
+		sqe->off = (uint64_t)-1;
+		break;
+	case OP_SPLICE:
+		sqe->opcode = IORING_OP_SPLICE;
+		sqe->fd = op->fd_out;
+		sqe->off = (uint64_t)-1;
+		sqe->splice_fd_in = op->fd;
+		sqe->splice_off_in = (uint64_t)op->off_in;
+		sqe->len = (unsigned)op->len;
+		break;
+	case OP_CLOSE:
+		sqe->opcode = IORING_OP_CLOSE;
+	}
+	ring_push(r);
+}
+
+/*
+ * descriptors with O_NONBLOCK set fail with EAGAIN instead of waiting,
+ * so the operation is queued again behind a poll request
+ */
+static void op_poll(struct kgio_ring *r, struct ring_op *op, VALUE key)
+{
+	struct io_uring_sqe *sqe = ring_sqe(r);
+	uint32_t events = op->type == OP_READ || op->type == OP_SPLICE ?
+	                  POLLIN : POLLOUT;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = op->fd;
+	sqe->flags = IOSQE_IO_LINK;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->poll32_events = events;
+	ring_push(r);
+	op_prep(r, op, key);
+}
+
+static VALUE op_queue(VALUE self, struct ring_op *op, VALUE obj)
+{
+	struct kgio_ring *r = ring_of(self);
+	VALUE key = ULL2NUM(++r->seq);
+
+	rb_hash_aset(r->ops, key, obj);
+	op_prep(r, op, key);
+	return self;
+}
+
+static VALUE op_new(VALUE io, int type, struct ring_op **op)
+{
+	VALUE obj = Data_Make_Struct(rb_cObject, struct ring_op,
+	                             op_mark, op_free, *op);
+
+	(*op)->io = io;
+	(*op)->buf = (*op)->out = Qnil;
+	(*op)->fd = my_fileno(io);
+	(*op)->fd_out = -1;
+	(*op)->type = type;
+	return obj;
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.accept(server)	-> ring
+ *
+ * Queues accepts on +server+ (a Kgio::TCPServer or Kgio::UNIXServer).
+ * Each connection is reported by Kgio::Ring#wait as an
+ * [:accept, server, client] triple where +client+ is created like
+ * kgio_accept would (see Kgio.accept_class), with kgio_addr set.
+ *
+ * The accept stays queued until it fails or is cancelled with
+ * Kgio::Ring#cancel, a single multishot request is used where the
+ * kernel supports it (Linux 5.19+).
+ */
+static VALUE ring_accept(VALUE self, VALUE server)
+{
+	struct ring_op *op;
+	VALUE obj = op_new(server, OP_ACCEPT, &op);
+
+	op->multishot = ring_of(self)->multishot;
+	return op_queue(self, op, obj);
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.read(io, maxlen)		-> ring
+ *	ring.read(io, maxlen, buffer)	-> ring
+ *
+ * Queues a read of at most +maxlen+ bytes from +io+, reported as
+ * [:read, io, buffer] or [:read, io, nil] on EOF.  This is recv(2) for
+ * stream sockets and read(2) otherwise.  +buffer+ may not be modified
+ * until the read is reported.
+ */
+static VALUE ring_read(int argc, VALUE *argv, VALUE self)
+{
+	struct ring_op *op;
+	VALUE io, length, buf, obj;
+
+	rb_scan_args(argc, argv, "21", &io, &length, &buf);
+	obj = op_new(io, OP_READ, &op);
+	op->len = NUM2LONG(length);
+	if (op->len < 0 || op->len > INT_MAX)
+		rb_raise(rb_eArgError, "invalid length %ld", op->len);
+	if (NIL_P(buf)) {
+		buf = rb_str_new(NULL, op->len);
+	} else {
+		StringValue(buf);
+		rb_str_resize(buf, op->len);
+	}
+	op->buf = buf;
+	op->sock = kgio_fd_type(io, op->fd) == KGIO_FD_STREAM;
+	rb_str_locktmp(buf);
+	op->locked = 1;
+	return op_queue(self, op, obj);
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.write(io, str)	-> ring
+ *
+ * Queues a write of +str+ to +io+, reported as [:write, io, nil] once
+ * all of it is written.  This is send(2) for stream sockets and
+ * write(2) otherwise, short writes are continued automatically.
+ * +str+ may be modified right away.
+ */
+static VALUE ring_write(VALUE self, VALUE io, VALUE str)
+{
+	struct ring_op *op;
+	VALUE obj = op_new(io, OP_WRITE, &op);
+
+	str = rb_obj_as_string(str);
+	op->buf = rb_str_new_frozen(str);
+	op->len = RSTRING_LEN(op->buf);
+	if (op->len > INT_MAX)
+		rb_raise(rb_eArgError, "String too large for io_uring");
+	op->sock = kgio_fd_type(io, op->fd) == KGIO_FD_STREAM;
+	return op_queue(self, op, obj);
+}
+
+#if defined(IOV_MAX) && (IOV_MAX < 1024)
+#  define RING_IOV_MAX IOV_MAX
+#else
+#  define RING_IOV_MAX 1024
+#endif
+
+/*
+ * call-seq:
+ *
+ *	ring.writev(io, array)	-> ring
+ *
+ * Queues a writev(2) of every String in +array+ to +io+, reported as
+ * [:writev, io, nil] once all of it is written.  Short writes are
+ * continued automatically and the Strings may be modified right away.
+ */
+static VALUE ring_writev(VALUE self, VALUE io, VALUE ary)
+{
+	struct ring_op *op;
+	VALUE obj = op_new(io, OP_WRITEV, &op);
+	long i, cnt;
+
+	Check_Type(ary, T_ARRAY);
+	cnt = RARRAY_LEN(ary);
+	if (cnt > RING_IOV_MAX)
+		rb_raise(rb_eArgError, "too many Strings (%ld > %d)",
+		         cnt, RING_IOV_MAX);
+	op->buf = rb_ary_new2(cnt);
+	op->iov = ALLOC_N(struct iovec, cnt ? cnt : 1);
+	for (i = 0; i < cnt; i++) {
+		VALUE str = rb_obj_as_string(rb_ary_entry(ary, i));
+
+		str = rb_str_new_frozen(str);
+		rb_ary_push(op->buf, str);
+		op->iov[i].iov_base = RSTRING_PTR(str);
+		op->iov[i].iov_len = (size_t)RSTRING_LEN(str);
+		op->len += RSTRING_LEN(str);
+	}
+	op->iovcnt = (int)cnt;
+	return op_queue(self, op, obj);
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.splice(src, dst, len)		-> ring
+ *	ring.splice(src, offset, dst, len)	-> ring
+ *
+ * Queues a splice(2) of at most +len+ bytes from +src+ to +dst+, one
+ * of which must be a pipe.  +offset+ is the position to read from in
+ * a regular file +src+.  Reported as [:splice, src, bytes] or
+ * [:splice, src, nil] on EOF.
+ */
+static VALUE ring_splice(int argc, VALUE *argv, VALUE self)
+{
+	struct ring_op *op;
+	VALUE src, offset, dst, len, obj;
+
+	if (argc == 3)
+		rb_scan_args(argc, argv, "30", &src, &dst, &len);
+	else
+		rb_scan_args(argc, argv, "40", &src, &offset, &dst, &len);
+	obj = op_new(src, OP_SPLICE, &op);
+	op->off_in = argc == 3 ? -1 : (int64_t)NUM2LL(offset);
+	op->out = dst;
+	op->fd_out = my_fileno(dst);
+	op->len = NUM2LONG(len);
+	if (op->len < 0 || op->len > INT_MAX)
+		rb_raise(rb_eArgError, "invalid length %ld", op->len);
+	return op_queue(self, op, obj);
+}
+
+static int my_dup(int fd)
+{
+#ifdef F_DUPFD_CLOEXEC
+	return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+#else
+	int rv = dup(fd);
+
+	if (rv >= 0)
+		(void)fcntl(rv, F_SETFD, FD_CLOEXEC);
+	return rv;
+#endif
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.close_io(io)	-> ring
+ *
+ * Closes +io+ with IO#close and queues the close(2) of a duplicate of
+ * its descriptor, reported as [:close, io, nil].  That last close is
+ * what tears down the socket or pipe, so it happens in the kernel
+ * instead of holding up the caller.
+ */
+static VALUE ring_close_io(VALUE self, VALUE io)
+{
+	struct ring_op *op;
+	VALUE obj = op_new(io, OP_CLOSE, &op);
+	int state;
+
+	ring_of(self);
+	op->fd = my_dup(op->fd);
+	if (op->fd < 0)
+		rb_sys_fail("dup");
+	rb_protect(rb_io_close, io, &state);
+	if (state) {
+		(void)close(op->fd);
+		rb_jump_tag(state);
+	}
+	return op_queue(self, op, obj);
+}
+
+static void op_release(struct ring_op *op)
+{
+	if (op->locked) {
+		op->locked = 0;
+		rb_str_unlocktmp(op->buf);
+	}
+}
+
+static const char *op_name(struct ring_op *op)
+{
+	switch (op->type) {
+	case OP_ACCEPT: return "accept";
+	case OP_READ: return op->sock ? "recv" : "read";
+	case OP_WRITE: return op->sock ? "send" : "write";
+	case OP_WRITEV: return "writev";
+	case OP_SPLICE: return "splice";
+	}
+	return "close";
+}
+
+static void iov_consume(struct ring_op *op, long n)
+{
+	while (n > 0) {
+		struct iovec *v = op->iov + op->iovoff;
+
+		if ((size_t)n < v->iov_len) {
+			v->iov_base = (char *)v->iov_base + n;
+			v->iov_len -= (size_t)n;
+			return;
+		}
+		n -= (long)v->iov_len;
+		op->iovoff++;
+	}
+}
+
+struct accepted_args {
+	int fd;
+	const struct sockaddr *addr;
+};
+
+static VALUE accepted(VALUE ptr)
+{
+	struct accepted_args *a = (struct accepted_args *)ptr;
+
+	return kgio_accepted(a->fd, a->addr);
+}
+
+/* returns Qundef if the operation is still in flight */
+static VALUE op_accept_done(struct kgio_ring *r, struct ring_op *op,
+                            VALUE key, int res, unsigned flags)
+{
+	struct accepted_args a;
+	int state = 0;
+	VALUE rv;
+
+	a.fd = res;
+	a.addr = (struct sockaddr *)&op->addr;
+
+	if (res < 0) {
+		switch (-res) {
+		case EINVAL:
+			if (!op->multishot)
+				return kgio_syserr(-res, "accept");
+			/* kernel without multishot accept */
+			r->multishot = op->multishot = 0;
+			break;
+#ifdef ECONNABORTED
+		case ECONNABORTED:
+#endif
+#ifdef EPROTO
+		case EPROTO:
+#endif
+		case EINTR:
+			break;
+		default:
+			return kgio_syserr(-res, "accept");
+		}
+		if (!(flags & IORING_CQE_F_MORE))
+			op_prep(r, op, key);
+		return Qundef;
+	}
+	if (op->multishot) {
+		op->addrlen = (socklen_t)sizeof(op->addr);
+		if (getpeername(res, (struct sockaddr *)&op->addr,
+		                &op->addrlen) != 0)
+			a.addr = NULL;
+	}
+
+	/* kgio_accepted closes res if it raises, keep accepting anyways */
+	rv = rb_protect(accepted, (VALUE)&a, &state);
+	if (!(flags & IORING_CQE_F_MORE))
+		op_prep(r, op, key);
+	if (state)
+		rb_jump_tag(state);
+	return rv;
+}
+
+/* returns the result of a completed request, Qundef if still pending */
+static VALUE
+op_done(struct kgio_ring *r, struct ring_op *op, VALUE key, int res,
+        unsigned flags)
+{
+	if (op->type == OP_ACCEPT)
+		return op_accept_done(r, op, key, res, flags);
+	if (res == -EAGAIN && op->type != OP_CLOSE) {
+		op_poll(r, op, key);
+		return Qundef;
+	}
+	if (res == -EINTR) {
+		op_prep(r, op, key);
+		return Qundef;
+	}
+	if (res < 0)
+		return kgio_syserr(-res, op_name(op));
+	switch (op->type) {
+	case OP_READ:
+		rb_str_unlocktmp(op->buf);
+		op->locked = 0;
+		rb_str_set_len(op->buf, res);
+		return res == 0 ? Qnil : op->buf;
+	case OP_WRITE:
+		op->off += res;
+		op->len -= res;
+		if (op->len > 0 && res > 0) {
+			op_prep(r, op, key);
+			return Qundef;
+		}
+		return Qnil;
+	case OP_WRITEV:
+		op->len -= res;
+		iov_consume(op, res);
+		if (op->len > 0 && res > 0) {
+			op_prep(r, op, key);
+			return Qundef;
+		}
+		return Qnil;
+	case OP_SPLICE:
+		return res == 0 ? Qnil : INT2NUM(res);
+	}
+	return Qnil;
+}
+
+static void
+op_complete(struct kgio_ring *r, VALUE rv, uint64_t id, int res,
+            unsigned flags)
+{
+	VALUE key = ULL2NUM(id);
+	VALUE obj = rb_hash_lookup(r->ops, key);
+	struct ring_op *op;
+	VALUE result;
+
+	if (NIL_P(obj))
+		return;
+	Data_Get_Struct(obj, struct ring_op, op);
+	result = op_done(r, op, key, res, flags);
+	if (result == Qundef)
+		return;
+	if (op->type != OP_ACCEPT || TYPE(result) != T_FILE) {
+		op_release(op);
+		rb_hash_delete(r->ops, key);
+	}
+	if (!NIL_P(rv))
+		rb_ary_push(rv, rb_ary_new3(3, sym_op[op->type], op->io,
+		                            result));
+}
+
+/* appends [op, io, result] for every CQE to +rv+ (if not nil) */
+static VALUE ring_reap(struct kgio_ring *r, VALUE rv)
+{
+	unsigned head = *r->cq_head;
+
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		uint64_t id = cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+
+		/* release the slot first, completing may queue more work */
+		__atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+		if (id)
+			op_complete(r, rv, id, res, flags);
+	}
+	return rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.submit	-> Integer
+ *
+ * Submits every queued operation to the kernel with a single
+ * io_uring_enter(2) call and returns the number submitted.
+ */
+static VALUE ring_submit(VALUE self)
+{
+	return INT2NUM(ring_enter(ring_of(self), 0));
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.harvest	-> Array
+ *
+ * Returns an Array of [op, io, result] triples for operations which
+ * completed, without entering the kernel.  +op+ is one of :accept,
+ * :read, :write, :writev, :splice or :close and +result+ is described
+ * by the method which queued the operation.  Errors are not raised,
+ * instead the SystemCallError (e.g. Errno::ECONNRESET) is the result.
+ */
+static VALUE ring_harvest(VALUE self)
+{
+	return ring_reap(ring_of(self), rb_ary_new());
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.wait		-> Array
+ *	ring.wait(min)		-> Array
+ *
+ * Submits queued operations and waits for at least +min+ (default: 1)
+ * of them to complete, then returns the same as Kgio::Ring#harvest.
+ * Other threads may run while this waits, but the Array may be empty
+ * if the wait was interrupted.
+ */
+static VALUE ring_wait(int argc, VALUE *argv, VALUE self)
+{
+	struct kgio_ring *r = ring_of(self);
+	VALUE min;
+	unsigned n;
+
+	rb_scan_args(argc, argv, "01", &min);
+	n = NIL_P(min) ? 1 : NUM2UINT(min);
+	if (n && *r->cq_head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		ring_enter(r, n);
+	else
+		ring_enter(r, 0);
+	return ring_reap(r, rb_ary_new());
+}
+
+static void cancel_one(struct kgio_ring *r, VALUE key)
+{
+	struct io_uring_sqe *sqe = ring_sqe(r);
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = NUM2ULL(key);
+	ring_push(r);
+}
+
+struct cancel_args {
+	struct kgio_ring *r;
+	VALUE io;
+};
+
+static int cancel_i(VALUE key, VALUE obj, VALUE arg)
+{
+	struct cancel_args *c = (struct cancel_args *)arg;
+	struct ring_op *op;
+
+	Data_Get_Struct(obj, struct ring_op, op);
+	if (NIL_P(c->io) || op->io == c->io)
+		cancel_one(c->r, key);
+	return ST_CONTINUE;
+}
+
+static void ring_cancel_all(struct kgio_ring *r, VALUE io)
+{
+	struct cancel_args c;
+
+	c.r = r;
+	c.io = io;
+	rb_hash_foreach(r->ops, cancel_i, (VALUE)&c);
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.cancel(io)	-> ring
+ *
+ * Queues cancellation of every operation on +io+, each cancelled
+ * operation is reported with Errno::ECANCELED as its result (unless
+ * it completed first).  This is how a queued accept is stopped.
+ */
+static VALUE ring_cancel(VALUE self, VALUE io)
+{
+	ring_cancel_all(ring_of(self), io);
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.pending	-> Integer
+ *
+ * Returns the number of operations queued or in flight.
+ */
+static VALUE ring_pending(VALUE self)
+{
+	return LONG2NUM((long)RHASH_SIZE(ring_of(self)->ops));
+}
+
+/* cancels every request and waits until the kernel is done with all */
+static void ring_drain(struct kgio_ring *r)
+{
+	ring_cancel_all(r, Qnil);
+	while (RHASH_SIZE(r->ops) > 0) {
+		ring_enter(r, 1);
+		ring_reap(r, Qnil);
+	}
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.close	-> nil
+ *
+ * Cancels everything in flight, waits for the kernel to let go of
+ * the buffers and releases the ring.  Sockets accepted meanwhile are
+ * discarded.
+ */
+static VALUE ring_close(VALUE self)
+{
+	struct kgio_ring *r = ring_of(self);
+
+	ring_drain(r);
+	ring_unmap(r);
+	rb_gc_unregister_address(&r->ops);
+	r->ops = Qnil;
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.closed?	-> true or false
+ *
+ * Returns true if Kgio::Ring#close was called.
+ */
+static VALUE ring_closed_p(VALUE self)
+{
+	struct kgio_ring *r;
+
+	Data_Get_Struct(self, struct kgio_ring, r);
+	return r->fd < 0 ? Qtrue : Qfalse;
+}
+
+static void init_ring_methods(VALUE cRing)
+{
+	static const char *names[] = {
+		"accept", "read", "write", "writev", "splice", "close"
+	};
+	int i;
+
+	for (i = 0; i < 6; i++)
+		sym_op[i] = ID2SYM(rb_intern(names[i]));
+	rb_set_end_proc(reap_dead_at_exit, Qnil);
+
+	rb_define_alloc_func(cRing, ring_alloc);
+	rb_define_method(cRing, "initialize", ring_init, -1);
+	rb_define_method(cRing, "accept", ring_accept, 1);
+	rb_define_method(cRing, "read", ring_read, -1);
+	rb_define_method(cRing, "write", ring_write, 2);
+	rb_define_method(cRing, "writev", ring_writev, 2);
+	rb_define_method(cRing, "splice", ring_splice, -1);
+	rb_define_method(cRing, "close_io", ring_close_io, 1);
+	rb_define_method(cRing, "cancel", ring_cancel, 1);
+	rb_define_method(cRing, "submit", ring_submit, 0);
+	rb_define_method(cRing, "harvest", ring_harvest, 0);
+	rb_define_method(cRing, "wait", ring_wait, -1);
+	rb_define_method(cRing, "pending", ring_pending, 0);
+	rb_define_method(cRing, "close", ring_close, 0);
+	rb_define_method(cRing, "closed?", ring_closed_p, 0);
+}
+#else /* ! KGIO_RING */
+static VALUE ring_supported_p(VALUE klass)
+{
+	return Qfalse;
+}
+
+static void init_ring_methods(VALUE cRing)
+{
+	rb_undef_alloc_func(cRing);
+}
+#endif /* ! KGIO_RING */
+
+void init_kgio_ring(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE cRing;
+
+	/*
+	 * Document-class: Kgio::Ring
+	 *
+	 * Batches accept, read, write, writev, splice and close
+	 * operations on many IOs into a single io_uring(7) submission
+	 * and reports their completions together, so a busy server
+	 * makes far fewer system calls than with one kgio_* call (and
+	 * readiness notification) per operation.
+	 *
+	 *	ring = Kgio::Ring.new
+	 *	ring.accept(server)
+	 *	loop do
+	 *	  ring.wait.each do |op, io, result|
+	 *	    case op
+	 *	    when :accept then ring.read(result, 16384)
+	 *	    when :read then ...
+	 *	    end
+	 *	  end
+	 *	end
+	 *
+	 * Only available on Linux, use Kgio::Ring.supported? to check
+	 * before falling back to the kgio_* methods.
+	 */
+	cRing = rb_define_class_under(mKgio, "Ring", rb_cObject);
+	rb_define_singleton_method(cRing, "supported?", ring_supported_p, 0);
+	init_ring_methods(cRing);
+}
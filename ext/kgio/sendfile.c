@@ -0,0 +1,138 @@
+#include "kgio.h"
+#include <sys/stat.h>
+#include "missing/sendfile.h"
+static VALUE mKgio_WaitWritable;
+
+/* keep each call within the limits of a 32-bit size_t/ssize_t */
+#define SENDFILE_CHUNK ((off_t)1 << 30)
+
+struct sf_args {
+	VALUE io;
+	int out_fd;
+	int in_fd;
+	off_t offset;
+	off_t count; /* bytes left to send */
+	off_t sent;
+};
+
+static void prepare_sendfile(struct sf_args *a, int argc, VALUE *argv, VALUE io)
+{
+	VALUE file, offset, count;
+
+	rb_scan_args(argc, argv, "12", &file, &offset, &count);
+	a->io = io;
+	a->out_fd = my_fileno(io);
+	a->in_fd = my_fileno(file);
+	a->offset = NIL_P(offset) ? 0 : NUM2OFFT(offset);
+	a->sent = 0;
+	if (a->offset < 0)
+		rb_raise(rb_eArgError, "negative offset given");
+
+	if (NIL_P(count)) {
+		struct stat st;
+
+		if (fstat(a->in_fd, &st) == -1)
+			rb_sys_fail("fstat");
+		a->count = st.st_size - a->offset;
+		if (a->count < 0)
+			a->count = 0;
+	} else {
+		a->count = NUM2OFFT(count);
+		if (a->count < 0)
+			rb_raise(rb_eArgError, "negative count given");
+	}
+}
+
+static VALUE my_sendfile(int io_wait, int argc, VALUE *argv, VALUE io)
+{
+	struct sf_args a;
+	ssize_t n;
+
+	prepare_sendfile(&a, argc, argv, io);
+	if (a.count == 0)
+		return INT2FIX(0);
+	kgio_nonblock(kgio_fd_state(io, a.out_fd), a.out_fd);
+	while (a.count > 0) {
+		off_t len = a.count > SENDFILE_CHUNK ? SENDFILE_CHUNK : a.count;
+
+		n = xsendfile(a.out_fd, a.in_fd, &a.offset, (size_t)len);
+		if (n > 0) {
+			a.sent += n;
+			a.count -= n;
+			continue;
+		}
+		if (n == 0)
+			break; /* EOF on the file */
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN) {
+			if (io_wait) {
+				kgio_wait_writable(a.io, a.out_fd);
+				continue;
+			}
+			if (a.sent == 0)
+				return mKgio_WaitWritable;
+			break;
+		}
+		kgio_wr_sys_fail("sendfile");
+	}
+	return OFFT2NUM(a.sent);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_sendfile(file)                  -> Integer
+ *	io.kgio_sendfile(file, offset)          -> Integer
+ *	io.kgio_sendfile(file, offset, count)   -> Integer
+ *
+ * Copies +count+ bytes of +file+ starting at +offset+ to the socket
+ * with sendfile(2) without the data passing through the Ruby heap.
+ * +offset+ defaults to zero, and +count+ defaults to the remainder
+ * of the file.  The file offset of +file+ itself is never changed.
+ *
+ * Returns the number of bytes sent, which is only less than +count+
+ * if the end of +file+ was reached.
+ *
+ * Calls the method Kgio.wait_writable if it is set.  Otherwise this
+ * blocks in a thread-safe manner until all data is sent or a
+ * fatal error occurs.
+ *
+ * On systems without a compatible sendfile(2), this falls back to
+ * pread(2) and write(2) with a small buffer.
+ */
+static VALUE kgio_sendfile(int argc, VALUE *argv, VALUE io)
+{
+	return my_sendfile(1, argc, argv, io);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_trysendfile(file)                  -> Integer or WaitWritable
+ *	io.kgio_trysendfile(file, offset, count)   -> Integer or WaitWritable
+ *
+ * Same as Kgio::SocketMethods#kgio_sendfile, except it returns as
+ * soon as EAGAIN is encountered.
+ *
+ * Returns the number of bytes sent, which may be less than +count+.
+ *
+ * Returns Kgio::WaitWritable if EAGAIN is encountered and nothing
+ * was sent.
+ */
+static VALUE kgio_trysendfile(int argc, VALUE *argv, VALUE io)
+{
+	return my_sendfile(0, argc, argv, io);
+}
+
+void init_kgio_sendfile(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE mSocketMethods = rb_const_get(mKgio, rb_intern("SocketMethods"));
+
+	mKgio_WaitWritable = rb_const_get(mKgio, rb_intern("WaitWritable"));
+
+	rb_define_method(mSocketMethods, "kgio_sendfile", kgio_sendfile, -1);
+	rb_define_method(mSocketMethods, "kgio_trysendfile",
+	                 kgio_trysendfile, -1);
+}
@@ -0,0 +1,313 @@
+#include "kgio.h"
+#if defined(HAVE_SPLICE) && defined(HAVE_TEE)
+static VALUE mKgio_WaitReadable, mKgio_WaitWritable;
+static ID id_splice_pipe;
+
+/*
+ * splice(2) needs a pipe on one end, so socket-to-socket transfers go
+ * through an intermediate pipe.  Empty pipes are shared by all
+ * connections in a small pool, a pipe still holding data that could
+ * not be written out stays attached to its destination IO until it
+ * is drained by the next call.
+ */
+#define PIPE_POOL_MAX 4
+static VALUE pipe_pool;
+static pid_t pool_pid;
+
+struct kgio_pipe {
+	int fd[2];
+	long pending; /* bytes in the pipe not yet spliced out */
+};
+
+static void pipe_close(struct kgio_pipe *p)
+{
+	if (p->fd[0] >= 0) {
+		(void)close(p->fd[0]);
+		(void)close(p->fd[1]);
+		p->fd[0] = p->fd[1] = -1;
+	}
+}
+
+static void pipe_free(void *ptr)
+{
+	pipe_close(ptr);
+	xfree(ptr);
+}
+
+static int my_pipe(int *fd)
+{
+#ifdef HAVE_PIPE2
+	return pipe2(fd, O_CLOEXEC | O_NONBLOCK);
+#else
+	if (pipe(fd) == -1)
+		return -1;
+	(void)fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+	set_nonblocking(fd[0]);
+	set_nonblocking(fd[1]);
+	return 0;
+#endif
+}
+
+static VALUE pipe_new(void)
+{
+	struct kgio_pipe *p;
+	VALUE rv = Data_Make_Struct(rb_cObject, struct kgio_pipe,
+	                            NULL, pipe_free, p);
+
+	p->fd[0] = p->fd[1] = -1;
+	if (my_pipe(p->fd) == -1) {
+		switch (errno) {
+		case EMFILE:
+		case ENFILE:
+			errno = 0;
+			rb_gc();
+			if (my_pipe(p->fd) == 0)
+				return rv;
+		}
+		rb_sys_fail("pipe");
+	}
+	return rv;
+}
+
+static VALUE pipe_get(void)
+{
+	pid_t pid = getpid();
+
+	/* never share pooled pipes with our parent after fork() */
+	if (pool_pid != pid) {
+		while (RARRAY_LEN(pipe_pool) > 0)
+			pipe_close(DATA_PTR(rb_ary_pop(pipe_pool)));
+		pool_pid = pid;
+	}
+	if (RARRAY_LEN(pipe_pool) > 0)
+		return rb_ary_pop(pipe_pool);
+	return pipe_new();
+}
+
+static void pipe_put(VALUE pipe)
+{
+	struct kgio_pipe *p = DATA_PTR(pipe);
+
+	assert(p->pending == 0 && "returning non-empty pipe to pool");
+	if (RARRAY_LEN(pipe_pool) < PIPE_POOL_MAX)
+		rb_ary_push(pipe_pool, pipe);
+	else
+		pipe_close(p);
+}
+
+/*
+ * splices out data left in the pipe attached to io by an earlier call,
+ * returns the number of bytes still pending
+ */
+static long drain(int io_wait, VALUE io, int fd)
+{
+	VALUE pipe = rb_attr_get(io, id_splice_pipe);
+	struct kgio_pipe *p;
+	ssize_t n;
+
+	if (NIL_P(pipe))
+		return 0;
+	p = DATA_PTR(pipe);
+	while (p->pending > 0) {
+		n = splice(p->fd[0], NULL, fd, NULL, (size_t)p->pending,
+		           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			p->pending -= n;
+		} else if (n == 0) {
+			/* never reuse a pipe we lost track of */
+			rb_ivar_set(io, id_splice_pipe, Qnil);
+			pipe_close(p);
+			rb_raise(rb_eIOError, "splice pipe emptied");
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN) {
+			if (!io_wait)
+				return p->pending;
+			kgio_wait_writable(io, fd);
+		} else {
+			/* leave the pipe attached, io is unusable anyways */
+			kgio_wr_sys_fail("splice");
+		}
+	}
+	rb_ivar_set(io, id_splice_pipe, Qnil);
+	pipe_put(pipe);
+	return 0;
+}
+
+static VALUE
+my_splice(int io_wait, VALUE src, VALUE dst, VALUE length, VALUE mirror)
+{
+	long len = NUM2LONG(length);
+	int src_fd = my_fileno(src);
+	int dst_fd = my_fileno(dst);
+	int mirror_fd = NIL_P(mirror) ? -1 : my_fileno(mirror);
+	struct kgio_pipe *p;
+	VALUE pipe;
+	ssize_t n;
+
+	if (drain(io_wait, dst, dst_fd) > 0)
+		return mKgio_WaitWritable;
+	if (mirror_fd >= 0 && drain(io_wait, mirror, mirror_fd) > 0)
+		return mKgio_WaitWritable;
+	if (len <= 0)
+		return INT2FIX(0);
+
+	kgio_nonblock(kgio_fd_state(src, src_fd), src_fd);
+	kgio_nonblock(kgio_fd_state(dst, dst_fd), dst_fd);
+	if (mirror_fd >= 0)
+		kgio_nonblock(kgio_fd_state(mirror, mirror_fd), mirror_fd);
+	pipe = pipe_get();
+	p = DATA_PTR(pipe);
+retry:
+	n = splice(src_fd, NULL, p->fd[1], NULL, (size_t)len,
+	           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n == -1) {
+		if (errno == EINTR)
+			goto retry;
+		pipe_put(pipe);
+		if (errno == EAGAIN) {
+			if (!io_wait)
+				return mKgio_WaitReadable;
+			kgio_wait_readable(src, src_fd);
+			pipe = pipe_get();
+			p = DATA_PTR(pipe);
+			goto retry;
+		}
+		rb_sys_fail("splice");
+	}
+	if (n == 0) {
+		pipe_put(pipe);
+		return Qnil;
+	}
+	p->pending = n;
+	rb_ivar_set(dst, id_splice_pipe, pipe);
+
+	if (mirror_fd >= 0) {
+		VALUE copy = pipe_get();
+		struct kgio_pipe *c = DATA_PTR(copy);
+		ssize_t t;
+
+		/*
+		 * tee(2) into a private, empty pipe always fits, so the
+		 * mirror may be drained independently of dst
+		 */
+		do {
+			t = tee(p->fd[0], c->fd[1], (size_t)n,
+			        SPLICE_F_NONBLOCK);
+		} while (t == -1 && errno == EINTR);
+		if (t == -1) {
+			pipe_put(copy);
+			rb_sys_fail("tee");
+		}
+		c->pending = t;
+		rb_ivar_set(mirror, id_splice_pipe, copy);
+		(void)drain(io_wait, mirror, mirror_fd);
+	}
+
+	/* anything left is written out first by the next call */
+	(void)drain(io_wait, dst, dst_fd);
+	return LONG2NUM((long)n);
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.trysplice(src, dst, len)	-> Integer or nil
+ *	Kgio.trysplice(src, dst, len)	-> Kgio::WaitReadable
+ *	Kgio.trysplice(src, dst, len)	-> Kgio::WaitWritable
+ *
+ * Moves at most +len+ bytes from +src+ to +dst+ with splice(2)
+ * without copying them into userspace.  Neither IO needs to be a
+ * pipe, an internal pipe is used if needed.
+ *
+ * Returns the number of bytes moved, or nil if +src+ reached EOF.
+ *
+ * Returns Kgio::WaitReadable if EAGAIN was encountered on +src+.
+ *
+ * If +dst+ could not take all the bytes moved, the rest is held
+ * inside Kgio and written out first by the next Kgio.trysplice or
+ * Kgio.splice call to +dst+.  That call returns Kgio::WaitWritable
+ * (without reading more from +src+) until +dst+ has taken all of it.
+ */
+static VALUE kgio_trysplice(VALUE mod, VALUE src, VALUE dst, VALUE len)
+{
+	return my_splice(0, src, dst, len, Qnil);
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.splice(src, dst, len)	-> Integer or nil
+ *
+ * Same as Kgio.trysplice, except it calls the methods assigned to
+ * Kgio.wait_readable and Kgio.wait_writable (or blocks in a
+ * thread-safe manner) until some data is moved and fully written
+ * to +dst+.
+ *
+ * Returns the number of bytes moved, or nil if +src+ reached EOF.
+ */
+static VALUE kgio_splice(VALUE mod, VALUE src, VALUE dst, VALUE len)
+{
+	return my_splice(1, src, dst, len, Qnil);
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.trytee(src, dst, len, mirror)	-> Integer or nil
+ *	Kgio.trytee(src, dst, len, mirror)	-> Kgio::WaitReadable
+ *	Kgio.trytee(src, dst, len, mirror)	-> Kgio::WaitWritable
+ *
+ * Same as Kgio.trysplice, except every byte moved from +src+ to
+ * +dst+ is also written to +mirror+ (e.g. a logging pipe) using
+ * tee(2).  Kgio::WaitWritable may also mean +mirror+ has not taken
+ * all the data from an earlier call yet.
+ *
+ * tee(2) duplicates the data into a second internal pipe, which only
+ * falls short if the kernel gave that pipe less room than the first
+ * one (e.g. once a user exceeds /proc/sys/fs/pipe-user-pages-soft).
+ * The bytes which did not fit are then never written to +mirror+, and
+ * the return value (the bytes moved to +dst+) does not show it.
+ */
+static VALUE
+kgio_trytee(VALUE mod, VALUE src, VALUE dst, VALUE len, VALUE mirror)
+{
+	return my_splice(0, src, dst, len, mirror);
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.tee(src, dst, len, mirror) -> Integer or nil
+ *
+ * Same as Kgio.splice, except every byte moved from +src+ to
+ * +dst+ is also written to +mirror+ using tee(2).  The same caveat
+ * about pipe sizes as for Kgio.trytee applies.
+ */
+static VALUE
+kgio_tee(VALUE mod, VALUE src, VALUE dst, VALUE len, VALUE mirror)
+{
+	return my_splice(1, src, dst, len, mirror);
+}
+
+void init_kgio_splice(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+
+	mKgio_WaitReadable = rb_const_get(mKgio, rb_intern("WaitReadable"));
+	mKgio_WaitWritable = rb_const_get(mKgio, rb_intern("WaitWritable"));
+	id_splice_pipe = rb_intern("kgio_splice_pipe");
+	pipe_pool = rb_ary_new();
+	rb_global_variable(&pipe_pool);
+
+	rb_define_singleton_method(mKgio, "trysplice", kgio_trysplice, 3);
+	rb_define_singleton_method(mKgio, "splice", kgio_splice, 3);
+	rb_define_singleton_method(mKgio, "trytee", kgio_trytee, 4);
+	rb_define_singleton_method(mKgio, "tee", kgio_tee, 4);
+}
+#else /* ! (HAVE_SPLICE && HAVE_TEE) */
+void init_kgio_splice(void)
+{
+}
+#endif /* ! (HAVE_SPLICE && HAVE_TEE) */
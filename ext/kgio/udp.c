@@ -0,0 +1,246 @@
+#include "kgio.h"
+#include <sys/uio.h>
+#include <limits.h>
+#include "missing/mmsg.h"
+
+static VALUE mKgio_WaitReadable, mKgio_WaitWritable;
+static ID id_mmsg_buf;
+
+/* upper bound on datagrams moved by a single recvmmsg/sendmmsg call */
+#define MMSG_MAX 1024
+
+/* no datagram is larger than this, so max_len never needs to be */
+#define DGRAM_MAX 65535
+
+/* per-message scratch space besides the data itself */
+#define MMSG_HDR_SIZE (long)(sizeof(struct mmsghdr) + \
+                             sizeof(struct iovec) + \
+                             sizeof(struct sockaddr_storage))
+
+/* scratch buffers are never this small, so they are never embedded */
+#define SCRATCH_MIN 4096
+
+/*
+ * scratch buffers larger than this are not kept between calls, a
+ * kgio_tryrecvmmsg(1024, 65535) needs about 67MB
+ */
+#define SCRATCH_KEEP (1024 * 1024)
+
+#ifdef MSG_DONTWAIT
+#  define MMSG_FLAGS MSG_DONTWAIT
+#  define mmsg_noblock(io, fd) (void)(fd)
+#else
+#  define MMSG_FLAGS 0
+#  define mmsg_noblock(io, fd) set_nonblocking(fd)
+#endif
+
+/*
+ * returns a scratch buffer of at least len bytes, buffers up to
+ * SCRATCH_KEEP bytes are kept on the socket and reused across calls
+ * to avoid a large allocation each time
+ */
+static VALUE scratch(VALUE io, long len)
+{
+	VALUE buf;
+
+	if (len < SCRATCH_MIN)
+		len = SCRATCH_MIN;
+	if (len > SCRATCH_KEEP)
+		return rb_str_new(NULL, len);
+	buf = rb_attr_get(io, id_mmsg_buf);
+	if (NIL_P(buf)) {
+		buf = rb_str_new(NULL, len);
+		rb_ivar_set(io, id_mmsg_buf, buf);
+	} else if (RSTRING_LEN(buf) < len) {
+		rb_str_resize(buf, len);
+	}
+	return buf;
+}
+
+/* frees a scratch buffer which is too large to keep right away */
+static void scratch_done(VALUE buf)
+{
+	if (RSTRING_LEN(buf) > SCRATCH_KEEP)
+		rb_str_resize(buf, 0);
+}
+
+/*
+ * call-seq:
+ *
+ *	udp.kgio_tryrecvmmsg(max_msgs, max_len) -> Array or Kgio::WaitReadable
+ *
+ * Receives up to +max_msgs+ datagrams with a single recvmmsg(2) call.
+ * Datagrams larger than +max_len+ bytes are truncated, +max_len+ may
+ * not exceed 65535 (the largest UDP payload).
+ *
+ * Returns an Array of [ data, addr ] pairs where +addr+ is the
+ * sender address packed as a sockaddr String (see
+ * Socket.unpack_sockaddr_in), suitable for passing back to
+ * Kgio::UDPSocket#kgio_trysendmmsg.
+ *
+ * Returns Kgio::WaitReadable if EAGAIN is encountered.
+ *
+ * On systems without recvmmsg(2), this loops over recvmsg(2).
+ */
+static VALUE kgio_tryrecvmmsg(VALUE io, VALUE max_msgs, VALUE max_len)
+{
+	int fd = my_fileno(io);
+	long vlen = NUM2LONG(max_msgs);
+	long len = NUM2LONG(max_len);
+	struct mmsghdr *vec;
+	struct iovec *iov;
+	struct sockaddr_storage *addr;
+	char *data;
+	long i;
+	int n, err;
+	VALUE rv, buf;
+
+	if (vlen <= 0 || vlen > MMSG_MAX)
+		rb_raise(rb_eArgError, "max_msgs must be between 1 and %d",
+		         MMSG_MAX);
+	if (len < 0 || len > DGRAM_MAX)
+		rb_raise(rb_eArgError, "max_len must be between 0 and %d",
+		         DGRAM_MAX);
+	if (vlen > LONG_MAX / (MMSG_HDR_SIZE + len))
+		rb_raise(rb_eArgError, "max_msgs * max_len is too large");
+
+	buf = scratch(io, vlen * (MMSG_HDR_SIZE + len));
+	vec = (struct mmsghdr *)RSTRING_PTR(buf);
+	iov = (struct iovec *)(vec + vlen);
+	addr = (struct sockaddr_storage *)(iov + vlen);
+	data = (char *)(addr + vlen);
+	memset(vec, 0, sizeof(struct mmsghdr) * vlen);
+	for (i = 0; i < vlen; i++) {
+		iov[i].iov_base = data + i * len;
+		iov[i].iov_len = (size_t)len;
+		vec[i].msg_hdr.msg_iov = &iov[i];
+		vec[i].msg_hdr.msg_iovlen = 1;
+		vec[i].msg_hdr.msg_name = &addr[i];
+		vec[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+	}
+
+	mmsg_noblock(io, fd);
+	do {
+		n = my_recvmmsg(fd, vec, (unsigned int)vlen, MMSG_FLAGS);
+	} while (n == -1 && errno == EINTR);
+	if (n == -1) {
+		err = errno;
+		scratch_done(buf);
+		if (err == EAGAIN)
+			return mKgio_WaitReadable;
+		errno = err;
+		rb_sys_fail("recvmmsg");
+	}
+
+	rv = rb_ary_new2(n);
+	for (i = 0; i < n; i++) {
+		socklen_t addrlen = vec[i].msg_hdr.msg_namelen;
+		VALUE str = rb_str_new(iov[i].iov_base, vec[i].msg_len);
+		VALUE from = addrlen ? rb_str_new((char *)&addr[i], addrlen)
+		                     : Qnil;
+
+		rb_ary_push(rv, rb_assoc_new(str, from));
+	}
+	scratch_done(buf);
+	return rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	udp.kgio_trysendmmsg([ [ data, addr ], ... ]) -> Integer or WaitWritable
+ *	udp.kgio_trysendmmsg([ data, ... ]) -> Integer or Kgio::WaitWritable
+ *
+ * Sends every datagram in the given Array with as few sendmmsg(2)
+ * calls as possible.  Each element is a [ data, addr ] pair where
+ * +addr+ is a packed sockaddr String (e.g. from
+ * Socket.pack_sockaddr_in or Kgio::UDPSocket#kgio_tryrecvmmsg), or
+ * just a +data+ String if the socket is connected.
+ *
+ * Returns the number of datagrams sent, this is less than the number
+ * given if EAGAIN was encountered partway through.
+ *
+ * Returns Kgio::WaitWritable if EAGAIN is encountered and nothing
+ * was sent.
+ *
+ * On systems without sendmmsg(2), this loops over sendmsg(2).
+ */
+static VALUE kgio_trysendmmsg(VALUE io, VALUE msgs)
+{
+	int fd = my_fileno(io);
+	long total, sent = 0;
+	int n;
+
+	Check_Type(msgs, T_ARRAY);
+	total = RARRAY_LEN(msgs);
+	mmsg_noblock(io, fd);
+	while (sent < total) {
+		long i, vlen = total - sent;
+		struct mmsghdr *vec;
+		struct iovec *iov;
+
+		if (vlen > MMSG_MAX)
+			vlen = MMSG_MAX;
+		vec = (struct mmsghdr *)RSTRING_PTR(scratch(io,
+		                vlen * (long)(sizeof(struct mmsghdr) +
+		                              sizeof(struct iovec))));
+		iov = (struct iovec *)(vec + vlen);
+		memset(vec, 0, sizeof(struct mmsghdr) * vlen);
+		for (i = 0; i < vlen; i++) {
+			VALUE msg = rb_ary_entry(msgs, sent + i);
+			VALUE addr = Qnil;
+
+			if (TYPE(msg) == T_ARRAY) {
+				addr = rb_ary_entry(msg, 1);
+				msg = rb_ary_entry(msg, 0);
+			}
+			Check_Type(msg, T_STRING);
+			iov[i].iov_base = RSTRING_PTR(msg);
+			iov[i].iov_len = (size_t)RSTRING_LEN(msg);
+			vec[i].msg_hdr.msg_iov = &iov[i];
+			vec[i].msg_hdr.msg_iovlen = 1;
+			if (!NIL_P(addr)) {
+				Check_Type(addr, T_STRING);
+				vec[i].msg_hdr.msg_name = RSTRING_PTR(addr);
+				vec[i].msg_hdr.msg_namelen =
+				                (socklen_t)RSTRING_LEN(addr);
+			}
+		}
+		do {
+			n = my_sendmmsg(fd, vec, (unsigned int)vlen,
+			                MMSG_FLAGS);
+		} while (n == -1 && errno == EINTR);
+		if (n == -1) {
+			/* errors resurface on the next call if we sent some */
+			if (errno == EAGAIN || sent > 0)
+				break;
+			rb_sys_fail("sendmmsg");
+		}
+		sent += n;
+	}
+	if (sent == 0 && total > 0)
+		return mKgio_WaitWritable;
+	return LONG2NUM(sent);
+}
+
+void init_kgio_udp(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE cUDPSocket;
+
+	mKgio_WaitReadable = rb_const_get(mKgio, rb_intern("WaitReadable"));
+	mKgio_WaitWritable = rb_const_get(mKgio, rb_intern("WaitWritable"));
+	id_mmsg_buf = rb_intern("kgio_mmsg_buf");
+
+	/*
+	 * Document-class: Kgio::UDPSocket
+	 *
+	 * A UDPSocket subclass which can move many datagrams per
+	 * system call and returns Kgio::WaitReadable or
+	 * Kgio::WaitWritable instead of raising on EAGAIN.
+	 */
+	cUDPSocket = rb_const_get(rb_cObject, rb_intern("UDPSocket"));
+	cUDPSocket = rb_define_class_under(mKgio, "UDPSocket", cUDPSocket);
+	rb_define_method(cUDPSocket, "kgio_tryrecvmmsg", kgio_tryrecvmmsg, 2);
+	rb_define_method(cUDPSocket, "kgio_trysendmmsg", kgio_trysendmmsg, 1);
+}
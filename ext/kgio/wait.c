@@ -1,25 +1,300 @@
 #include "kgio.h"
+#include <math.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+#  include <ruby/fiber/scheduler.h>
+#endif
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#  include <ruby/thread.h>
+#endif
 
 static ID io_wait_rd, io_wait_wr;
+static ID id_timeout;
+static VALUE eKgio_Timeout;
 
-void kgio_wait_readable(VALUE io, int fd)
+/* seconds on a clock which does not jump with the time of day */
+static double now(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+	}
+}
+
+/* returns the kgio_timeout of +io+, nil if unset */
+VALUE kgio_default_timeout(VALUE io)
+{
+	return rb_attr_get(io, id_timeout);
+}
+
+static double timeout_secs(VALUE timeout)
+{
+	double secs = NUM2DBL(timeout);
+
+	if (secs < 0)
+		rb_raise(rb_eArgError, "negative timeout");
+	return secs;
+}
+
+/*
+ * returns the deadline for a call given its +timeout+ argument in
+ * seconds, or zero (no deadline) if +timeout+ is nil
+ */
+double kgio_deadline(VALUE timeout)
+{
+	return NIL_P(timeout) ? 0 : now() + timeout_secs(timeout);
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+struct nogvl_call {
+	VALUE (*fn)(void *);
+	void *ptr;
+	VALUE rv;
+};
+
+static void *nogvl_call(void *ptr)
+{
+	struct nogvl_call *c = ptr;
+
+	c->rv = c->fn(c->ptr);
+	return NULL;
+}
+
+/* runs fn(ptr) without the GVL, interruptible like a blocking read */
+VALUE kgio_without_gvl(VALUE (*fn)(void *), void *ptr)
+{
+	struct nogvl_call c;
+
+	c.fn = fn;
+	c.ptr = ptr;
+	c.rv = Qnil;
+	(void)rb_thread_call_without_gvl(nogvl_call, &c, RUBY_UBF_IO, 0);
+	return c.rv;
+}
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+VALUE kgio_without_gvl(VALUE (*fn)(void *), void *ptr)
+{
+	return rb_thread_blocking_region(fn, ptr, RUBY_UBF_IO, 0);
+}
+#endif /* HAVE_RB_THREAD_BLOCKING_REGION */
+
+#ifdef KGIO_WITHOUT_GVL
+struct poll_args {
+	struct pollfd pfd;
+	int ms;
+};
+
+static VALUE nogvl_poll(void *ptr)
+{
+	struct poll_args *p = ptr;
+
+	return (VALUE)poll(&p->pfd, 1, p->ms);
+}
+
+/* returns zero if +deadline+ passed before fd became ready */
+static int poll_until(int fd, short events, double deadline)
+{
+	struct poll_args p;
+	double left;
+	int n;
+
+	p.pfd.fd = fd;
+	p.pfd.events = events;
+	for (;;) {
+		left = ceil((deadline - now()) * 1000.0);
+		if (left <= 0)
+			return 0;
+		p.ms = left > INT_MAX ? INT_MAX : (int)left;
+		p.pfd.revents = 0;
+		n = (int)kgio_without_gvl(nogvl_poll, &p);
+		if (n > 0)
+			return 1;
+		if (n < 0 && errno != EINTR)
+			rb_sys_fail("poll");
+	}
+}
+#else /* ! KGIO_WITHOUT_GVL */
+static int poll_until(int fd, short events, double deadline)
 {
-	if (io_wait_rd) {
-		(void)rb_funcall(io, io_wait_rd, 0, 0);
+	fd_set fds;
+	struct timeval tv;
+	double left;
+	int n;
+
+	for (;;) {
+		left = deadline - now();
+		if (left <= 0)
+			return 0;
+		tv.tv_sec = (time_t)left;
+		tv.tv_usec = (long)((left - (double)tv.tv_sec) * 1e6);
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		if (events == POLLIN)
+			n = rb_thread_select(fd + 1, &fds, NULL, NULL, &tv);
+		else
+			n = rb_thread_select(fd + 1, NULL, &fds, NULL, &tv);
+		if (n > 0)
+			return 1;
+		if (n < 0 && errno != EINTR)
+			rb_sys_fail("select");
+	}
+}
+#endif /* ! KGIO_WITHOUT_GVL */
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+/* returns true if the current Fiber is run by a non-blocking scheduler */
+int kgio_fiber_scheduled(void)
+{
+	return !NIL_P(rb_fiber_scheduler_current());
+}
+
+/*
+ * hands the wait to scheduler.io_wait(io, events, timeout), which
+ * returns a falsy value (or no events) if +timeout+ expired first
+ */
+static int sched_wait(VALUE sched, VALUE io, short events, double deadline)
+{
+	VALUE timeout, rv;
+	int ev = events == POLLIN ? RUBY_IO_READABLE : RUBY_IO_WRITABLE;
+
+	if (deadline == 0) {
+		timeout = kgio_default_timeout(io);
 	} else {
-		if (!rb_io_wait_readable(fd))
-			rb_sys_fail("wait readable");
+		double left = deadline - now();
+
+		if (left <= 0)
+			return 0;
+		timeout = rb_float_new(left);
 	}
+	rv = rb_fiber_scheduler_io_wait(sched, io, INT2FIX(ev), timeout);
+	if (NIL_P(timeout))
+		return 1;
+	return RTEST(rv) && rv != INT2FIX(0);
+}
+#else /* ! HAVE_RB_FIBER_SCHEDULER_CURRENT */
+int kgio_fiber_scheduled(void)
+{
+	return 0;
 }
+#endif /* ! HAVE_RB_FIBER_SCHEDULER_CURRENT */
 
-void kgio_wait_writable(VALUE io, int fd)
+/*
+ * Waits for +io+ to become readable (POLLIN) or writable (POLLOUT).
+ * Without a +deadline+, the kgio_timeout of +io+ (if any) bounds this
+ * wait alone.  Returns zero if the deadline passed first.
+ *
+ * Under a non-blocking Fiber scheduler (Ruby 3.1+), its io_wait hook
+ * is called directly with the remaining time so other Fibers may run.
+ * Otherwise, methods assigned with Kgio.wait_readable= and
+ * Kgio.wait_writable= are called as before, they are responsible for
+ * their own timeouts.
+ */
+int kgio_wait(VALUE io, int fd, short events, double deadline)
 {
-	if (io_wait_wr) {
-		(void)rb_funcall(io, io_wait_wr, 0, 0);
+	ID hook = events == POLLIN ? io_wait_rd : io_wait_wr;
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+	VALUE sched = rb_fiber_scheduler_current();
+
+	if (!NIL_P(sched))
+		return sched_wait(sched, io, events, deadline);
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+	if (hook) {
+		(void)rb_funcall(io, hook, 0, 0);
+		return 1;
+	}
+	if (deadline == 0) {
+		VALUE timeout = kgio_default_timeout(io);
+
+		if (NIL_P(timeout))
+			goto forever;
+		deadline = now() + NUM2DBL(timeout);
+	}
+	return poll_until(fd, events, deadline);
+forever:
+	if (events == POLLIN) {
+		if (!rb_io_wait_readable(fd))
+			rb_sys_fail("wait readable");
 	} else {
 		if (!rb_io_wait_writable(fd))
 			rb_sys_fail("wait writable");
 	}
+	return 1;
+}
+
+void kgio_timeout_error(const char *msg)
+{
+	kgio_raise_empty_bt(eKgio_Timeout, msg);
+}
+
+void kgio_wait_readable_until(VALUE io, int fd, double deadline)
+{
+	if (!kgio_wait(io, fd, POLLIN, deadline))
+		kgio_timeout_error("read timed out");
+}
+
+void kgio_wait_writable_until(VALUE io, int fd, double deadline)
+{
+	if (!kgio_wait(io, fd, POLLOUT, deadline))
+		kgio_timeout_error("write timed out");
+}
+
+void kgio_wait_readable(VALUE io, int fd)
+{
+	kgio_wait_readable_until(io, fd, 0);
+}
+
+void kgio_wait_writable(VALUE io, int fd)
+{
+	kgio_wait_writable_until(io, fd, 0);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_timeout = seconds
+ *	io.kgio_timeout = nil
+ *
+ * Sets the default number of seconds a blocking kgio method on this
+ * IO may wait for it to become readable or writable before raising
+ * Kgio::Timeout.  This applies to each wait separately, so it bounds
+ * how long a connection may be idle rather than how long a large
+ * transfer may take.  Methods which take a +timeout+ argument apply
+ * that to the whole call instead.  The default is nil (no timeout).
+ */
+static VALUE set_timeout(VALUE io, VALUE timeout)
+{
+	if (!NIL_P(timeout))
+		(void)timeout_secs(timeout);
+	rb_ivar_set(io, id_timeout, timeout);
+	return timeout;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_timeout	-> seconds or nil
+ *
+ * Returns the value assigned with kgio_timeout=
+ */
+static VALUE get_timeout(VALUE io)
+{
+	return kgio_default_timeout(io);
+}
+
+void kgio_define_timeout(VALUE klass)
+{
+	rb_define_method(klass, "kgio_timeout=", set_timeout, 1);
+	rb_define_method(klass, "kgio_timeout", get_timeout, 0);
 }
 
 /*
@@ -35,6 +310,9 @@ void kgio_wait_writable(VALUE io, int fd)
  *
  * A special value of nil will cause Ruby to wait using the
  * rb_io_wait_readable() function.
+ *
+ * Fibers run by a Fiber scheduler (Fiber.set_scheduler, Ruby 3.1+)
+ * do not need this, their scheduler's io_wait is called instead.
  */
 static VALUE set_wait_rd(VALUE mod, VALUE sym)
 {
@@ -63,6 +341,9 @@ static VALUE set_wait_rd(VALUE mod, VALUE sym)
  *
  * A special value of nil will cause Ruby to wait using the
  * rb_io_wait_writable() function.
+ *
+ * Fibers run by a Fiber scheduler (Fiber.set_scheduler, Ruby 3.1+)
+ * do not need this, their scheduler's io_wait is called instead.
  */
 static VALUE set_wait_wr(VALUE mod, VALUE sym)
 {
@@ -110,6 +391,11 @@ void init_kgio_wait(void)
 {
 	VALUE mKgio = rb_define_module("Kgio");
 
+	eKgio_Timeout = rb_const_get(mKgio, rb_intern("Timeout"));
+	id_timeout = rb_intern("kgio_timeout");
+	kgio_define_timeout(rb_define_module_under(mKgio, "PipeMethods"));
+	kgio_define_timeout(rb_define_module_under(mKgio, "SocketMethods"));
+
 	rb_define_singleton_method(mKgio, "wait_readable=", set_wait_rd, 1);
 	rb_define_singleton_method(mKgio, "wait_writable=", set_wait_wr, 1);
 	rb_define_singleton_method(mKgio, "wait_readable", wait_rd, 0);
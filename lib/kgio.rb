@@ -1,5 +1,6 @@
 # -*- encoding: binary -*-
 require 'socket'
+require 'timeout'
 module Kgio
 
   # The IPv4 address of UNIX domain sockets, useful for creating
@@ -14,6 +15,12 @@ module Kgio
   # PipeMethods#kgio_trywrite and SocketMethods#kgio_trywrite will
   # return this constant when waiting for a read is required.
   WaitWritable = :wait_writable
+
+  # Raised (without a backtrace) by blocking kgio methods when a
+  # +timeout+ argument or the kgio_timeout of an IO expires.  This is a
+  # Timeout::Error so existing rescue clauses keep working.
+  class Timeout < ::Timeout::Error
+  end
 end
 
 require 'kgio_ext'
@@ -21,16 +28,8 @@ require 'kgio_ext'
 # use Kgio::Pipe.popen and Kgio::Pipe.new instead of IO.popen
 # and IO.pipe to get PipeMethods#kgio_read and PipeMethod#kgio_write
 # methods.
+# Kgio::Pipe.new (defined in the extension) creates a pipe(7) with
+# O_NONBLOCK already set on both ends.
 class Kgio::Pipe < IO
   include Kgio::PipeMethods
-  class << self
-
-    # call-seq:
-    #
-    #   rd, wr = Kgio::Pipe.new
-    #
-    # This creates a new pipe(7) with Kgio::Pipe objects that respond
-    # to PipeMethods#kgio_read and PipeMethod#kgio_write
-    alias new pipe
-  end
 end
@@ -121,6 +121,108 @@ module LibReadWriteTest
     assert_equal "10", @rd.kgio_tryread(2)
   end
 
+  def test_readv
+    assert_nil @wr.kgio_write("HELLOWORLD")
+    assert_equal %w(HELLO WORLD), @rd.kgio_readv([5, 10])
+  end
+
+  def test_tryreadv
+    assert_nil @wr.kgio_write("HELLOWORLD")
+    assert_equal ["HELLO", "WORLD", ""], @rd.kgio_tryreadv([5, 5, 5])
+  end
+
+  def test_readv_extra_buf
+    hdr, body = "", "hello world"
+    bufs = [ hdr, body ]
+    assert_nil @wr.kgio_write("HI!")
+    rv = @rd.kgio_readv([2, 16], bufs)
+    assert_equal bufs.object_id, rv.object_id
+    assert_equal hdr.object_id, rv[0].object_id
+    assert_equal body.object_id, rv[1].object_id
+    assert_equal %w(HI !), rv
+  end
+
+  def test_readv_zero
+    assert_equal ["", ""], @rd.kgio_readv([0, 0])
+    assert_equal [], @rd.kgio_tryreadv([])
+  end
+
+  def test_readv_eof
+    @wr.close
+    assert_nil @rd.kgio_readv([1, 2])
+    assert_nil @rd.kgio_tryreadv([1, 2])
+  end
+
+  def test_tryreadv_extra_buf_eagain_clears_buffer
+    bufs = [ "hello", "world" ]
+    assert_equal Kgio::WaitReadable, @rd.kgio_tryreadv([2, 2], bufs)
+    assert_equal ["", ""], bufs
+  end
+
+  def test_readv_bad_args
+    assert_raises(ArgumentError) { @rd.kgio_tryreadv([1, 2], [""]) }
+    assert_raises(ArgumentError) { @rd.kgio_tryreadv([-1]) }
+    assert_raises(ArgumentError) { @rd.kgio_tryreadv([1] * 100000) }
+  end
+
+  def test_writev
+    assert_nil @wr.kgio_writev(["HELLO", "", " ", 10, "WORLD"])
+    assert_equal "HELLO 10WORLD", @rd.kgio_read(13)
+  end
+
+  def test_trywritev
+    assert_nil @wr.kgio_trywritev(["HELLO", "", " ", 10, "WORLD"])
+    assert_equal "HELLO 10WORLD", @rd.kgio_tryread(13)
+  end
+
+  def test_writev_empty
+    assert_nil @wr.kgio_writev([])
+    assert_nil @wr.kgio_trywritev(["", ""])
+    assert_equal Kgio::WaitReadable, @rd.kgio_tryread(1)
+  end
+
+  def test_writev_many
+    ary = (0...3000).map { |i| i.to_s(36) }
+    expect = ary.join
+    thr = Thread.new { @wr.kgio_writev(ary) }
+    @rd.nonblock = false
+    assert_equal expect, @rd.read(expect.size)
+    thr.join
+    assert_nil thr.value
+  end
+
+  def test_trywritev_return_wait_writable
+    tmp = []
+    tmp << @wr.kgio_trywritev(%w(H I)) until tmp[-1] == Kgio::WaitWritable
+    assert_equal Kgio::WaitWritable, tmp.pop
+    assert tmp.size > 0
+    penultimate = tmp.pop
+    assert(penultimate == ["I"] || penultimate == nil)
+    tmp.each { |rv| assert_nil rv }
+  end
+
+  def test_monster_trywritev
+    buf = [ "HEAD", RANDOM_BLOB.dup, "TAIL" ]
+    rv = @wr.kgio_trywritev(buf)
+    assert_kind_of Array, rv
+    rv = rv.join
+    assert rv.size < buf.join.size
+    @rd.nonblock = false
+    expect = buf.join
+    assert_equal(expect, @rd.read(expect.size - rv.size) + rv)
+  end
+
+  def test_monster_writev
+    buf = [ "HEAD", RANDOM_BLOB.dup, "TAIL" ]
+    thr = Thread.new { @wr.kgio_writev(buf) }
+    @rd.nonblock = false
+    expect = buf.join
+    readed = @rd.read(expect.size)
+    thr.join
+    assert_nil thr.value
+    assert_equal expect, readed
+  end
+
   def test_tryread_empty
     assert_equal Kgio::WaitReadable, @rd.kgio_tryread(1)
   end
@@ -203,6 +305,26 @@ module LibReadWriteTest
     assert_equal buf, readed
   end
 
+  def test_monster_read_buf
+    blob = RANDOM_BLOB[0, 1024 * 1024]
+    thr = Thread.new { @wr.kgio_write(blob) }
+    buf, readed = "", ""
+    while readed.size < blob.size
+      assert_same buf, @rd.kgio_read(blob.size, buf)
+      readed << buf
+    end
+    assert_nil thr.value
+    assert_equal blob, readed
+    assert_nothing_raised { buf << "unlocked" }
+  end
+
+  def test_monster_tryread_eagain_unlocks_buf
+    buf = "hello"
+    assert_equal Kgio::WaitReadable, @rd.kgio_tryread(1024 * 1024, buf)
+    assert_equal "", buf
+    assert_nothing_raised { buf << "unlocked" }
+  end
+
   def test_monster_write_wait_writable
     @wr.instance_variable_set :@nr, 0
     def @wr.wait_writable
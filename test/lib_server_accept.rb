@@ -23,6 +23,35 @@ module LibServerAccept
     assert_equal nil, @srv.kgio_tryaccept
   end
 
+  def test_tryaccept_many
+    assert_equal [], @srv.kgio_tryaccept_many(10)
+    clients = (1..3).map { client_connect }
+    IO.select([@srv])
+    rv = @srv.kgio_tryaccept_many(2)
+    assert_equal 2, rv.size
+    rv.concat(@srv.kgio_tryaccept_many(10))
+    assert_equal 3, rv.size
+    rv.each do |io|
+      assert_kind_of Kgio::Socket, io
+      assert_equal @host, io.kgio_addr
+    end
+    assert_equal [], @srv.kgio_tryaccept_many(10)
+    assert_equal [], @srv.kgio_tryaccept_many(0)
+    assert_raises(ArgumentError) { @srv.kgio_tryaccept_many(-1) }
+  ensure
+    (clients + rv).each { |io| io.close } if clients && rv
+  end
+
+  def test_tryaccept_many_batches
+    clients = (1..70).map { client_connect }
+    IO.select([@srv])
+    rv = @srv.kgio_tryaccept_many(100)
+    assert_equal 70, rv.size
+    assert_equal rv.size, rv.map { |io| io.fileno }.uniq.size
+  ensure
+    (clients + rv).each { |io| io.close } if clients && rv
+  end
+
   def test_blocking_accept
     t0 = Time.now
     pid = fork { sleep 1; a = client_connect; sleep }
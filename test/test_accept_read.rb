@@ -0,0 +1,124 @@
+require 'test/unit'
+require 'io/nonblock'
+$-w = true
+require 'kgio'
+
+class TestKgioAcceptRead < Test::Unit::TestCase
+  def setup
+    @srv = Kgio::TCPServer.new("127.0.0.1", 0)
+    @port = @srv.addr[1]
+    @ios = [ @srv ]
+  end
+
+  def teardown
+    @ios.each { |io| io.close unless io.closed? }
+  end
+
+  def connect
+    c = TCPSocket.new("127.0.0.1", @port)
+    @ios << c
+    c
+  end
+
+  def test_tryaccept_read_empty
+    assert_nil @srv.kgio_tryaccept_read(16)
+  end
+
+  def test_tryaccept_read
+    connect.write "HELLO"
+    IO.select([ @srv ])
+    sleep 0.05
+    client, data = @srv.kgio_tryaccept_read(16)
+    @ios << client
+    assert_kind_of Kgio::Socket, client
+    assert_equal "HELLO", data
+    assert_equal "127.0.0.1", client.kgio_addr
+  end
+
+  def test_tryaccept_read_no_data
+    connect
+    IO.select([ @srv ])
+    client, data = @srv.kgio_tryaccept_read(16)
+    @ios << client
+    assert_kind_of Kgio::Socket, client
+    assert_equal Kgio::WaitReadable, data
+  end
+
+  def test_tryaccept_read_eof
+    connect.close
+    IO.select([ @srv ])
+    sleep 0.05
+    client, data = @srv.kgio_tryaccept_read(16)
+    @ios << client
+    assert_kind_of Kgio::Socket, client
+    assert_nil data
+  end
+
+  def test_tryaccept_read_buf
+    connect.write "HELLO"
+    IO.select([ @srv ])
+    sleep 0.05
+    buf = ""
+    client, data = @srv.kgio_tryaccept_read(16, buf)
+    @ios << client
+    assert_same buf, data
+    assert_equal "HELLO", buf
+  end
+
+  def test_tryaccept_read_negative
+    connect
+    IO.select([ @srv ])
+    assert_raises(ArgumentError) { @srv.kgio_tryaccept_read(-1) }
+    client, _ = @srv.kgio_tryaccept_read(16)
+    @ios << client
+    assert_kind_of Kgio::Socket, client
+  end
+
+  def test_accept_read
+    connect.write "HELLO"
+    sleep 0.05
+    client, data = @srv.kgio_accept_read(16)
+    @ios << client
+    assert_equal "HELLO", data
+  end
+
+  def test_accept_read_timeout
+    assert_raises(Kgio::Timeout) { @srv.kgio_accept_read(16, nil, 0.01) }
+  end
+
+  def test_unix_tryaccept_read
+    path = "/tmp/kgio_accept_read_#{$$}_#{rand}"
+    srv = Kgio::UNIXServer.new(path)
+    @ios << srv
+    assert_nil srv.kgio_tryaccept_read(16)
+    c = UNIXSocket.new(path)
+    @ios << c
+    c.write "HELLO"
+    client, data = srv.kgio_accept_read(16)
+    @ios << client
+    assert_kind_of Kgio::Socket, client
+    assert_equal "HELLO", data
+    assert_equal Kgio::LOCALHOST, client.kgio_addr
+  ensure
+    File.unlink(path) if path && File.exist?(path)
+  end
+
+  def test_defer_accept
+    rv = @srv.kgio_defer_accept(1)
+    assert [ true, false ].include?(rv)
+    assert_equal true, rv if RUBY_PLATFORM =~ /linux/
+    assert_equal rv, @srv.kgio_defer_accept(0)
+  end
+
+  def test_new_reuseport_defer_accept
+    return unless Kgio::TCPServer.respond_to?(:new_reuseport)
+    srv = Kgio::TCPServer.new_reuseport("127.0.0.1", 0, :defer_accept => 1)
+    @ios << srv
+    c = TCPSocket.new("127.0.0.1", srv.addr[1])
+    @ios << c
+    c.write "HELLO"
+    client, data = srv.kgio_accept_read(16, nil, 5)
+    @ios << client
+    assert_equal "HELLO", data
+  end
+end
@@ -0,0 +1,80 @@
+# -*- encoding: binary -*-
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestKgioBufferPool < Test::Unit::TestCase
+  def setup
+    @rd, @wr = Kgio::UNIXSocket.pair
+    @pool = Kgio::BufferPool.new
+  end
+
+  def teardown
+    @rd.close unless @rd.closed?
+    @wr.close unless @wr.closed?
+  end
+
+  def test_read_reuses_buffers
+    @wr.kgio_write "HELLO"
+    buf = @rd.kgio_tryread(16384, @pool)
+    assert_equal "HELLO", buf
+    assert_equal 0, @pool.bytes
+    @pool.put(buf)
+    assert_equal "", buf
+    assert_equal 16384, @pool.bytes
+
+    @wr.kgio_write "WORLD"
+    buf2 = @rd.kgio_read(16384, @pool)
+    assert_equal buf.object_id, buf2.object_id
+    assert_equal "WORLD", buf2
+  end
+
+  def test_eagain_and_eof_return_buffer
+    assert_equal Kgio::WaitReadable, @rd.kgio_tryread(16384, @pool)
+    assert_equal 16384, @pool.bytes
+    @wr.close
+    assert_nil @rd.kgio_read(10000, @pool)
+    assert_equal 16384, @pool.bytes
+  end
+
+  def test_put_resets_encoding
+    buf = @pool.get(4096)
+    assert_equal "", buf
+    buf << "\xc2\xa9"
+    buf.force_encoding(Encoding::UTF_8) if defined?(Encoding)
+    @pool.put(buf)
+    buf = @pool.get(100)
+    assert_equal "", buf
+    assert_equal Encoding::BINARY, buf.encoding if defined?(Encoding)
+  end
+
+  def test_max_bytes
+    pool = Kgio::BufferPool.new(8192)
+    assert_equal 8192, pool.max_bytes
+    bufs = (1..3).map { pool.get(4096) }
+    bufs.each { |buf| pool.put(buf) }
+    assert_equal 8192, pool.bytes
+  end
+
+  def test_unpoolable
+    @pool.put("short")
+    @pool.put("." * 8192)
+    @pool.put(("." * 8192).freeze)
+    @pool.put(:foo)
+    assert_equal 8192, @pool.bytes
+    big = @pool.get(2 * 1024 * 1024)
+    @pool.put(big)
+    assert_equal 8192, @pool.bytes
+  end
+
+  def test_tryread_many_pool
+    @wr.kgio_write "HI"
+    a, b = Kgio::UNIXSocket.pair
+    rv = Kgio.tryread_many([ @rd, a ], 16384, @pool)
+    assert_equal [ "HI", Kgio::WaitReadable ], rv
+    assert_equal 16384, @pool.bytes
+  ensure
+    a.close
+    b.close
+  end
+end
@@ -0,0 +1,56 @@
+require 'test/unit'
+require 'socket'
+$-w = true
+require 'kgio'
+
+class TestCork < Test::Unit::TestCase
+  def teardown
+    [ @srv, @cli, @acc ].each { |io| io.close if io && ! io.closed? }
+  end
+
+  def setup
+    host = ENV["TEST_HOST"] || '127.0.0.1'
+    @srv = Kgio::TCPServer.new(host, 0)
+    port = @srv.addr[1]
+    @cli = Kgio::TCPSocket.new(host, port)
+    @acc = @srv.kgio_accept
+  end
+
+  def corked?(io)
+    io.getsockopt(Socket::IPPROTO_TCP, Socket::TCP_CORK).int != 0
+  end
+
+  def test_write_more
+    assert_nil @cli.kgio_write("HEAD", :more => true)
+    assert_nil @cli.kgio_write("BODY", 5, :more => false)
+    buf = ""
+    buf << @acc.kgio_read(8) until buf.size == 8
+    assert_equal "HEADBODY", buf
+  end
+
+  def test_trywrite_more
+    assert_nil @cli.kgio_trywrite("HEAD", :more => true)
+    assert_nil @cli.kgio_trywrite("BODY")
+    buf = ""
+    buf << @acc.kgio_read(8) until buf.size == 8
+    assert_equal "HEADBODY", buf
+  end
+
+  def test_cork_uncork
+    assert_equal true, @cli.kgio_cork
+    assert corked?(@cli) if defined?(Socket::TCP_CORK)
+    assert_nil @cli.kgio_write("HELLO")
+    assert_equal true, @cli.kgio_uncork
+    assert ! corked?(@cli) if defined?(Socket::TCP_CORK)
+    assert_equal "HELLO", @acc.kgio_read(5)
+  end
+
+  def test_cork_unix
+    a, b = Kgio::UNIXSocket.pair
+    assert_equal false, a.kgio_cork
+    assert_equal false, a.kgio_uncork
+  ensure
+    a.close if a
+    b.close if b
+  end
+end
@@ -0,0 +1,124 @@
+require 'test/unit'
+require 'io/nonblock'
+$-w = true
+require 'kgio'
+
+# Kgio caches the type of descriptors it has seen, make sure reused
+# descriptors are not mistaken for the old ones and that O_NONBLOCK
+# changes made behind Kgio's back are noticed
+class TestFdState < Test::Unit::TestCase
+  class KgioUNIXSocket < UNIXSocket
+    include Kgio::PipeMethods
+  end
+
+  def test_close_and_reuse_fd
+    rd, wr = Kgio::Pipe.new
+    assert_nil wr.kgio_write("HI")
+    assert_equal "HI", rd.kgio_read(2)
+    fd = rd.fileno
+    rd.close
+    wr.close
+
+    a, b = KgioUNIXSocket.pair
+    assert_equal fd, a.fileno
+    a.nonblock = false
+    assert_equal Kgio::WaitReadable, a.kgio_tryread(1)
+    assert_nil b.kgio_write("HELLO")
+    assert_equal "HELLO", a.kgio_read(5)
+    a.close
+    b.close
+  end
+
+  def test_socket_with_pipe_methods
+    a, b = KgioUNIXSocket.pair
+    assert_nil a.kgio_trywrite("HELLO")
+    assert_equal "HELLO", b.kgio_tryread(5)
+    assert_equal Kgio::WaitReadable, b.kgio_tryread(5)
+    a.close
+    assert_nil b.kgio_read(5)
+    b.close
+  end
+
+  def test_reopen
+    rd, wr = Kgio::Pipe.new
+    rd2, wr2 = IO.pipe
+    assert_equal Kgio::WaitReadable, rd.kgio_tryread(1)
+    rd2.nonblock = false
+    rd.reopen(rd2)
+    wr2.write "HI"
+    # IO#reopen changes the class of rd, too
+    assert_equal [ "HI" ], Kgio.tryread_many([ rd ], 2)
+    assert_equal [ Kgio::WaitReadable ], Kgio.tryread_many([ rd ], 2)
+  ensure
+    [ rd, wr, rd2, wr2 ].each { |io| io.close if io && ! io.closed? }
+  end
+
+  def test_nonblock_cleared
+    rd, wr = Kgio::Pipe.new
+    assert_equal Kgio::WaitReadable, rd.kgio_tryread(1)
+    rd.nonblock = false
+    assert_equal Kgio::WaitReadable, rd.kgio_tryread(1)
+    assert rd.nonblock?
+  ensure
+    rd.close
+    wr.close
+  end
+
+  def test_pipe_new
+    rd, wr = Kgio::Pipe.new
+    assert_kind_of Kgio::Pipe, rd
+    assert_kind_of Kgio::Pipe, wr
+    assert rd.nonblock?
+    assert wr.nonblock?
+    assert_equal Kgio::WaitReadable, rd.kgio_tryread(1)
+  ensure
+    rd.close
+    wr.close
+  end
+
+  def test_pipe_new_block
+    pair = nil
+    assert_equal :ok, Kgio::Pipe.new { |rd, wr|
+      pair = [ rd, wr ]
+      assert_nil wr.kgio_write("HI")
+      assert_equal "HI", rd.kgio_read(2)
+      :ok
+    }
+    assert pair.all? { |io| io.closed? }
+  end
+
+  def test_nonblock_block
+    rd, wr = Kgio::Pipe.new
+    rd.nonblock(false) { wr.kgio_write("HI"); rd.read(2) }
+    assert_equal Kgio::WaitReadable, rd.kgio_tryread(1)
+    assert_equal Kgio::WaitReadable, Kgio.tryread_many([ rd ], 1)[0]
+  ensure
+    rd.close
+    wr.close
+  end
+
+  def test_listener_nonblock_cleared
+    srv = Kgio::TCPServer.new("127.0.0.1", 0)
+    assert_nil srv.kgio_tryaccept
+    srv.nonblock = false # as a sibling process might
+    assert_nil srv.kgio_tryaccept
+    assert_equal [], srv.kgio_tryaccept_many(4)
+  ensure
+    srv.close
+  end
+
+  def test_fork
+    rd, wr = Kgio::Pipe.new
+    assert_equal Kgio::WaitReadable, rd.kgio_tryread(1)
+    pid = fork do
+      rd.nonblock = false
+      exit!(rd.kgio_tryread(1) == Kgio::WaitReadable)
+    end
+    _, status = Process.waitpid2(pid)
+    assert status.success?
+    assert rd.nonblock?
+  ensure
+    rd.close
+    wr.close
+  end if Process.respond_to?(:fork)
+end
@@ -0,0 +1,191 @@
+require 'test/unit'
+require 'io/nonblock'
+$-w = true
+require 'kgio'
+
+# a minimal IO.select-based Fiber scheduler which records io_wait calls
+class KgioTestScheduler
+  attr_reader :waits
+
+  def initialize
+    @readable = {}
+    @writable = {}
+    @waiting = {}
+    @ready = []
+    @waits = []
+  end
+
+  def io_wait(io, events, timeout)
+    @waits << [ io, events, timeout ]
+    fiber = Fiber.current
+    @readable[io] = fiber if events & IO::READABLE != 0
+    @writable[io] = fiber if events & IO::WRITABLE != 0
+    @waiting[fiber] = Process.clock_gettime(Process::CLOCK_MONOTONIC) +
+                      timeout if timeout
+    Fiber.yield
+  ensure
+    @readable.delete(io)
+    @writable.delete(io)
+    @waiting.delete(fiber)
+  end
+
+  def kernel_sleep(duration = nil)
+    block(:sleep, duration)
+  end
+
+  def block(blocker, timeout = nil)
+    fiber = Fiber.current
+    @waiting[fiber] = Process.clock_gettime(Process::CLOCK_MONOTONIC) +
+                      timeout if timeout
+    Fiber.yield
+  ensure
+    @waiting.delete(fiber)
+  end
+
+  def unblock(blocker, fiber)
+    @ready << fiber
+  end
+
+  def fiber(&block)
+    fiber = Fiber.new(blocking: false, &block)
+    fiber.resume
+    fiber
+  end
+
+  def close
+    run
+  end
+
+  def run
+    until @readable.empty? && @writable.empty? && @waiting.empty? &&
+          @ready.empty?
+      now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      timeout = @waiting.values.min
+      timeout = timeout ? [ timeout - now, 0 ].max : nil
+      timeout = 0 unless @ready.empty?
+      r, w = IO.select(@readable.keys, @writable.keys, nil, timeout)
+      resume = []
+      r and r.each { |io| resume << [ @readable[io], IO::READABLE ] }
+      w and w.each { |io| resume << [ @writable[io], IO::WRITABLE ] }
+      now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      @waiting.each do |fiber, t|
+        resume << [ fiber, false ] if t <= now && resume.none? { |f, _|
+          f == fiber }
+      end
+      @ready.slice!(0..-1).each { |fiber| resume << [ fiber, true ] }
+      resume.each { |fiber, rv| fiber.resume(rv) if fiber.alive? }
+    end
+  end
+end
+
+class TestKgioFiberScheduler < Test::Unit::TestCase
+  def setup
+    unless defined?(Fiber.set_scheduler) && RUBY_VERSION >= "3.1"
+      @sched = nil
+      return
+    end
+    @sched = KgioTestScheduler.new
+    @rd, @wr = Kgio::UNIXSocket.pair
+  end
+
+  def teardown
+    [ @rd, @wr ].each { |io| io.close if io && ! io.closed? }
+    Kgio.wait_readable = Kgio.wait_writable = nil
+  end
+
+  def schedule
+    thr = Thread.new do
+      Fiber.set_scheduler(@sched)
+      yield
+    end
+    thr.join
+  end
+
+  def test_read_yields_to_scheduler
+    return unless @sched
+    got = nil
+    order = []
+    schedule do
+      Fiber.schedule { got = @rd.kgio_read(5); order << :read }
+      Fiber.schedule { order << :write; @wr.kgio_write("HELLO") }
+    end
+    assert_equal "HELLO", got
+    assert_equal [ :write, :read ], order
+    assert_equal [ [ @rd, IO::READABLE, nil ] ], @sched.waits
+  end
+
+  def test_scheduler_before_hook
+    return unless @sched
+    Kgio.wait_readable = :nonexistent_method
+    got = nil
+    schedule do
+      Fiber.schedule { got = @rd.kgio_read(5) }
+      Fiber.schedule { @wr.kgio_write("HELLO") }
+    end
+    assert_equal "HELLO", got
+  end
+
+  def test_timeout_passed_to_scheduler
+    return unless @sched
+    err = nil
+    schedule do
+      Fiber.schedule do
+        begin
+          @rd.kgio_read(5, nil, 0.05)
+        rescue => err
+        end
+      end
+    end
+    assert_kind_of Kgio::Timeout, err
+    io, events, timeout = @sched.waits[0]
+    assert_equal [ @rd, IO::READABLE ], [ io, events ]
+    assert_kind_of Float, timeout
+    assert timeout > 0 && timeout <= 0.05
+  end
+
+  def test_per_io_timeout_passed_to_scheduler
+    return unless @sched
+    @rd.kgio_timeout = 0.05
+    err = nil
+    schedule do
+      Fiber.schedule do
+        begin
+          @rd.kgio_read(5)
+        rescue => err
+        end
+      end
+    end
+    assert_kind_of Kgio::Timeout, err
+    assert_equal [ [ @rd, IO::READABLE, 0.05 ] ], @sched.waits
+  end
+
+  def test_write_yields_to_scheduler
+    return unless @sched
+    buf = "." * 1024 * 1024
+    got = 0
+    schedule do
+      Fiber.schedule { @wr.kgio_write(buf) }
+      Fiber.schedule do
+        tmp = ""
+        got += @rd.kgio_read!(16384, tmp).size while got < buf.size
+      end
+    end
+    assert_equal buf.size, got
+    assert @sched.waits.any? { |io, ev, _| io == @wr && ev == IO::WRITABLE }
+  end
+
+  def test_accept_yields_to_scheduler
+    return unless @sched
+    srv = Kgio::TCPServer.new("127.0.0.1", 0)
+    port = srv.addr[1]
+    client = accepted = nil
+    schedule do
+      Fiber.schedule { accepted = srv.kgio_accept }
+      Fiber.schedule { client = Kgio::TCPSocket.new("127.0.0.1", port) }
+    end
+    assert_kind_of Kgio::Socket, accepted
+    assert_equal [ srv, IO::READABLE, nil ], @sched.waits[0]
+  ensure
+    [ srv, client, accepted ].each { |io| io.close if io && ! io.closed? }
+  end
+end
@@ -0,0 +1,101 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestKgioAddr < Test::Unit::TestCase
+  def setup
+    @ios = []
+  end
+
+  def teardown
+    @ios.each { |io| io.close unless io.closed? }
+  end
+
+  def ipv6?
+    TCPServer.new("::1", 0).close
+    true
+  rescue SystemCallError
+    false
+  end
+
+  def pair(srv, host)
+    @ios << srv
+    @ios << Kgio::TCPSocket.new(host, srv.addr[1])
+    client = srv.kgio_accept
+    @ios << client
+    client
+  end
+
+  def test_lazy
+    client = pair(Kgio::TCPServer.new("127.0.0.1", 0), "127.0.0.1")
+    assert_nil client.instance_variable_get(:@kgio_addr)
+    assert_equal "127.0.0.1", client.kgio_addr
+    assert_equal "127.0.0.1", client.instance_variable_get(:@kgio_addr)
+  end
+
+  def test_mutable_per_socket
+    srv = Kgio::TCPServer.new("127.0.0.1", 0)
+    a = pair(srv, "127.0.0.1")
+    @ios << TCPSocket.new("127.0.0.1", srv.addr[1])
+    b = srv.kgio_accept
+    @ios << b
+    assert_same a.kgio_addr, a.kgio_addr
+    assert ! a.kgio_addr.equal?(b.kgio_addr)
+    a.kgio_addr << ":1234"
+    assert_equal "127.0.0.1:1234", a.kgio_addr
+    assert_equal "127.0.0.1", b.kgio_addr
+  end
+
+  def test_assign
+    client = pair(Kgio::TCPServer.new("127.0.0.1", 0), "127.0.0.1")
+    client.kgio_addr = "10.0.0.1"
+    assert_equal "10.0.0.1", client.kgio_addr
+  end
+
+  def test_tryaccept_many
+    srv = Kgio::TCPServer.new("127.0.0.1", 0)
+    @ios << srv
+    @ios << TCPSocket.new("127.0.0.1", srv.addr[1])
+    IO.select([srv])
+    clients = srv.kgio_tryaccept_many(1)
+    @ios.concat(clients)
+    assert_equal [ "127.0.0.1" ], clients.map { |c| c.kgio_addr }
+  end
+
+  def test_ipv6
+    return unless ipv6?
+    client = pair(Kgio::TCPServer.new("::1", 0), "::1")
+    assert_equal "::1", client.kgio_addr
+    assert_equal "::1", @ios[1].peeraddr[3]
+    assert_raises(ArgumentError) { Kgio::TCPSocket.new("::1::", 80) }
+  end
+
+  def test_ipv6_tryaccept
+    return unless ipv6?
+    srv = Kgio::TCPServer.new("::1", 0)
+    @ios << srv
+    @ios << TCPSocket.new("::1", srv.addr[1])
+    IO.select([srv])
+    client = srv.kgio_tryaccept
+    @ios << client
+    assert_equal "::1", client.kgio_addr
+  end
+
+  def test_v4_mapped
+    return unless ipv6?
+    srv = begin
+      Kgio::TCPServer.new("::", 0)
+    rescue SystemCallError
+      return
+    end
+    client = pair(srv, "127.0.0.1")
+    assert_equal "127.0.0.1", client.kgio_addr
+  end
+
+  def test_reuseport_ipv6
+    return unless ipv6? && Kgio::TCPServer.respond_to?(:new_reuseport)
+    srv = Kgio::TCPServer.new_reuseport("::1", 0)
+    client = pair(srv, "::1")
+    assert_equal "::1", client.kgio_addr
+  end
+end
@@ -0,0 +1,56 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestPeek < Test::Unit::TestCase
+  class EIEIO < Errno::EIO
+  end
+
+  def teardown
+    @srv.close unless @srv.closed?
+    @cli.close unless @cli.closed?
+    @acc.close unless @acc.closed?
+    Kgio.wait_readable = nil
+  end
+
+  def setup
+    host = ENV["TEST_HOST"] || '127.0.0.1'
+    @srv = Kgio::TCPServer.new(host, 0)
+    port = @srv.addr[1]
+    @cli = Kgio::TCPSocket.new(host, port)
+    @acc = @srv.kgio_accept
+  end
+
+  def test_peek
+    assert_equal Kgio::WaitReadable, @acc.kgio_trypeek(5)
+    @cli.kgio_write "HELLO"
+    assert_equal "HELLO", @acc.kgio_peek(1024)
+    assert_equal "HELLO", @acc.kgio_trypeek(1024)
+    assert_equal "HELLO", @acc.kgio_read(1024)
+    assert_equal Kgio::WaitReadable, @acc.kgio_trypeek(5)
+  end
+
+  def test_peek_extra_buf
+    buf = "hello world"
+    @cli.kgio_write "HI"
+    rv = @acc.kgio_trypeek(1024, buf)
+    assert_equal rv.object_id, buf.object_id
+    assert_equal "HI", buf
+    assert_equal "HI", @acc.kgio_tryread(1024)
+  end
+
+  def test_peek_eof
+    @cli.close
+    assert_nil @acc.kgio_trypeek(5)
+    assert_nil @acc.kgio_peek(5)
+  end
+
+  def test_peek_wait_readable_method
+    def @acc.moo
+      raise EIEIO
+    end
+    Kgio.wait_readable = :moo
+    assert_raises(EIEIO) { @acc.kgio_peek(5) }
+    assert_equal Kgio::WaitReadable, @acc.kgio_trypeek(5)
+  end
+end
@@ -0,0 +1,55 @@
+require './test/lib_read_write.rb'
+
+class TestKgioPipeVmsplice < Test::Unit::TestCase
+  def setup
+    @rd, @wr = Kgio::Pipe.new
+  end
+
+  RANDOM_BLOB = LibReadWriteTest::RANDOM_BLOB
+
+  def teardown
+    @rd.close unless @rd.closed?
+    @wr.close unless @wr.closed?
+  end
+
+  def test_vmsplice_small
+    assert_nil @wr.kgio_vmsplice("HELLO")
+    assert_nil @wr.kgio_tryvmsplice("WORLD")
+    assert_equal "HELLOWORLD", @rd.kgio_read(10)
+  end
+
+  def test_monster_vmsplice
+    buf = RANDOM_BLOB.dup
+    thr = Thread.new { @wr.kgio_vmsplice(buf) }
+    @rd.nonblock = false
+    readed = @rd.read(buf.size)
+    thr.join
+    assert_nil thr.value
+    assert_equal RANDOM_BLOB, readed
+  end
+
+  def test_monster_tryvmsplice
+    buf = RANDOM_BLOB.dup
+    rv = @wr.kgio_tryvmsplice(buf)
+    assert_kind_of String, rv
+    assert rv.size < buf.size
+
+    # the caller may clobber its String while the pipe references it
+    buf.replace("\0" * buf.size)
+    @rd.nonblock = false
+    assert_equal(RANDOM_BLOB, @rd.read(RANDOM_BLOB.size - rv.size) + rv)
+  end
+
+  def test_vmsplice_socket_fallback
+    a, b = Kgio::UNIXSocket.pair
+    a.extend Kgio::PipeMethods
+    buf = "." * 65536
+    thr = Thread.new { a.kgio_vmsplice(buf) }
+    b.nonblock = false
+    assert_equal buf, b.read(buf.size)
+    assert_nil thr.value
+  ensure
+    a.close
+    b.close
+  end
+end
@@ -0,0 +1,108 @@
+require 'test/unit'
+require 'io/nonblock'
+$-w = true
+require 'kgio'
+
+class TestKgioPoller < Test::Unit::TestCase
+  def setup
+    @poller = Kgio::Poller.new
+    @rd, @wr = Kgio::UNIXSocket.pair
+  end
+
+  def teardown
+    @poller.close unless @poller.closed?
+    [ @rd, @wr ].each { |io| io.close unless io.closed? }
+  end
+
+  def test_timeout
+    assert_same @poller, @poller.add(@rd)
+    t0 = Time.now
+    assert_equal [], @poller.wait(0.05)
+    assert Time.now - t0 >= 0.04
+    assert_equal [], @poller.wait(0)
+  end
+
+  def test_readable
+    @poller.add(@rd, Kgio::Poller::IN)
+    @wr.kgio_write "HI"
+    assert_equal [ @rd ], @poller.wait(1)
+    assert_equal [ @rd ], @poller.wait(1) # level-triggered
+    assert_equal "HI", @rd.kgio_tryread(5)
+    assert_equal [], @poller.wait(0)
+  end
+
+  def test_array_reused
+    @poller.add(@rd)
+    @wr.kgio_write "HI"
+    a = @poller.wait(1)
+    b = @poller.wait(1)
+    assert_same a, b
+    assert_equal [ @rd ], b
+  end
+
+  def test_edge_triggered
+    @poller.add(@rd, Kgio::Poller::IN | Kgio::Poller::ET)
+    @wr.kgio_write "HI"
+    assert_equal [ @rd ], @poller.wait(1)
+    assert_equal [], @poller.wait(0)
+    @wr.kgio_write "HI"
+    assert_equal [ @rd ], @poller.wait(1)
+  end
+
+  def test_oneshot_rearm
+    @poller.add(@rd, Kgio::Poller::IN | Kgio::Poller::ONESHOT)
+    @wr.kgio_write "HI"
+    assert_equal [ @rd ], @poller.wait(1)
+    assert_equal [], @poller.wait(0)
+    @poller.add(@rd, Kgio::Poller::IN | Kgio::Poller::ONESHOT)
+    assert_equal [ @rd ], @poller.wait(1)
+  end
+
+  def test_writable
+    @poller.add(@wr, Kgio::Poller::OUT)
+    assert_equal [ @wr ], @poller.wait(1)
+  end
+
+  def test_max_events
+    pairs = (1..5).map { Kgio::UNIXSocket.pair }
+    pairs.each { |r, w| @poller.add(r); w.kgio_write "." }
+    assert_equal 2, @poller.wait(1, 2).size
+    assert_equal 5, @poller.wait(1, 100).size
+  ensure
+    pairs.flatten.each { |io| io.close } if pairs
+  end
+
+  def test_delete
+    @poller.add(@rd)
+    @wr.kgio_write "HI"
+    assert_same @rd, @poller.delete(@rd)
+    assert_nil @poller.delete(@rd)
+    assert_equal [], @poller.wait(0)
+  end
+
+  def test_wait_releases_gvl
+    @poller.add(@rd)
+    thr = Thread.new { @poller.wait(5).dup }
+    sleep 0.05
+    @wr.kgio_write "HI"
+    assert_equal [ @rd ], thr.value
+  end
+
+  def test_many
+    pairs = (1..256).map { Kgio::UNIXSocket.pair }
+    pairs.each { |r, _| @poller.add(r, Kgio::Poller::IN | Kgio::Poller::ET) }
+    pairs.each_with_index { |(_, w), i| w.kgio_write("#{i}") if i.odd? }
+    ready = []
+    ready.concat(@poller.wait(1)) while ready.size < 128
+    expect = pairs.map { |r, _| r }.values_at(*(1..255).step(2).to_a)
+    assert_equal expect.sort_by(&:fileno), ready.sort_by(&:fileno)
+  ensure
+    pairs.flatten.each { |io| io.close } if pairs
+  end
+
+  def test_closed
+    @poller.close
+    assert @poller.closed?
+    assert_raises(IOError) { @poller.wait(0) }
+  end
+end if defined?(Kgio::Poller)
@@ -0,0 +1,118 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestReadBuffer < Test::Unit::TestCase
+  def setup
+    @rd, @wr = Kgio::UNIXSocket.pair
+    @rbuf = Kgio::ReadBuffer.new(@rd)
+  end
+
+  def teardown
+    @rd.close unless @rd.closed?
+    @wr.close unless @wr.closed?
+  end
+
+  def test_fill
+    assert_equal 0, @rbuf.size
+    assert_equal 0, @rbuf.capacity
+    assert_equal Kgio::WaitReadable, @rbuf.tryfill
+    @wr.kgio_write "HELLO"
+    assert_equal 5, @rbuf.tryfill
+    assert_equal 5, @rbuf.size
+    assert @rbuf.capacity >= 16384
+    assert_equal "HELLO", @rbuf.to_s
+    @wr.close
+    assert_nil @rbuf.tryfill
+    assert_nil @rbuf.fill
+    assert_equal "HELLO", @rbuf.to_s
+    assert_same @rd, @rbuf.io
+  end
+
+  def test_slice_consume_shift
+    @wr.kgio_write "HELLO WORLD"
+    @rbuf.fill
+    assert_equal "WORLD", @rbuf.slice(6, 100)
+    assert_equal "", @rbuf.slice(11, 1)
+    assert_nil @rbuf.slice(12, 1)
+    assert_equal 6, @rbuf.consume(6)
+    assert_equal "WORLD", @rbuf.to_s
+    assert_equal "WOR", @rbuf.shift(3)
+    assert_equal "LD", @rbuf.shift(100)
+    assert_equal 0, @rbuf.consume(1)
+    assert_equal "", @rbuf.to_s
+  end
+
+  def test_index
+    @wr.kgio_write "a\r\nb\r\n"
+    @rbuf.fill
+    assert_equal 1, @rbuf.index("\r\n")
+    assert_equal 4, @rbuf.index("\r\n", 2)
+    assert_nil @rbuf.index("x")
+  end
+
+  def test_read_until
+    assert_equal Kgio::WaitReadable, @rbuf.tryread_until("\r\n\r\n", 1000)
+    @wr.kgio_write "GET / HTTP/1.1\r\n\r"
+    assert_equal Kgio::WaitReadable, @rbuf.tryread_until("\r\n\r\n", 1000)
+    @wr.kgio_write "\nGET /b HTTP/1.1\r\n\r\n"
+    assert_equal "GET / HTTP/1.1\r\n\r\n", @rbuf.tryread_until("\r\n\r\n", 1000)
+    assert_equal "GET /b HTTP/1.1\r\n\r\n", @rbuf.read_until("\r\n\r\n", 1000)
+    assert_equal 0, @rbuf.size
+    @wr.kgio_write "TOOLONG"
+    assert_equal "TOO", @rbuf.tryread_until("\n", 3)
+    @wr.close
+    assert_nil @rbuf.read_until("\n", 100)
+    assert_equal "LONG", @rbuf.to_s
+  end
+
+  def test_read_exactly
+    assert_equal Kgio::WaitReadable, @rbuf.tryread_exactly(5)
+    @wr.kgio_write "HEL"
+    assert_equal Kgio::WaitReadable, @rbuf.tryread_exactly(5)
+    thr = Thread.new { sleep 0.05; @wr.kgio_write "LO!" }
+    assert_equal "HELLO", @rbuf.read_exactly(5)
+    thr.join
+    assert_equal "!", @rbuf.to_s
+  end
+
+  def test_big_frames_shared
+    blob = "." * 100_000
+    thr = Thread.new { @wr.kgio_write(blob * 2) }
+    a = @rbuf.read_exactly(blob.size)
+    b = @rbuf.read_exactly(blob.size)
+    thr.join
+    assert_equal blob, a
+    assert_equal blob, b
+    @wr.kgio_write "NEXT"
+    assert_equal "NEXT", @rbuf.read_exactly(4)
+    assert_equal blob, a
+  end
+
+  def test_shrink
+    @wr.kgio_write "HELLO"
+    @rbuf.fill
+    @rbuf.consume(1)
+    assert_equal 4, @rbuf.shrink
+    assert_equal "ELLO", @rbuf.to_s
+    @rbuf.consume(4)
+    assert_equal 0, @rbuf.shrink
+    assert_equal 0, @rbuf.capacity
+    @wr.kgio_write "AGAIN"
+    assert_equal "AGAIN", @rbuf.read_exactly(5)
+  end
+
+  def test_pipe_chunk
+    rd, wr = Kgio::Pipe.new
+    rbuf = Kgio::ReadBuffer.new(rd, 4)
+    wr.kgio_write "HELLO"
+    assert_equal 4, rbuf.fill
+    assert_equal 1, rbuf.fill
+    assert_equal "HELLO", rbuf.to_s
+    assert_raises(ArgumentError) { Kgio::ReadBuffer.new(rd, 0) }
+    assert_raises(TypeError) { Kgio::ReadBuffer.new(nil) }
+  ensure
+    rd.close
+    wr.close
+  end
+end
@@ -0,0 +1,154 @@
+require 'test/unit'
+require 'socket'
+$-w = true
+require 'kgio'
+
+module LibReadExactlyTest
+  def teardown
+    @rd.close unless @rd.closed?
+    @wr.close unless @wr.closed?
+    Kgio.wait_readable = nil
+  end
+
+  def test_read_exactly
+    thr = Thread.new do
+      %w(HE LL O).each { |s| sleep 0.02; @wr.kgio_write(s) }
+    end
+    assert_equal "HELLO", @rd.kgio_read_exactly(5)
+    thr.join
+  end
+
+  def test_read_exactly_buf
+    buf = "HE"
+    @wr.kgio_write "LLO WORLD"
+    rv = @rd.kgio_read_exactly(5, buf)
+    assert_equal rv.object_id, buf.object_id
+    assert_equal "HELLO", buf
+    assert_equal " WORLD", @rd.kgio_read(6)
+    assert_equal "", @rd.kgio_read_exactly(0)
+  end
+
+  def test_tryread_exactly
+    buf = ""
+    assert_equal Kgio::WaitReadable, @rd.kgio_tryread_exactly(5, buf)
+    @wr.kgio_write "HEL"
+    assert_equal Kgio::WaitReadable, @rd.kgio_tryread_exactly(5, buf)
+    assert_equal "HEL", buf
+    @wr.kgio_write "LO"
+    assert_equal "HELLO", @rd.kgio_tryread_exactly(5, buf)
+  end
+
+  def test_reset_rcvlowat
+    buf = ""
+    assert_equal false, @rd.kgio_reset_rcvlowat
+    @wr.kgio_write "HI"
+    assert_equal Kgio::WaitReadable, @rd.kgio_tryread_exactly(1000, buf)
+    @rd.kgio_reset_rcvlowat
+    assert_equal false, @rd.kgio_reset_rcvlowat
+    @wr.kgio_write "!"
+    assert IO.select([ @rd ], nil, nil, 5)
+    assert_equal "!", @rd.kgio_tryread(1000)
+  end
+
+  def test_read_exactly_eof
+    buf = ""
+    @wr.kgio_write "HEL"
+    @wr.close
+    assert_nil @rd.kgio_read_exactly(5, buf)
+    assert_equal "HEL", buf
+    assert_nil @rd.kgio_tryread_exactly(5, buf)
+  end
+
+  def test_read_exactly_wait_readable_method
+    def @rd.moo
+      raise EOFError, "moo"
+    end
+    Kgio.wait_readable = :moo
+    assert_raises(EOFError) { @rd.kgio_read_exactly(5) }
+  end
+end
+
+class TestPipeReadExactly < Test::Unit::TestCase
+  include LibReadExactlyTest
+
+  def setup
+    @rd, @wr = Kgio::Pipe.new
+  end
+end
+
+class TestTCPReadExactly < Test::Unit::TestCase
+  include LibReadExactlyTest
+
+  def setup
+    host = ENV["TEST_HOST"] || '127.0.0.1'
+    @srv = Kgio::TCPServer.new(host, 0)
+    @wr = Kgio::TCPSocket.new(host, @srv.addr[1])
+    @rd = @srv.kgio_accept
+  end
+
+  def teardown
+    super
+    @srv.close
+  end
+
+  def lowat
+    @rd.getsockopt(Socket::SOL_SOCKET, Socket::SO_RCVLOWAT).int
+  end
+
+  def test_tryread_exactly_lowat
+    buf = ""
+    assert_equal 1, lowat
+    @wr.kgio_write "HI"
+    assert_equal Kgio::WaitReadable, @rd.kgio_tryread_exactly(1000, buf)
+    assert_equal 998, lowat
+    assert_nil IO.select([ @rd ], nil, nil, 0.1)
+    @wr.kgio_write "." * 998
+    assert IO.select([ @rd ], nil, nil, 5)
+    assert_equal 1000, @rd.kgio_tryread_exactly(1000, buf).size
+    assert_equal 1, lowat
+  end
+
+  def test_reset_rcvlowat_tcp
+    @wr.kgio_write "HI"
+    assert_equal Kgio::WaitReadable, @rd.kgio_tryread_exactly(1000, "")
+    assert_equal 998, lowat
+    assert_equal true, @rd.kgio_reset_rcvlowat
+    assert_equal 1, lowat
+  end
+
+  def test_read_exactly_lowat_restored
+    def @rd.wait_readable
+      IO.select([ self ])
+      @lowat = getsockopt(Socket::SOL_SOCKET, Socket::SO_RCVLOWAT).int
+    end
+    Kgio.wait_readable = :wait_readable
+    thr = Thread.new { sleep 0.05; @wr.kgio_write("." * 100) }
+    assert_equal 100, @rd.kgio_read_exactly(100).size
+    thr.join
+    assert_equal 100, @rd.instance_variable_get(:@lowat)
+    assert_equal 1, lowat
+  end
+
+  def test_read_exactly_big
+    blob = "." * (1024 * 1024)
+    @rd.instance_variable_set(:@nr, 0)
+    def @rd.wait_readable
+      @nr += 1
+      IO.select([ self ])
+    end
+    Kgio.wait_readable = :wait_readable
+    thr = Thread.new { @wr.kgio_write(blob) }
+    assert_equal blob, @rd.kgio_read_exactly(blob.size)
+    thr.join
+    assert @rd.instance_variable_get(:@nr) < 64
+    assert_equal 1, lowat
+  end
+end
+
+class TestSocketPairReadExactly < Test::Unit::TestCase
+  include LibReadExactlyTest
+
+  def setup
+    @rd, @wr = Kgio::UNIXSocket.pair
+  end
+end
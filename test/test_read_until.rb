@@ -0,0 +1,111 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+module LibReadUntilTest
+  def teardown
+    @rd.close unless @rd.closed?
+    @wr.close unless @wr.closed?
+    Kgio.wait_readable = nil
+  end
+
+  def test_tryread_until
+    buf = ""
+    assert_equal Kgio::WaitReadable, @rd.kgio_tryread_until("\n", 100, buf)
+    assert_equal "", buf
+    @wr.kgio_write "GET / HTTP/1.0\r\n"
+    assert_equal Kgio::WaitReadable,
+                 @rd.kgio_tryread_until("\r\n\r\n", 100, buf)
+    assert_equal "GET / HTTP/1.0\r\n", buf
+    @wr.kgio_write "Host: example.com\r\n\r"
+    assert_equal Kgio::WaitReadable,
+                 @rd.kgio_tryread_until("\r\n\r\n", 100, buf)
+    @wr.kgio_write "\nbody"
+    len = @rd.kgio_tryread_until("\r\n\r\n", 100, buf)
+    assert_equal "GET / HTTP/1.0\r\nHost: example.com\r\n\r\n",
+                 buf.slice!(0, len)
+    assert_equal "body", buf
+  end
+
+  def test_tryread_until_buffered_frames
+    buf = ""
+    @wr.kgio_write "a\nbb\nccc"
+    assert_equal 2, @rd.kgio_tryread_until("\n", 100, buf)
+    assert_equal "a\n", buf.slice!(0, 2)
+    assert_equal 3, @rd.kgio_tryread_until("\n", 100, buf)
+    assert_equal "bb\n", buf.slice!(0, 3)
+    assert_equal Kgio::WaitReadable, @rd.kgio_tryread_until("\n", 100, buf)
+    assert_equal "ccc", buf
+    @wr.kgio_write "\n"
+    assert_equal 4, @rd.kgio_tryread_until("\n", 100, buf)
+  end
+
+  def test_tryread_until_maxlen
+    buf = ""
+    @wr.kgio_write "HELLO WORLD"
+    assert_equal 5, @rd.kgio_tryread_until("\n", 5, buf)
+    assert_equal "HELLO", buf
+    assert_equal 5, @rd.kgio_tryread_until("\n", 5, buf)
+  end
+
+  def test_tryread_until_eof
+    buf = ""
+    @wr.kgio_write "partial"
+    @wr.close
+    assert_nil @rd.kgio_tryread_until("\n", 100, buf)
+    assert_equal "partial", buf
+    assert_nil @rd.kgio_read_until("\n", 100, buf)
+  end
+
+  def test_tryread_until_different_buf
+    a, b = "", ""
+    @wr.kgio_write "HI"
+    assert_equal Kgio::WaitReadable, @rd.kgio_tryread_until("\n", 100, a)
+    b << "X\nY"
+    assert_equal 2, @rd.kgio_tryread_until("\n", 100, b)
+    assert_equal "HI", a
+  end
+
+  def test_read_until
+    buf = ""
+    thr = Thread.new do
+      sleep 0.05
+      @wr.kgio_write "HELLO\r"
+      sleep 0.05
+      @wr.kgio_write "\nWORLD"
+    end
+    assert_equal 7, @rd.kgio_read_until("\r\n", 100, buf)
+    assert_equal "HELLO\r\nWORLD", buf
+    thr.join
+  end
+
+  def test_read_until_wait_readable_method
+    def @rd.moo
+      raise EOFError, "moo"
+    end
+    Kgio.wait_readable = :moo
+    assert_raises(EOFError) { @rd.kgio_read_until("\n", 100, "") }
+  end
+
+  def test_bad_args
+    assert_raises(ArgumentError) { @rd.kgio_tryread_until("", 100, "") }
+    assert_raises(ArgumentError) { @rd.kgio_tryread_until("\n", 0, "") }
+    assert_raises(TypeError) { @rd.kgio_tryread_until("\n", 100, nil) }
+  end
+end
+
+class TestPipeReadUntil < Test::Unit::TestCase
+  include LibReadUntilTest
+
+  def setup
+    @rd, @wr = Kgio::Pipe.new
+  end
+end
+
+class TestSocketPairReadUntil < Test::Unit::TestCase
+  include LibReadUntilTest
+
+  def setup
+    @rd, @wr = Kgio::UNIXSocket.pair
+  end
+end
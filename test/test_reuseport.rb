@@ -0,0 +1,92 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestReuseport < Test::Unit::TestCase
+  BPF_RET_K = 0x06 # BPF_RET | BPF_K
+
+  def setup
+    @srvs = []
+    @clients = []
+  end
+
+  def teardown
+    (@srvs + @clients).each { |io| io.close unless io.closed? }
+  end
+
+  def listen(port = 0, opts = nil)
+    srv = if opts
+      Kgio::TCPServer.new_reuseport("127.0.0.1", port, opts)
+    else
+      Kgio::TCPServer.new_reuseport("127.0.0.1", port)
+    end
+    @srvs << srv
+    srv
+  end
+
+  def connect(port, nr)
+    nr.times { @clients << TCPSocket.new("127.0.0.1", port) }
+    sleep 0.05
+  end
+
+  def test_group
+    return unless Kgio::TCPServer.respond_to?(:new_reuseport)
+    a = listen
+    port = a.addr[1]
+    b = listen(port, :backlog => 128)
+    assert_instance_of Kgio::TCPServer, b
+    assert_equal port, b.addr[1]
+    connect(port, 20)
+    got = a.kgio_tryaccept_many(20) + b.kgio_tryaccept_many(20)
+    assert_equal 20, got.size
+    got.each do |c|
+      assert_equal "127.0.0.1", c.kgio_addr
+      c.close
+    end
+  end
+
+  def test_plain_server_conflicts
+    return unless Kgio::TCPServer.respond_to?(:new_reuseport)
+    port = listen.addr[1]
+    assert_raises(Errno::EADDRINUSE) { TCPServer.new("127.0.0.1", port) }
+  end
+
+  def test_bpf
+    return unless Kgio::TCPServer.respond_to?(:new_reuseport)
+    a = listen
+    port = a.addr[1]
+    begin
+      b = listen(port, :bpf => [ [ BPF_RET_K, 0, 0, 1 ] ])
+    rescue NotImplementedError
+      return
+    end
+    connect(port, 5)
+    assert_equal [], a.kgio_tryaccept_many(5)
+    assert_equal 5, b.kgio_tryaccept_many(5).each { |c| c.close }.size
+  end
+
+  def test_bpf_cpu
+    return unless Kgio::TCPServer.respond_to?(:new_reuseport)
+    begin
+      a = listen(0, :bpf => :cpu, :workers => 1)
+    rescue NotImplementedError
+      return
+    end
+    port = a.addr[1]
+    b = listen(port)
+    connect(port, 5)
+    assert_equal [], b.kgio_tryaccept_many(5)
+    assert_equal 5, a.kgio_tryaccept_many(5).each { |c| c.close }.size
+  end
+
+  def test_invalid
+    return unless Kgio::TCPServer.respond_to?(:new_reuseport)
+    assert_raises(ArgumentError) { listen(0, :bpf => []) }
+    assert_raises(ArgumentError) { listen(0, :bpf => [ [ 1, 2 ] ]) }
+    assert_raises(ArgumentError) { listen(0, :bpf => :cpu, :workers => 0) }
+    assert_raises(TypeError) { listen(0, :bpf => "x") }
+    assert_raises(ArgumentError) {
+      Kgio::TCPServer.new_reuseport("localhost", 0)
+    }
+  end
+end
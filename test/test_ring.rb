@@ -0,0 +1,205 @@
+require 'test/unit'
+require 'io/nonblock'
+$-w = true
+require 'kgio'
+
+class TestKgioRing < Test::Unit::TestCase
+  def setup
+    @ring = Kgio::Ring.new(16) if Kgio::Ring.supported?
+    @ios = []
+  end
+
+  def teardown
+    @ring.close if @ring && ! @ring.closed?
+    @ios.each { |io| io.close unless io.closed? }
+  end
+
+  def wait_for(count)
+    rv = []
+    rv.concat(@ring.wait) while rv.size < count
+    rv
+  end
+
+  def abandon_read(io, buf)
+    ring = Kgio::Ring.new(4)
+    ring.read(io, 5, buf)
+    ring.submit
+    nil
+  end
+
+  def test_supported
+    assert [ true, false ].include?(Kgio::Ring.supported?)
+    unless Kgio::Ring.supported?
+      assert_raises(NotImplementedError) { Kgio::Ring.new }
+    end
+  end
+
+  def test_read_write_socket
+    return unless @ring
+    a, b = Kgio::UNIXSocket.pair
+    @ios.concat [ a, b ]
+    buf = ""
+    assert_same @ring, @ring.read(a, 5, buf)
+    assert_same @ring, @ring.write(b, "HELLO")
+    assert_equal 2, @ring.pending
+    done = wait_for(2).sort_by { |op, _, _| op.to_s }
+    assert_equal [ [ :read, a, buf ], [ :write, b, nil ] ], done
+    assert_equal "HELLO", buf
+    assert_nothing_raised { buf << "unlocked" }
+    assert_equal 0, @ring.pending
+  end
+
+  def test_read_pipe_eagain_and_eof
+    return unless @ring
+    r, w = Kgio::Pipe.new
+    @ios.concat [ r, w ]
+    assert_equal Kgio::WaitReadable, r.kgio_tryread(1) # sets O_NONBLOCK
+    @ring.read(r, 100)
+    assert_equal 1, @ring.submit
+    assert_equal [], @ring.harvest
+    w.kgio_write "abc"
+    assert_equal [ [ :read, r, "abc" ] ], wait_for(1)
+    w.close
+    @ring.read(r, 100)
+    assert_equal [ [ :read, r, nil ] ], wait_for(1)
+  end
+
+  def test_write_large
+    return unless @ring
+    a, b = Kgio::UNIXSocket.pair
+    @ios.concat [ a, b ]
+    blob = File.open("/dev/urandom") { |fp| fp.read(4 * 1024 * 1024) }
+    @ring.write(a, blob)
+    @ring.submit
+    thr = Thread.new { b.read(blob.size) }
+    assert_equal [ [ :write, a, nil ] ], wait_for(1)
+    assert_equal blob, thr.value
+  end
+
+  def test_writev
+    return unless @ring
+    a, b = Kgio::UNIXSocket.pair
+    @ios.concat [ a, b ]
+    ary = [ "HELLO", " ", :WORLD ]
+    @ring.writev(a, ary)
+    ary[0] << "!!!"
+    assert_equal [ [ :writev, a, nil ] ], wait_for(1)
+    assert_equal "HELLO WORLD", b.kgio_read(100)
+  end
+
+  def test_accept_tcp
+    return unless @ring
+    srv = Kgio::TCPServer.new("127.0.0.1", 0)
+    @ios << srv
+    @ring.accept(srv)
+    @ring.submit
+    port = srv.addr[1]
+    clients = (1..3).map { TCPSocket.new("127.0.0.1", port) }
+    @ios.concat clients
+    done = wait_for(3)
+    done.each do |op, io, client|
+      assert_equal :accept, op
+      assert_same srv, io
+      assert_kind_of Kgio::Socket, client
+      assert_equal "127.0.0.1", client.kgio_addr
+      @ios << client
+    end
+    assert_equal 1, @ring.pending
+
+    @ring.cancel(srv)
+    op, io, err = wait_for(1)[0]
+    assert_equal [ :accept, srv ], [ op, io ]
+    assert_kind_of Errno::ECANCELED, err
+    assert_equal 0, @ring.pending
+  end
+
+  def test_accept_unix_class
+    return unless @ring
+    path = "/tmp/kgio_ring_#{$$}_#{rand}"
+    srv = Kgio::UNIXServer.new(path)
+    @ios << srv
+    Kgio.accept_class = Kgio::UNIXSocket
+    @ring.accept(srv)
+    @ring.submit
+    @ios << UNIXSocket.new(path)
+    op, io, client = wait_for(1)[0]
+    @ios << client
+    assert_equal [ :accept, srv ], [ op, io ]
+    assert_instance_of Kgio::UNIXSocket, client
+    assert_equal Kgio::LOCALHOST, client.kgio_addr
+  ensure
+    Kgio.accept_class = nil
+    File.unlink(path) if path && File.exist?(path)
+  end
+
+  def test_splice
+    return unless @ring
+    r, w = Kgio::Pipe.new
+    a, b = Kgio::UNIXSocket.pair
+    @ios.concat [ r, w, a, b ]
+    w.kgio_write "HELLO"
+    @ring.splice(r, a, 100)
+    assert_equal [ [ :splice, r, 5 ] ], wait_for(1)
+    assert_equal "HELLO", b.kgio_read(5)
+  end
+
+  def test_close_io
+    return unless @ring
+    a, b = Kgio::UNIXSocket.pair
+    @ios.concat [ a, b ]
+    @ring.close_io(a)
+    assert a.closed?
+    assert_equal [ [ :close, a, nil ] ], wait_for(1)
+    assert_nil b.kgio_read(1)
+  end
+
+  def test_close_io_flushes
+    return unless @ring
+    a, b = Kgio::UNIXSocket.pair
+    @ios.concat [ a, b ]
+    a.sync = false
+    a.write "HELLO"
+    @ring.close_io(a)
+    assert a.closed?
+    assert_equal [ [ :close, a, nil ] ], wait_for(1)
+    assert_equal "HELLO", b.kgio_read(5)
+    assert_nil b.kgio_read(1)
+  end
+
+  def test_gc_without_close
+    return unless @ring
+    a, b = Kgio::UNIXSocket.pair
+    @ios.concat [ a, b ]
+    buf = ""
+    abandon_read(a, buf)
+    GC.start
+    Kgio::Ring.new(4).close # reaps rings collected while open
+    b.kgio_write "HELLO"
+    assert_nothing_raised { buf << "unlocked" }
+    assert_equal "HELLO", a.kgio_read(5)
+  end
+
+  def test_errors_are_results
+    return unless @ring
+    a, b = Kgio::UNIXSocket.pair
+    @ios.concat [ a, b ]
+    b.close
+    @ring.write(a, "HELLO")
+    op, io, err = wait_for(1)[0]
+    assert_equal [ :write, a ], [ op, io ]
+    assert_kind_of Errno::EPIPE, err
+  end
+
+  def test_close_cancels
+    return unless @ring
+    a, b = Kgio::UNIXSocket.pair
+    @ios.concat [ a, b ]
+    buf = ""
+    @ring.read(a, 5, buf)
+    @ring.submit
+    assert_nil @ring.close
+    assert @ring.closed?
+    assert_nothing_raised { buf << "unlocked" }
+    assert_raises(IOError) { @ring.submit }
+  end
+end
@@ -0,0 +1,76 @@
+require 'test/unit'
+require 'io/nonblock'
+require 'tempfile'
+$-w = true
+require 'kgio'
+
+class TestKgioSendfile < Test::Unit::TestCase
+  BLOB = File.open("/dev/urandom") { |fp| fp.read(4 * 1024 * 1024) }
+
+  def setup
+    @rd, @wr = Kgio::UNIXSocket.pair
+    @tmp = Tempfile.new('kgio_sendfile')
+    @tmp.sync = true
+    @tmp.write(BLOB)
+  end
+
+  def teardown
+    @rd.close unless @rd.closed?
+    @wr.close unless @wr.closed?
+    @tmp.close!
+    Kgio.wait_writable = nil
+  end
+
+  def test_sendfile_partial
+    assert_equal 5, @wr.kgio_sendfile(@tmp, 10, 5)
+    assert_equal BLOB[10, 5], @rd.kgio_read(5)
+    assert_equal BLOB.size, @tmp.pos
+  end
+
+  def test_sendfile_past_eof
+    assert_equal 0, @wr.kgio_sendfile(@tmp, BLOB.size + 1)
+    assert_equal 2, @wr.kgio_sendfile(@tmp, BLOB.size - 2, 100)
+    assert_equal BLOB[-2, 2], @rd.kgio_read(100)
+  end
+
+  def test_sendfile_whole
+    thr = Thread.new { @wr.kgio_sendfile(@tmp) }
+    @rd.nonblock = false
+    assert_equal BLOB, @rd.read(BLOB.size)
+    assert_equal BLOB.size, thr.value
+  end
+
+  def test_trysendfile
+    rv = @wr.kgio_trysendfile(@tmp, 0, BLOB.size)
+    assert_kind_of Integer, rv
+    assert rv > 0 && rv < BLOB.size
+    assert_equal Kgio::WaitWritable, @wr.kgio_trysendfile(@tmp, rv, 1)
+    @rd.nonblock = false
+    assert_equal BLOB[0, rv], @rd.read(rv)
+  end
+
+  def test_sendfile_wait_writable_method
+    @wr.instance_variable_set :@nr, 0
+    def @wr.wait_writable
+      @nr += 1
+      IO.select(nil, [self])
+    end
+    Kgio.wait_writable = :wait_writable
+    thr = Thread.new { @wr.kgio_sendfile(@tmp) }
+    @rd.nonblock = false
+    assert_equal BLOB, @rd.read(BLOB.size)
+    assert_equal BLOB.size, thr.value
+    assert @wr.instance_variable_get(:@nr) > 0
+  end
+
+  def test_sendfile_closed
+    @rd.close
+    begin
+      loop { @wr.kgio_sendfile(@tmp) }
+    rescue Errno::EPIPE, Errno::ECONNRESET => e
+      assert_equal [], e.backtrace
+      return
+    end
+    assert false, "should never get here (line:#{__LINE__})"
+  end
+end
@@ -0,0 +1,81 @@
+require 'test/unit'
+require 'io/nonblock'
+$-w = true
+require 'kgio'
+
+class TestKgioSplice < Test::Unit::TestCase
+  def setup
+    @src_rd, @src_wr = Kgio::UNIXSocket.pair
+    @dst_rd, @dst_wr = Kgio::UNIXSocket.pair
+  end
+
+  def teardown
+    [ @src_rd, @src_wr, @dst_rd, @dst_wr ].each { |io| io.close unless io.closed? }
+    Kgio.wait_readable = Kgio.wait_writable = nil
+  end
+
+  def test_trysplice
+    assert_equal Kgio::WaitReadable, Kgio.trysplice(@src_rd, @dst_wr, 16384)
+    @src_wr.kgio_write "HELLO"
+    assert_equal 5, Kgio.trysplice(@src_rd, @dst_wr, 16384)
+    assert_equal "HELLO", @dst_rd.kgio_read(5)
+    @src_wr.close
+    assert_nil Kgio.trysplice(@src_rd, @dst_wr, 16384)
+  end
+
+  def test_splice_blocking
+    thr = Thread.new { sleep 0.5; @src_wr.kgio_write "HELLO" }
+    assert_equal 5, Kgio.splice(@src_rd, @dst_wr, 16384)
+    assert_equal "HELLO", @dst_rd.kgio_read(5)
+    thr.join
+  end
+
+  def test_trysplice_dst_full
+    buf = "." * 4096
+    sent = 0
+    loop do
+      case rv = @dst_wr.kgio_trywrite(buf)
+      when nil then sent += buf.size
+      when String then sent += buf.size - rv.size
+      else break
+      end
+    end
+    @src_wr.kgio_write "HELLO"
+    assert_equal 5, Kgio.trysplice(@src_rd, @dst_wr, 16384)
+    @src_wr.kgio_write "WORLD"
+    assert_equal Kgio::WaitWritable, Kgio.trysplice(@src_rd, @dst_wr, 16384)
+
+    @dst_rd.nonblock = false
+    assert_equal sent, @dst_rd.read(sent).size
+    rv = Kgio.trysplice(@src_rd, @dst_wr, 16384)
+    assert_kind_of Integer, rv
+    assert_equal "HELLOWORLD", @dst_rd.kgio_read(10)
+  end
+
+  def test_splice_many
+    blob = File.open("/dev/urandom") { |fp| fp.read(1024 * 1024) }
+    wr = Thread.new { @src_wr.kgio_write(blob); @src_wr.close }
+    rd = Thread.new { @dst_rd.nonblock = false; @dst_rd.read }
+    nr = 0
+    while n = Kgio.splice(@src_rd, @dst_wr, 65536)
+      nr += n
+    end
+    @dst_wr.close
+    wr.join
+    assert_equal blob.size, nr
+    assert_equal blob, rd.value
+  end
+
+  def test_trytee
+    log_rd, log_wr = Kgio::Pipe.new
+    @src_wr.kgio_write "HELLO"
+    assert_equal 5, Kgio.trytee(@src_rd, @dst_wr, 16384, log_wr)
+    assert_equal "HELLO", @dst_rd.kgio_read(5)
+    assert_equal "HELLO", log_rd.kgio_read(5)
+    @src_wr.close
+    assert_nil Kgio.tee(@src_rd, @dst_wr, 16384, log_wr)
+  ensure
+    log_rd.close
+    log_wr.close
+  end
+end if Kgio.respond_to?(:trysplice)
@@ -0,0 +1,109 @@
+require 'test/unit'
+require 'io/nonblock'
+$-w = true
+require 'kgio'
+
+class TestKgioTimeout < Test::Unit::TestCase
+  def setup
+    @rd, @wr = Kgio::UNIXSocket.pair
+  end
+
+  def teardown
+    [ @rd, @wr ].each { |io| io.close unless io.closed? }
+    Kgio.wait_readable = Kgio.wait_writable = nil
+  end
+
+  def assert_timeout(min)
+    t0 = Time.now
+    err = assert_raises(Kgio::Timeout) { yield }
+    assert Time.now - t0 >= min
+    assert_equal [], err.backtrace
+    assert_kind_of Timeout::Error, err
+  end
+
+  def test_read_timeout
+    assert_timeout(0.05) { @rd.kgio_read(5, nil, 0.05) }
+    assert_timeout(0.05) { @rd.kgio_read!(5, "", 0.05) }
+  end
+
+  def test_read_before_timeout
+    @wr.kgio_write "HI"
+    assert_equal "HI", @rd.kgio_read(5, nil, 0.05)
+    thr = Thread.new { sleep 0.05; @wr.kgio_write "HELLO" }
+    assert_equal "HELLO", @rd.kgio_read(5, nil, 5)
+    thr.join
+  end
+
+  def test_pipe_read_timeout
+    r, w = Kgio::Pipe.new
+    assert_timeout(0.05) { r.kgio_read(5, nil, 0.05) }
+    w.kgio_write("HI", 1)
+    assert_equal "HI", r.kgio_read(5, nil, 0.05)
+  ensure
+    r.close
+    w.close
+  end
+
+  def test_per_io_default
+    assert_nil @rd.kgio_timeout
+    @rd.kgio_timeout = 0.05
+    assert_equal 0.05, @rd.kgio_timeout
+    assert_timeout(0.05) { @rd.kgio_read(5) }
+    assert_timeout(0.05) { @rd.kgio_read_until("\n", 100, "") }
+    @rd.kgio_timeout = nil
+    assert_nil @rd.kgio_timeout
+  end
+
+  def test_explicit_overrides_default
+    @rd.kgio_timeout = 60
+    assert_timeout(0.05) { @rd.kgio_read(5, nil, 0.05) }
+  end
+
+  def test_write_timeout
+    buf = "." * 1024 * 1024 * 10
+    assert_timeout(0.05) { @wr.kgio_write(buf, 0.05) }
+    assert_timeout(0.05) { @wr.kgio_write(buf, 0.05, :more => true) }
+    @wr.kgio_timeout = 0.05
+    assert_timeout(0.05) { @wr.kgio_write(buf) }
+  end
+
+  def test_invalid
+    assert_raises(ArgumentError) { @rd.kgio_read(5, nil, -1) }
+    assert_raises(ArgumentError) { @rd.kgio_timeout = -1 }
+    assert_raises(ArgumentError) { @rd.kgio_tryread(5, nil, 1) }
+    assert_raises(ArgumentError) { @wr.kgio_trywrite("HI", false, 1) }
+  end
+
+  def test_accept_timeout
+    srv = Kgio::TCPServer.new("127.0.0.1", 0)
+    assert_timeout(0.05) { srv.kgio_accept(0.05) }
+    srv.kgio_timeout = 0.05
+    assert_timeout(0.05) { srv.kgio_accept }
+    client = TCPSocket.new("127.0.0.1", srv.addr[1])
+    accepted = srv.kgio_accept(1)
+    assert_kind_of Kgio::Socket, accepted
+    assert_equal "127.0.0.1", accepted.kgio_addr
+  ensure
+    [ srv, client, accepted ].each { |io| io.close if io && ! io.closed? }
+  end
+
+  def test_unix_accept_timeout
+    path = "/tmp/kgio_timeout_#{$$}_#{rand}"
+    srv = Kgio::UNIXServer.new(path)
+    assert_timeout(0.05) { srv.kgio_accept(0.05) }
+    client = Kgio::UNIXSocket.new(path, 1)
+    accepted = srv.kgio_accept(1)
+    assert_kind_of Kgio::Socket, accepted
+  ensure
+    [ srv, client, accepted ].each { |io| io.close if io && ! io.closed? }
+    File.unlink(path) if path && File.exist?(path)
+  end
+
+  def test_tcp_connect_timeout_arg
+    srv = Kgio::TCPServer.new("127.0.0.1", 0)
+    client = Kgio::TCPSocket.new("127.0.0.1", srv.addr[1], 1)
+    assert_kind_of Kgio::TCPSocket, client
+  ensure
+    [ srv, client ].each { |io| io.close if io && ! io.closed? }
+  end
+end
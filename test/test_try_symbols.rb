@@ -0,0 +1,199 @@
+require 'test/unit'
+require 'socket'
+$-w = true
+require 'kgio'
+
+class TestTrySymbols < Test::Unit::TestCase
+  def setup
+    @rd, @wr = Kgio::UNIXSocket.pair
+  end
+
+  def teardown
+    [ @rd, @wr ].each { |io| io.close unless io.closed? }
+  end
+
+  def test_setting
+    assert_equal false, @rd.kgio_try_symbols?
+    @rd.kgio_try_symbols = true
+    assert_equal true, @rd.kgio_try_symbols?
+    assert_equal false, @wr.kgio_try_symbols?
+    assert_raises(TypeError) { @rd.kgio_try_symbols = nil }
+    @rd.kgio_try_symbols = false
+    assert_equal false, @rd.kgio_try_symbols?
+  end
+
+  def test_per_io
+    a, b = Kgio::UNIXSocket.pair
+    a.kgio_try_symbols = true
+    @wr.close
+    b.close
+    assert_nil @rd.kgio_tryread(5)
+    assert_equal :eof, a.kgio_tryread(5)
+    assert_equal [ nil, :eof ], Kgio.tryread_many([ @rd, a ], 5)
+  ensure
+    a.close if a
+  end
+
+  def test_tryread_eof
+    @wr.close
+    assert_nil @rd.kgio_tryread(5)
+    @rd.kgio_try_symbols = true
+    assert_equal :eof, @rd.kgio_tryread(5)
+    assert_equal :eof, @rd.kgio_trypeek(5)
+    assert_equal :eof, @rd.kgio_tryreadv([ 5 ])
+    assert_equal [ :eof ], Kgio.tryread_many([ @rd ], 5)
+    assert_nil @rd.kgio_read(5)
+  end
+
+  def test_pipe_tryread_eof
+    r, w = Kgio::Pipe.new
+    r.kgio_try_symbols = true
+    w.close
+    assert_equal :eof, r.kgio_tryread(5)
+  ensure
+    r.close
+  end
+
+  def test_framed_tryread_eof
+    @wr.close
+    @rd.kgio_try_symbols = true
+    assert_equal :eof, @rd.kgio_tryread_until("\n", 16, "")
+    assert_equal :eof, @rd.kgio_tryread_exactly(5, "")
+    assert_equal :eof, Kgio::ReadBuffer.new(@rd).tryfill
+    assert_equal :eof, Kgio::ReadBuffer.new(@rd).tryread_until("\n", 16)
+    assert_equal :eof, Kgio::ReadBuffer.new(@rd).tryread_exactly(5)
+    assert_nil @rd.kgio_read_until("\n", 16, "")
+    assert_nil Kgio::ReadBuffer.new(@rd).fill
+  end
+
+  def test_framed_econnreset
+    srv = Kgio::TCPServer.new("127.0.0.1", 0)
+    c = reset_client(srv, true)
+    assert_equal :econnreset, c.kgio_tryread_until("\n", 9, "")
+    c = reset_client(srv, true)
+    assert_equal :econnreset, c.kgio_tryread_exactly(9, "")
+    rbuf = Kgio::ReadBuffer.new(reset_client(srv, true))
+    assert_equal :econnreset, rbuf.tryfill
+
+    err = assert_raises(Errno::ECONNRESET) do
+      reset_client(srv).kgio_read_until("\n", 9, "")
+    end
+    assert_equal [], err.backtrace
+    assert_match(/ - recv\z/, err.message)
+    rbuf = Kgio::ReadBuffer.new(reset_client(srv))
+    err = assert_raises(Errno::ECONNRESET) { rbuf.fill }
+    assert_equal [], err.backtrace
+    assert_match(/ - recv\z/, err.message)
+    err = assert_raises(Errno::ECONNRESET) do
+      reset_client(srv).kgio_read_exactly(9)
+    end
+    assert_equal [], err.backtrace
+  ensure
+    @clients.each { |io| io.close } if @clients
+    srv.close if srv
+  end
+
+  def reset_client(srv, try_symbols = false)
+    client = Kgio::TCPSocket.new("127.0.0.1", srv.addr[1])
+    client.kgio_try_symbols = try_symbols
+    (@clients ||= []) << client
+    accepted = srv.kgio_accept
+    linger = [ 1, 0 ].pack("ii")
+    accepted.setsockopt(Socket::SOL_SOCKET, Socket::SO_LINGER, linger)
+    accepted.close
+    sleep 0.01
+    client
+  end
+
+  def test_trywrite_epipe
+    @rd.close
+    @wr.kgio_try_symbols = true
+    assert_equal :epipe, @wr.kgio_trywrite("HELLO")
+    assert_equal :epipe, @wr.kgio_trywritev([ "HELLO" ])
+    assert_raises(Errno::EPIPE) { @wr.kgio_write("HELLO") }
+  end
+
+  def test_tryread_econnreset
+    srv = Kgio::TCPServer.new("127.0.0.1", 0)
+    client = Kgio::TCPSocket.new("127.0.0.1", srv.addr[1])
+    accepted = srv.kgio_accept
+    linger = [ 1, 0 ].pack("ii")
+    accepted.setsockopt(Socket::SOL_SOCKET, Socket::SO_LINGER, linger)
+    accepted.close
+    sleep 0.01
+    client.kgio_try_symbols = true
+    assert_equal :econnreset, client.kgio_tryread(5)
+  ensure
+    [ srv, client ].each { |io| io.close if io && ! io.closed? }
+  end
+
+  def test_start_econnrefused
+    path = "/tmp/kgio_try_symbols_#{$$}_#{rand}"
+    UNIXServer.new(path).close
+    assert_raises(Errno::ECONNREFUSED) { Kgio::UNIXSocket.start(path) }
+    opts = { :try_symbols => true }
+    assert_equal :econnrefused, Kgio::UNIXSocket.start(path, opts)
+    addr = Socket.pack_sockaddr_un(path)
+    assert_equal :econnrefused, Kgio::Socket.start(addr, opts)
+  ensure
+    File.unlink(path) if path && File.exist?(path)
+  end
+
+  def test_start_try_symbols
+    srv = Kgio::TCPServer.new("127.0.0.1", 0)
+    port = srv.addr[1]
+    c = Kgio::TCPSocket.start("127.0.0.1", port, :try_symbols => true)
+    assert_equal true, c.kgio_try_symbols?
+    c.close
+    c = Kgio::TCPSocket.start("127.0.0.1", port)
+    assert_equal false, c.kgio_try_symbols?
+  ensure
+    [ srv, c ].each { |io| io.close if io && ! io.closed? }
+  end
+
+  def test_preallocated_errors
+    @wr.close
+    errs = (1..2).map do
+      begin
+        @rd.kgio_read!(5)
+      rescue EOFError => e
+        e
+      end
+    end
+    assert_equal [ [], [] ], errs.map { |e| e.backtrace }
+    assert ! errs[0].equal?(errs[1])
+    assert ! errs[0].frozen?
+
+    err = begin
+      begin
+        raise "outer"
+      rescue
+        @rd.kgio_read!(5)
+      end
+    rescue EOFError => e
+      e
+    end
+    assert_equal "outer", err.cause.message if err.respond_to?(:cause)
+    assert_nil errs[0].cause if errs[0].respond_to?(:cause)
+  end
+
+  def test_preallocated_epipe
+    @rd.close
+    err = assert_raises(Errno::EPIPE) { @wr.kgio_write("HELLO") }
+    assert_equal [], err.backtrace
+    assert_equal Errno::EPIPE::Errno, err.errno
+    assert_match(/ - (send|write)\z/, err.message)
+  end
+
+  def test_preallocated_econnreset
+    a, b = Kgio::UNIXSocket.pair
+    b.kgio_write "HELLO"
+    a.setsockopt(Socket::SOL_SOCKET, Socket::SO_LINGER, [ 1, 0 ].pack("ii"))
+    a.close
+    err = assert_raises(Errno::ECONNRESET) { loop { b.kgio_read(5) } }
+    assert_equal [], err.backtrace
+    assert_match(/ - (recv|read)\z/, err.message)
+  ensure
+    b.close if b
+  end
+end
@@ -0,0 +1,69 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestTryreadMany < Test::Unit::TestCase
+  def setup
+    @pairs = (1..3).map { Kgio::UNIXSocket.pair }
+    @pipe = Kgio::Pipe.new
+  end
+
+  def teardown
+    (@pairs + [ @pipe ]).flatten.each { |io| io.close unless io.closed? }
+  end
+
+  def test_tryread_many
+    @pairs[0][1].kgio_write "HELLO"
+    @pairs[2][1].close
+    @pipe[1].kgio_write "PIPE"
+    ios = @pairs.map { |pair| pair[0] } << @pipe[0]
+    rv = Kgio.tryread_many(ios, 16)
+    assert_equal [ "HELLO", Kgio::WaitReadable, nil, "PIPE" ], rv
+  end
+
+  def test_tryread_many_closed
+    @pairs[0][1].kgio_write "HELLO"
+    @pairs[2][1].kgio_write "WORLD"
+    @pairs[1][0].close
+    ios = @pairs.map { |pair| pair[0] }
+    rv = Kgio.tryread_many(ios, 16)
+    assert_equal "HELLO", rv[0]
+    assert_kind_of IOError, rv[1]
+    assert_equal "WORLD", rv[2]
+  end
+
+  def test_tryread_many_buffers
+    @pairs[0][1].kgio_write "HELLO"
+    ios = @pairs.map { |pair| pair[0] }
+    bufs = [ "", nil, "hello world" ]
+    rv = Kgio.tryread_many(ios, 16, bufs)
+    assert_equal bufs[0].object_id, rv[0].object_id
+    assert_equal "HELLO", bufs[0]
+    assert_equal Kgio::WaitReadable, rv[1]
+    assert_equal Kgio::WaitReadable, rv[2]
+    assert_equal "", bufs[2]
+  end
+
+  def test_tryread_many_result
+    @pairs[0][1].kgio_write "HELLO"
+    ios = @pairs.map { |pair| pair[0] }
+    result = [ :stale ] * 5
+    rv = Kgio.tryread_many(ios, 16, nil, result)
+    assert_same result, rv
+    assert_equal [ "HELLO", Kgio::WaitReadable, Kgio::WaitReadable ], rv
+    assert_same result, Kgio.tryread_many(ios[0, 1], 16, nil, result)
+    assert_equal [ Kgio::WaitReadable ], result
+    assert_raises(ArgumentError) { Kgio.tryread_many(ios, 16, nil, ios) }
+  end
+
+  def test_tryread_many_error
+    @pairs[1][1].kgio_write "OK"
+    rv = Kgio.tryread_many([ @pipe[1], @pairs[1][0] ], 16)
+    assert_kind_of Errno::EBADF, rv[0]
+    assert_equal "OK", rv[1]
+  end
+
+  def test_tryread_many_empty
+    assert_equal [], Kgio.tryread_many([], 16)
+  end
+end
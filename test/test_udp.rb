@@ -0,0 +1,78 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestKgioUDPSocket < Test::Unit::TestCase
+  def setup
+    @host = ENV["TEST_HOST"] || '127.0.0.1'
+    @srv = Kgio::UDPSocket.new
+    @srv.bind(@host, 0)
+    @cli = Kgio::UDPSocket.new
+    @cli.bind(@host, 0)
+    @srv_addr = Socket.pack_sockaddr_in(@srv.addr[1], @host)
+  end
+
+  def teardown
+    @srv.close unless @srv.closed?
+    @cli.close unless @cli.closed?
+  end
+
+  def test_tryrecvmmsg_empty
+    assert_equal Kgio::WaitReadable, @srv.kgio_tryrecvmmsg(8, 1500)
+  end
+
+  def test_tryrecvmmsg_large
+    assert_equal Kgio::WaitReadable, @srv.kgio_tryrecvmmsg(1024, 65535)
+    assert_equal 1, @cli.kgio_trysendmmsg([ [ "HI", @srv_addr ] ])
+    IO.select([ @srv ])
+    rv = @srv.kgio_tryrecvmmsg(1024, 65535)
+    assert_equal "HI", rv[0][0]
+  end
+
+  def test_roundtrip
+    msgs = (1..50).map { |i| [ "msg#{i}", @srv_addr ] }
+    assert_equal 50, @cli.kgio_trysendmmsg(msgs)
+    got = []
+    until got.size == 50
+      IO.select([ @srv ])
+      rv = @srv.kgio_tryrecvmmsg(32, 1500)
+      assert_kind_of Array, rv
+      assert rv.size <= 32
+      got.concat(rv)
+    end
+    assert_equal msgs.map { |m| m[0] }, got.map { |m| m[0] }
+    port, host = Socket.unpack_sockaddr_in(got[0][1])
+    assert_equal @cli.addr[1], port
+    assert_equal @host, host
+
+    # reply straight back to the senders
+    replies = got.map { |data, addr| [ data.upcase, addr ] }
+    assert_equal 50, @srv.kgio_trysendmmsg(replies)
+    IO.select([ @cli ])
+    rv = @cli.kgio_tryrecvmmsg(1, 1500)
+    assert_equal "MSG1", rv[0][0]
+  end
+
+  def test_truncated
+    assert_equal 1, @cli.kgio_trysendmmsg([ [ "HELLO", @srv_addr ] ])
+    IO.select([ @srv ])
+    assert_equal "HE", @srv.kgio_tryrecvmmsg(4, 2)[0][0]
+  end
+
+  def test_connected
+    @cli.connect(@host, @srv.addr[1])
+    assert_equal 2, @cli.kgio_trysendmmsg(%w(a b))
+    IO.select([ @srv ])
+    sleep 0.1
+    assert_equal %w(a b), @srv.kgio_tryrecvmmsg(4, 1).map { |m| m[0] }
+  end
+
+  def test_bad_args
+    assert_raises(ArgumentError) { @srv.kgio_tryrecvmmsg(0, 1) }
+    assert_raises(ArgumentError) { @srv.kgio_tryrecvmmsg(1, -1) }
+    assert_raises(ArgumentError) { @srv.kgio_tryrecvmmsg(1, 65536) }
+    assert_raises(ArgumentError) { @srv.kgio_tryrecvmmsg(1024, 1 << 62) }
+    assert_raises(TypeError) { @cli.kgio_trysendmmsg([ 1 ]) }
+    assert_equal 0, @cli.kgio_trysendmmsg([])
+  end
+end
@@ -0,0 +1,120 @@
+require 'test/unit'
+require 'io/nonblock'
+$-w = true
+require 'kgio'
+
+module LibWriteQueueTest
+  BLOB = File.open("/dev/urandom") { |fp| fp.read(1024 * 1024) }
+
+  def teardown
+    @rd.close unless @rd.closed?
+    @wr.close unless @wr.closed?
+    Kgio.wait_writable = nil
+  end
+
+  def test_push_flush
+    q = Kgio::WriteQueue.new(@wr)
+    assert q.empty?
+    assert_nil q.tryflush
+    str = "HELLO"
+    assert_same q, q.push(str)
+    q << " " << :WORLD
+    str << "!!!"
+    assert_equal 11, q.bytes
+    assert ! q.empty?
+    assert_nil q.tryflush
+    assert q.empty?
+    assert_equal 0, q.bytes
+    assert_equal "HELLO WORLD", @rd.kgio_read(100)
+    assert_same @wr, q.io
+  end
+
+  def test_tryflush_partial
+    q = Kgio::WriteQueue.new(@wr)
+    q << "HEAD" << BLOB << "TAIL"
+    total = q.bytes
+    assert_equal Kgio::WaitWritable, q.tryflush
+    pending = q.bytes
+    assert pending > 0 && pending < total
+    assert_equal Kgio::WaitWritable, q.tryflush
+    assert_equal pending, q.bytes
+    thr = Thread.new do
+      @rd.nonblock = false
+      @rd.read(total)
+    end
+    assert_nil q.flush
+    assert_equal 0, q.bytes
+    assert_equal "HEAD#{BLOB}TAIL", thr.value
+  end
+
+  def test_many_small
+    q = Kgio::WriteQueue.new(@wr)
+    ary = (0...20000).map { |i| "#{i}," }
+    expect = ary.join
+    ary.each { |s| q << s }
+    thr = Thread.new do
+      @rd.nonblock = false
+      @rd.read(expect.size)
+    end
+    until q.empty?
+      q.tryflush
+      IO.select(nil, [ @wr ]) unless q.empty?
+    end
+    assert_equal expect, thr.value
+  end
+
+  def test_clear
+    q = Kgio::WriteQueue.new(@wr)
+    q << BLOB
+    assert_equal Kgio::WaitWritable, q.tryflush
+    assert q.clear > 0
+    assert q.empty?
+    assert_nil q.tryflush
+  end
+
+  def test_wait_writable_method
+    q = Kgio::WriteQueue.new(@wr)
+    q << BLOB
+    @wr.instance_variable_set(:@nr, 0)
+    def @wr.wait_writable
+      @nr += 1
+      IO.select(nil, [ self ])
+    end
+    Kgio.wait_writable = :wait_writable
+    thr = Thread.new do
+      @rd.nonblock = false
+      @rd.read(BLOB.size)
+    end
+    assert_nil q.flush
+    assert_equal BLOB, thr.value
+    assert @wr.instance_variable_get(:@nr) > 0
+  end
+
+  def test_epipe
+    q = Kgio::WriteQueue.new(@wr)
+    q << "HI"
+    @rd.close
+    begin
+      loop { q << "HI"; q.flush }
+    rescue Errno::EPIPE, Errno::ECONNRESET => e
+      assert_equal [], e.backtrace
+      return
+    end
+  end
+end
+
+class TestPipeWriteQueue < Test::Unit::TestCase
+  include LibWriteQueueTest
+
+  def setup
+    @rd, @wr = Kgio::Pipe.new
+  end
+end
+
+class TestSocketPairWriteQueue < Test::Unit::TestCase
+  include LibWriteQueueTest
+
+  def setup
+    @rd, @wr = Kgio::UNIXSocket.pair
+  end
+end